@@ -0,0 +1,18 @@
+/*****************************************************************************************************\
+ The BMU_SCENARIO bench on the PC: runs the scripted HV sequences in src/scenario_bench.cpp and the
+ receive path fuzz, and prints the same report the bench image prints over serial. Exits non zero if
+ anything failed.
+
+   bench
+\*****************************************************************************************************/
+
+#include "bmu.h"
+
+int scenario_run_bench(bmu_context_t *ctx);
+
+int main(void)
+{
+    static bmu_context_t ctx;
+
+    return scenario_run_bench(&ctx) != 0;
+}
@@ -0,0 +1,246 @@
+"""Run the BMU's receive and fault logic over NumPy columns, through bmu_process_batch() in libbmu.so.
+
+Build the library first with `make -C host libbmu.so`. A whole log goes through in one call, and the
+columns are handed to the library in place when they already have the right type and layout:
+
+    import numpy as np
+    import bmu
+
+    b = bmu.Bmu()                                   # race limits, or bmu.Bmu(bmu.PROFILE_TEST)
+    status = b.process(timestamps_ms, ids, lengths, payloads)
+    over_current = status[:, 0] & 0x01
+
+timestamps_ms and ids are uint32 (set bmu.EXTENDED in ids for extended frames), lengths uint8 and
+payloads uint8 with 8 bytes per frame, shape (n, 8). The result is uint8 of shape (n, 6), the BMU
+status frame after each input frame. A Bmu keeps its state between calls, so a log can be fed in
+pieces; make a new one to start again.
+
+Custom limits are a Config, laid out like bmu_config_t in bmu.h:
+
+    config = bmu.Config.from_profile(bmu.PROFILE_RACE)
+    config.max_discharge_current_ma = 120000
+    b = bmu.Bmu(config)
+
+A Config whose IVT rates (ivt_current_cycle_ms, ivt_cycle_ms) fail the CAN schedule analysis raises
+ValueError, see bmu_batch_config_ok() in bmu_batch.h.
+
+save() and restore() move a Bmu's state in and out as checkpoint bytes, the format in checkpoint.h that
+host/replay and the BMU's shell use too:
+
+    checkpoint = b.save(timestamps_ms[-1])
+    later = bmu.Bmu()
+    uptime_ms = later.restore(checkpoint)           # then feed the frames logged after uptime_ms
+
+Lockstep replays a log through the existing fault engine and the table driven one (fault_engine.h) side
+by side, through bmu_lockstep_batch(), and keeps where their status bits diverged:
+
+    l = bmu.Lockstep()                              # takes a profile or a Config like Bmu
+    l.process(timestamps_ms, ids, lengths, payloads)
+    for time_ms, primary, shadow in l.divergences():
+        print(time_ms, primary.hex(), shadow.hex())
+"""
+
+import ctypes
+import os
+
+import numpy as np
+
+PROFILE_RACE = 0
+PROFILE_CHARGE = 1
+PROFILE_TEST = 2
+
+EXTENDED = 0x80000000
+
+_lib = ctypes.CDLL(os.path.join(os.path.dirname(os.path.abspath(__file__)), "libbmu.so"))
+
+
+class Config(ctypes.Structure):
+    """bmu_config_t, field for field."""
+
+    _fields_ = [
+        ("max_discharge_current_ma", ctypes.c_int),
+        ("max_charge_current_ma", ctypes.c_int),
+        ("max_pack_voltage_mv", ctypes.c_int),
+        ("min_pack_voltage_mv", ctypes.c_int),
+        ("pack_voltage_hysteresis_mv", ctypes.c_int),
+        ("max_ivt_temperature", ctypes.c_int),
+        ("min_ivt_temperature", ctypes.c_int),
+        ("can_timeout_ms", ctypes.c_int),
+        ("ivt_timeout_ms", ctypes.c_int),
+        ("ivt_current_cycle_ms", ctypes.c_int),
+        ("ivt_cycle_ms", ctypes.c_int),
+        ("driver_controls_timeout_ms", ctypes.c_int),
+    ]
+
+    @classmethod
+    def from_profile(cls, profile):
+        """A copy of one of the built in profiles, to change before handing to Bmu."""
+        pointer = _lib.bmu_batch_profile(profile)
+        if not pointer:
+            raise ValueError("no profile %d" % profile)
+        return cls.from_buffer_copy(pointer.contents)
+
+
+LOCKSTEP_LOG_SIZE = 16
+
+
+class Divergence(ctypes.Structure):
+    """lockstep_divergence_t in lockstep.h."""
+
+    _fields_ = [
+        ("time_ms", ctypes.c_uint32),
+        ("primary", ctypes.c_uint8 * 2),
+        ("shadow", ctypes.c_uint8 * 2),
+    ]
+
+
+class LockstepLog(ctypes.Structure):
+    """lockstep_t in lockstep.h, field for field."""
+
+    _fields_ = [
+        ("log", Divergence * LOCKSTEP_LOG_SIZE),
+        ("count", ctypes.c_uint32),
+        ("compares", ctypes.c_uint32),
+        ("started_ms", ctypes.c_uint32),
+        ("confirm_passes", ctypes.c_uint8),
+        ("run", ctypes.c_uint8),
+        ("last", ctypes.c_uint8 * 4),
+    ]
+
+
+_u8 = ctypes.POINTER(ctypes.c_uint8)
+_u32 = ctypes.POINTER(ctypes.c_uint32)
+
+_lib.bmu_batch_context_size.restype = ctypes.c_int
+_lib.bmu_batch_context_size.argtypes = []
+_lib.bmu_batch_profile.restype = ctypes.POINTER(Config)
+_lib.bmu_batch_profile.argtypes = [ctypes.c_int]
+_lib.bmu_batch_config_ok.restype = ctypes.c_bool
+_lib.bmu_batch_config_ok.argtypes = [ctypes.POINTER(Config)]
+_lib.bmu_batch_init.restype = None
+_lib.bmu_batch_init.argtypes = [ctypes.c_void_p, ctypes.c_void_p]
+_lib.bmu_process_batch.restype = ctypes.c_int
+_lib.bmu_process_batch.argtypes = [ctypes.c_void_p, _u32, _u32, _u8, _u8, ctypes.c_int, _u8]
+_lib.bmu_batch_checkpoint_size.restype = ctypes.c_int
+_lib.bmu_batch_checkpoint_size.argtypes = []
+_lib.bmu_batch_save.restype = None
+_lib.bmu_batch_save.argtypes = [ctypes.c_void_p, ctypes.c_uint32, ctypes.c_char_p]
+_lib.bmu_batch_restore.restype = ctypes.c_bool
+_lib.bmu_batch_restore.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_int, ctypes.c_void_p,
+                                   ctypes.POINTER(ctypes.c_uint32)]
+_lib.bmu_batch_lockstep_size.restype = ctypes.c_int
+_lib.bmu_batch_lockstep_size.argtypes = []
+_lib.bmu_lockstep_batch.restype = ctypes.c_int
+_lib.bmu_lockstep_batch.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.POINTER(LockstepLog), _u32, _u32, _u8,
+                                    _u8, ctypes.c_int]
+_lib.lockstep_init.restype = None
+_lib.lockstep_init.argtypes = [ctypes.POINTER(LockstepLog), ctypes.c_uint8]
+
+# The library reads the config through a pointer for as long as the context lives
+assert ctypes.sizeof(Config) == 12 * ctypes.sizeof(ctypes.c_int)
+assert ctypes.sizeof(LockstepLog) == _lib.bmu_batch_lockstep_size()
+
+
+def _column(values, dtype, name, count, width=None):
+    # Only copies if the caller's array isn't already the right type and C contiguous
+    column = np.ascontiguousarray(values, dtype=dtype)
+    shape = (count,) if width is None else (count, width)
+    if column.shape != shape:
+        raise ValueError("%s has shape %s, expected %s" % (name, column.shape, shape))
+    return column
+
+
+def _config_pointer(config):
+    if isinstance(config, Config):
+        if not _lib.bmu_batch_config_ok(ctypes.byref(config)):
+            raise ValueError("IVT rates %d ms and %d ms fail the CAN schedule analysis"
+                             % (config.ivt_current_cycle_ms, config.ivt_cycle_ms))
+        return ctypes.addressof(config)
+    pointer = ctypes.cast(_lib.bmu_batch_profile(config), ctypes.c_void_p).value
+    if not pointer:
+        raise ValueError("no profile %d" % config)
+    return pointer
+
+
+def _columns(timestamps_ms, ids, lengths, payloads):
+    count = len(timestamps_ms)
+    return (count, _column(timestamps_ms, np.uint32, "timestamps_ms", count), _column(ids, np.uint32, "ids", count),
+            _column(lengths, np.uint8, "lengths", count), _column(payloads, np.uint8, "payloads", count, 8))
+
+
+class Bmu:
+    """One BMU context in the library, fed with process()."""
+
+    def __init__(self, config=PROFILE_RACE):
+        self._config = config if isinstance(config, Config) else None
+        self._context = ctypes.create_string_buffer(_lib.bmu_batch_context_size())
+        _lib.bmu_batch_init(self._context, _config_pointer(config))
+
+    def process(self, timestamps_ms, ids, lengths, payloads, status=None):
+        """Run every frame through the BMU, returns the status frame after each as (n, 6) uint8.
+
+        status can be a preallocated (n, 6) uint8 array to fill instead.
+        """
+        count, timestamps_ms, ids, lengths, payloads = _columns(timestamps_ms, ids, lengths, payloads)
+        if status is None:
+            status = np.empty((count, 6), dtype=np.uint8)
+        elif status.dtype != np.uint8 or status.shape != (count, 6) or not status.flags.c_contiguous:
+            raise ValueError("status must be C contiguous uint8 of shape (%d, 6)" % count)
+        if count == 0:
+            return status
+
+        _lib.bmu_process_batch(self._context, timestamps_ms.ctypes.data_as(_u32), ids.ctypes.data_as(_u32),
+                               lengths.ctypes.data_as(_u8), payloads.ctypes.data_as(_u8), count,
+                               status.ctypes.data_as(_u8))
+        return status
+
+    def save(self, now_ms):
+        """The state as of now_ms as checkpoint bytes."""
+        data = ctypes.create_string_buffer(_lib.bmu_batch_checkpoint_size())
+        _lib.bmu_batch_save(self._context, now_ms, data)
+        return data.raw
+
+    def restore(self, data):
+        """Load checkpoint bytes, returns the time in ms they were taken at.
+
+        The Bmu takes the profile the checkpoint was taken with, or its own Config if that wasn't a
+        built in one.
+        """
+        config_pointer = ctypes.addressof(self._config) if self._config is not None else None
+        uptime_ms = ctypes.c_uint32()
+        if not _lib.bmu_batch_restore(self._context, bytes(data), len(data), config_pointer, ctypes.byref(uptime_ms)):
+            raise ValueError("not a checkpoint this build can restore")
+        return uptime_ms.value
+
+
+class Lockstep:
+    """Two BMU contexts, the existing fault engine and the table driven one, fed with process()."""
+
+    def __init__(self, config=PROFILE_RACE):
+        self._config = config if isinstance(config, Config) else None
+        self._primary = ctypes.create_string_buffer(_lib.bmu_batch_context_size())
+        self._shadow = ctypes.create_string_buffer(_lib.bmu_batch_context_size())
+        _lib.bmu_batch_init(self._primary, _config_pointer(config))
+        _lib.bmu_batch_init(self._shadow, _config_pointer(config))
+        self.log = LockstepLog()
+        # Replayed logs have no skew between the two, see lockstep.h
+        _lib.lockstep_init(ctypes.byref(self.log), 1)
+
+    def process(self, timestamps_ms, ids, lengths, payloads):
+        """Run every frame through both engines, returns the number of new divergences."""
+        count, timestamps_ms, ids, lengths, payloads = _columns(timestamps_ms, ids, lengths, payloads)
+        if count == 0:
+            return 0
+        return _lib.bmu_lockstep_batch(self._primary, self._shadow, ctypes.byref(self.log),
+                                       timestamps_ms.ctypes.data_as(_u32), ids.ctypes.data_as(_u32),
+                                       lengths.ctypes.data_as(_u8), payloads.ctypes.data_as(_u8), count)
+
+    def divergences(self):
+        """The divergences still in the log, oldest first, as (time_ms, primary, shadow).
+
+        primary and shadow are the two status bytes the fault engines own (LOCKSTEP_MASK0/1). The log
+        keeps the last LOCKSTEP_LOG_SIZE, log.count has them all.
+        """
+        first = max(0, self.log.count - LOCKSTEP_LOG_SIZE)
+        entries = [self.log.log[n % LOCKSTEP_LOG_SIZE] for n in range(first, self.log.count)]
+        return [(entry.time_ms, bytes(entry.primary), bytes(entry.shadow)) for entry in entries]
@@ -0,0 +1,494 @@
+/*****************************************************************************************************\
+ Simulated CAN bus, see can_sim.h. Host only, like everything in this directory.
+\*****************************************************************************************************/
+
+#include <cstdio>
+#include <cstring>
+
+#include "bmu.h"
+#include "can_ids.h"
+#include "can_sim.h"
+#include "charger.h"
+#include "checkpoint.h"
+#include "ivt_sim.h"
+#include "mbed.h"
+
+#define CAN_SIM_BIT_NS CAN_BIT_TIME_US_X1000
+// Longest stuffable part of a frame: extended header, 8 data bytes and the CRC
+#define CAN_SIM_MAX_FRAME_BITS 128
+#define CAN_SIM_NS_PER_MS 1000000
+// The pack the emulated IVTs measure: at rest, well inside the race limits
+#define CAN_SIM_PACK_MV 60000
+#define CAN_SIM_PACK_TEMPERATURE 250
+
+// In main.cpp, which has no header of its own
+void bmu_context_init(bmu_context_t *ctx, const bmu_config_t *config);
+void bmu_receive(bmu_context_t *ctx, const CANMessage &msg, uint32_t now_ms);
+void bmu_loop(bmu_context_t *ctx, uint32_t now_ms);
+void CANDataSentCallback(void);
+extern bool heartbeat_flag;
+extern bool charger_flag;
+extern checkpoint_ring_t checkpoints;
+extern CAN can;
+
+// Traffic that isn't in the schedule. The MPPTs answer on the bases beat() addresses them at; their
+// traffic isn't ours to schedule, so the rate is a guess at the busy end. The IVT extras only ever come
+// from the emulated IVTs.
+static const can_schedule_msg_t can_sim_extra[CAN_SIM_MPPTS + CAN_SIM_IVT_EXTRAS] = {
+    {0x650, 8, false, 1, 100000, 1000},
+    {0x660, 8, false, 1, 100000, 1000},
+    {0x670, 8, false, 1, 100000, 1000},
+    {IVT_FRONT_BASE_ID + 2, 6, false, 1, IVT_SIM_DEFAULT_CYCLE_MS * 1000, 0},
+    {IVT_FRONT_BASE_ID + 3, 6, false, 1, IVT_SIM_DEFAULT_CYCLE_MS * 1000, 0},
+    {IVT_REAR_BASE_ID + 2, 6, false, 1, IVT_SIM_DEFAULT_CYCLE_MS * 1000, 0},
+    {IVT_REAR_BASE_ID + 3, 6, false, 1, IVT_SIM_DEFAULT_CYCLE_MS * 1000, 0},
+};
+
+static const char *const can_sim_node_names[CAN_SIM_NODES] = {
+    "BMU", "IVT front", "IVT rear", "PCU front", "PCU rear", "controls", "charger", "MPPT",
+};
+
+typedef struct can_sim_frame {
+    uint64_t release_ns;
+    uint32_t id;
+    uint8_t dlc;
+    bool given;                 // data from the sender, random if not
+    uint8_t data[8];
+} can_sim_frame_t;
+
+typedef struct can_sim_message_state {
+    can_sim_frame_t queue[CAN_SIM_QUEUE];   // oldest first from head
+    uint64_t nominal_ns;                    // next release before jitter, UINT64_MAX if not periodic
+    uint8_t head;
+    uint8_t queued;
+} can_sim_message_state_t;
+
+// The nodes that are the real thing with bmu set
+typedef struct can_sim_bmu {
+    bmu_context_t ctx;
+    ivt_sim_t ivts[2];
+} can_sim_bmu_t;
+
+static can_sim_message_state_t can_sim_states[CAN_SIM_MESSAGES];
+static can_sim_bmu_t can_sim_bmu;
+// Where the BMU's writes go, see can_sim_bmu_write()
+static can_sim_result_t *can_sim_result;
+static uint64_t can_sim_now_ns;
+
+const can_schedule_msg_t *can_sim_message(int m)
+{
+    return m < CAN_SCHEDULE_MESSAGES ? &can_schedule[m] : &can_sim_extra[m - CAN_SCHEDULE_MESSAGES];
+}
+
+// The message a frame belongs to: its own ID, or one of a burst sent on consecutive IDs (telemetry)
+static int can_sim_find(uint32_t id, bool extended)
+{
+    for (int m = 0; m < CAN_SIM_MESSAGES; m++)
+    {
+        if (can_sim_message(m)->id == id && can_sim_message(m)->extended == extended)
+            return m;
+    }
+    for (int m = 0; m < CAN_SIM_MESSAGES; m++)
+    {
+        const can_schedule_msg_t *msg = can_sim_message(m);
+        if (msg->extended == extended && id > msg->id && id < msg->id + msg->burst)
+            return m;
+    }
+    return -1;
+}
+
+can_sim_node_t can_sim_sender(uint32_t id)
+{
+    if (id >= (uint32_t)IVT_FRONT_BASE_ID && id < (uint32_t)IVT_FRONT_BASE_ID + 8)
+        return CAN_SIM_IVT_FRONT;
+    if (id >= (uint32_t)IVT_REAR_BASE_ID && id < (uint32_t)IVT_REAR_BASE_ID + 8)
+        return CAN_SIM_IVT_REAR;
+    if (id == (uint32_t)PCU_STATUS_FRONT || id == (uint32_t)CELL_VOLTAGES_BASE_ID || id == (uint32_t)CELL_TEMPERATURES_FRONT_ID)
+        return CAN_SIM_PCU_FRONT;
+    if (id == (uint32_t)PCU_STATUS_REAR || id == (uint32_t)CELL_TEMPERATURES_REAR_ID)
+        return CAN_SIM_PCU_REAR;
+    if (id == (uint32_t)DRIVER_CONTROLS_ID || id == (uint32_t)BMU_PROFILE_ID)
+        return CAN_SIM_DRIVER_CONTROLS;
+    if (id == CHARGER_STATUS_ID)
+        return CAN_SIM_CHARGER;
+    if (id >= can_sim_extra[0].id && id <= can_sim_extra[CAN_SIM_MPPTS - 1].id)
+        return CAN_SIM_MPPT;
+    return CAN_SIM_BMU;
+}
+
+const char *can_sim_node_name(int node)
+{
+    return node >= 0 && node < CAN_SIM_NODES ? can_sim_node_names[node] : "?";
+}
+
+static uint32_t can_sim_random(uint32_t *state)
+{
+    //xorshift32
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+static int can_sim_put_bits(uint8_t *bits, int n, uint32_t value, int count)
+{
+    for (int i = count - 1; i >= 0; i--)
+        bits[n++] = (value >> i) & 1;
+    return n;
+}
+
+/*****************************************************************************************************\
+ Length of one frame on the wire in bits, from start of frame to the end of the interframe space.
+ The stuffed part (start of frame to the end of the CRC) is built bit by bit, so the stuff bits are
+ exactly the ones this payload needs.
+\*****************************************************************************************************/
+int can_sim_frame_bits(uint32_t id, bool extended, const uint8_t *data, uint8_t dlc, int *stuff_bits)
+{
+    uint8_t bits[CAN_SIM_MAX_FRAME_BITS];
+    int n = 0;
+
+    n = can_sim_put_bits(bits, n, 0, 1);                            // start of frame
+    if (extended)
+    {
+        n = can_sim_put_bits(bits, n, (id >> 18) & 0x7FF, 11);
+        n = can_sim_put_bits(bits, n, 0x3, 2);                      // SRR, IDE
+        n = can_sim_put_bits(bits, n, id & 0x3FFFF, 18);
+        n = can_sim_put_bits(bits, n, 0, 3);                        // RTR, r1, r0
+    }
+    else
+    {
+        n = can_sim_put_bits(bits, n, id & 0x7FF, 11);
+        n = can_sim_put_bits(bits, n, 0, 3);                        // RTR, IDE, r0
+    }
+    n = can_sim_put_bits(bits, n, dlc, 4);
+    for (int i = 0; i < dlc; i++)
+        n = can_sim_put_bits(bits, n, data[i], 8);
+
+    uint16_t crc = 0;
+    for (int i = 0; i < n; i++)
+    {
+        bool next = bits[i] ^ ((crc >> 14) & 1);
+        crc = (crc << 1) & 0x7FFF;
+        if (next)
+            crc ^= 0x4599;
+    }
+    n = can_sim_put_bits(bits, n, crc, 15);
+
+    // After five equal bits the transmitter inserts the opposite one, which starts the next run
+    int stuff = 0;
+    int run = 1;
+    uint8_t last = bits[0];
+    for (int i = 1; i < n; i++)
+    {
+        if (bits[i] == last)
+            run++;
+        else
+        {
+            run = 1;
+            last = bits[i];
+        }
+        if (run == 5)
+        {
+            stuff++;
+            last = !last;
+            run = 1;
+        }
+    }
+    if (stuff_bits != NULL)
+        *stuff_bits = stuff;
+    // CRC delimiter, ACK slot and delimiter, end of frame, interframe space
+    return n + stuff + 13;
+}
+
+static void can_sim_queue(int m, uint64_t release_ns, uint32_t id, const uint8_t *data, uint8_t dlc)
+{
+    can_sim_message_state_t *state = &can_sim_states[m];
+    if (state->queued == CAN_SIM_QUEUE)
+    {
+        can_sim_result->messages[m].overruns++;
+        return;
+    }
+    can_sim_frame_t *frame = &state->queue[(state->head + state->queued) % CAN_SIM_QUEUE];
+    frame->release_ns = release_ns;
+    frame->id = id;
+    frame->dlc = dlc;
+    frame->given = data != NULL;
+    if (data != NULL)
+        memcpy(frame->data, data, dlc);
+    state->queued++;
+}
+
+static void can_sim_release(int m, uint64_t release_ns)
+{
+    const can_schedule_msg_t *msg = can_sim_message(m);
+    for (int i = 0; i < msg->burst; i++)
+        can_sim_queue(m, release_ns, msg->id, NULL, msg->dlc);
+}
+
+// Scheduled stand-ins send periodically. The IVT extras never do, and with bmu set neither do the
+// BMU's and the IVTs' messages, the real nodes send those.
+static bool can_sim_periodic(const can_sim_config_t *config, int m)
+{
+    if (m >= CAN_SCHEDULE_MESSAGES + CAN_SIM_MPPTS || (m >= CAN_SCHEDULE_MESSAGES && !config->mppts))
+        return false;
+    can_sim_node_t node = can_sim_sender(can_sim_message(m)->id);
+    return !(config->bmu && (node == CAN_SIM_BMU || node == CAN_SIM_IVT_FRONT || node == CAN_SIM_IVT_REAR));
+}
+
+// A frame the BMU wrote, through the CAN stand-in in mbed.h. It is queued at the time of the pass.
+static void can_sim_bmu_write(const CANMessage &msg)
+{
+    int m = can_sim_find(msg.id, msg.format == CANExtended);
+    if (m < 0)
+    {
+        can_sim_result->unmatched++;
+        return;
+    }
+    can_sim_queue(m, can_sim_now_ns, msg.id, msg.data, msg.len);
+}
+
+static void can_sim_bmu_init(uint32_t *random)
+{
+    const uint32_t bases[2] = {IVT_FRONT_BASE_ID, IVT_REAR_BASE_ID};
+
+    bmu_context_init(&can_sim_bmu.ctx, &bmu_profiles[BMU_PROFILE_RACE]);
+    checkpoint_init(&checkpoints);
+    heartbeat_flag = false;
+    charger_flag = false;
+    can.attach(&CANDataSentCallback, CAN::TxIrq);
+    can.written = can_sim_bmu_write;
+    for (int i = 0; i < 2; i++)
+    {
+        ivt_sim_init(&can_sim_bmu.ivts[i], bases[i], can_sim_random(random));
+        ivt_sim_set_load(&can_sim_bmu.ivts[i], 0, CAN_SIM_PACK_MV, CAN_SIM_PACK_TEMPERATURE);
+        ivt_sim_restart(&can_sim_bmu.ivts[i], can_sim_random(random) % IVT_SIM_DEFAULT_CYCLE_MS);
+    }
+}
+
+// One ms of the real nodes: the IVTs' results that fell due, then a pass of the BMU's main loop
+static void can_sim_bmu_tick(uint32_t now_ms)
+{
+    ivt_sim_frame_t frames[IVT_SIM_MAX_FRAMES];
+
+    for (int i = 0; i < 2; i++)
+    {
+        ivt_sim_t *ivt = &can_sim_bmu.ivts[i];
+        // Not powered up yet
+        if ((int32_t)(now_ms - ivt->restart_ms) < 0)
+            continue;
+        int count = ivt_sim_step(ivt, now_ms, frames);
+        for (int j = 0; j < count; j++)
+        {
+            int m = can_sim_find(frames[j].id, false);
+            if (m < 0)
+                can_sim_result->unmatched++;
+            else
+                can_sim_queue(m, can_sim_now_ns, frames[j].id, frames[j].data, 6);
+        }
+    }
+    // The tickers
+    if (now_ms % HEARTBEAT_PERIOD_MS == 0)
+        heartbeat_flag = true;
+    if (now_ms % CHARGER_FRAME_PERIOD_MS == 0)
+        charger_flag = true;
+    bmu_loop(&can_sim_bmu.ctx, now_ms);
+}
+
+// A frame that made it, to whichever real node takes it
+static void can_sim_bmu_deliver(const can_sim_frame_t *frame, uint32_t now_ms)
+{
+    can_sim_node_t node = can_sim_sender(frame->id);
+
+    if (frame->id == (uint32_t)IVT_CONFIG_ID)
+    {
+        for (int i = 0; i < 2; i++)
+        {
+            if ((int32_t)(now_ms - can_sim_bmu.ivts[i].restart_ms) >= 0)
+                ivt_sim_receive(&can_sim_bmu.ivts[i], frame->id, frame->data, frame->dlc);
+        }
+    }
+    else if (node == CAN_SIM_IVT_FRONT || node == CAN_SIM_IVT_REAR)
+    {
+        CANMessage msg(frame->id, frame->data, frame->dlc);
+        bmu_receive(&can_sim_bmu.ctx, msg, now_ms);
+        can_sim_result->ivt_frames[node == CAN_SIM_IVT_REAR]++;
+    }
+}
+
+void can_sim_run(const can_sim_config_t *config, can_sim_result_t *result)
+{
+    can_sim_message_state_t *states = can_sim_states;
+    uint64_t end_ns = (uint64_t)config->duration_ms * CAN_SIM_NS_PER_MS;
+    uint64_t now_ns = 0;
+    // Next ms the real nodes run at, with bmu set
+    uint64_t tick_ns = config->bmu ? 0 : UINT64_MAX;
+    uint32_t random = config->seed ? config->seed : 1;
+
+    memset(result, 0, sizeof(*result));
+    memset(states, 0, sizeof(can_sim_states));
+    can_sim_result = result;
+    // Nodes power up whenever they like, so every message starts at a random point in its period
+    for (int m = 0; m < CAN_SIM_MESSAGES; m++)
+        states[m].nominal_ns = can_sim_periodic(config, m) ? (uint64_t)(can_sim_random(&random) % can_sim_message(m)->period_us) * 1000 : UINT64_MAX;
+    if (config->bmu)
+        can_sim_bmu_init(&random);
+
+    while (now_ns < end_ns)
+    {
+        for (; tick_ns <= now_ns; tick_ns += CAN_SIM_NS_PER_MS)
+        {
+            can_sim_now_ns = tick_ns;
+            can_sim_bmu_tick((uint32_t)(tick_ns / CAN_SIM_NS_PER_MS));
+        }
+        uint64_t next_release_ns = tick_ns;
+        int winner = -1;
+
+        for (int m = 0; m < CAN_SIM_MESSAGES; m++)
+        {
+            const can_schedule_msg_t *msg = can_sim_message(m);
+            can_sim_message_state_t *state = &states[m];
+            while (state->nominal_ns <= now_ns)
+            {
+                uint64_t jitter_ns = msg->jitter_us ? (uint64_t)(can_sim_random(&random) % (msg->jitter_us + 1)) * 1000 : 0;
+                can_sim_release(m, state->nominal_ns + jitter_ns);
+                state->nominal_ns += (uint64_t)msg->period_us * 1000;
+            }
+            if (state->nominal_ns < next_release_ns)
+                next_release_ns = state->nominal_ns;
+            // Jittered releases aren't due until their time comes
+            if (state->queued == 0 || state->queue[state->head].release_ns > now_ns)
+                continue;
+            if (winner < 0 || can_priority_key(*msg) < can_priority_key(*can_sim_message(winner)))
+                winner = m;
+        }
+
+        if (winner < 0)
+        {
+            // Idle until the next release, including ones held back by jitter
+            for (int m = 0; m < CAN_SIM_MESSAGES; m++)
+            {
+                if (states[m].queued > 0 && states[m].queue[states[m].head].release_ns < next_release_ns)
+                    next_release_ns = states[m].queue[states[m].head].release_ns;
+            }
+            result->elapsed_bits += (next_release_ns - now_ns + CAN_SIM_BIT_NS - 1) / CAN_SIM_BIT_NS;
+            now_ns += (next_release_ns - now_ns + CAN_SIM_BIT_NS - 1) / CAN_SIM_BIT_NS * CAN_SIM_BIT_NS;
+            continue;
+        }
+
+        const can_schedule_msg_t *msg = can_sim_message(winner);
+        can_sim_message_state_t *state = &states[winner];
+        can_sim_stats_t *stats = &result->messages[winner];
+        can_sim_frame_t *frame = &state->queue[state->head];
+        int stuff;
+        if (!frame->given)
+        {
+            for (int i = 0; i < frame->dlc; i++)
+                frame->data[i] = (uint8_t)can_sim_random(&random);
+        }
+        int bits = can_sim_frame_bits(frame->id, msg->extended, frame->data, frame->dlc, &stuff);
+
+        if (config->error_ppm > 0 && can_sim_random(&random) % 1000000 < config->error_ppm)
+        {
+            // Destroyed somewhere before the end of frame, then everyone sends the error frame and the
+            // sender tries again from arbitration
+            int hit = 1 + can_sim_random(&random) % (bits - 13);
+            int lost = hit + CAN_SIM_ERROR_FRAME_BITS;
+            now_ns += (uint64_t)lost * CAN_SIM_BIT_NS;
+            result->elapsed_bits += lost;
+            result->busy_bits += lost;
+            result->error_frames++;
+            stats->errors++;
+            continue;
+        }
+
+        uint64_t release_ns = frame->release_ns;
+        uint64_t queueing_us = (now_ns - release_ns) / 1000;
+        now_ns += (uint64_t)bits * CAN_SIM_BIT_NS;
+        uint64_t response_us = (now_ns - release_ns + 999) / 1000;
+        if (config->bmu)
+            can_sim_bmu_deliver(frame, (uint32_t)(now_ns / CAN_SIM_NS_PER_MS));
+        state->head = (state->head + 1) % CAN_SIM_QUEUE;
+        state->queued--;
+
+        result->elapsed_bits += bits;
+        result->busy_bits += bits;
+        result->stuff_bits += stuff;
+        stats->frames++;
+        stats->total_response_us += response_us;
+        if (response_us > stats->worst_response_us)
+            stats->worst_response_us = (uint32_t)response_us;
+        if (queueing_us > stats->worst_queueing_us)
+            stats->worst_queueing_us = (uint32_t)queueing_us;
+    }
+
+    if (config->bmu)
+    {
+        can.written = NULL;
+        for (int i = 0; i < 2; i++)
+        {
+            result->ivt_restart_ms[i] = can_sim_bmu.ivts[i].restart_ms;
+            result->ivt_configured_ms[i] = can_sim_bmu.ivts[i].configured_ms;
+            result->ivt_configs[i] = can_sim_bmu.ivts[i].configs;
+        }
+        result->bmu_status = can_sim_bmu.ctx.BMU_status_array[0];
+        result->ivt_lost = can_sim_bmu.ctx.ivt_lost;
+    }
+}
+
+/*****************************************************************************************************\
+ Print the measured latencies next to the bound from can_response_time_us(). With check_bounds, every
+ scheduled message must stay inside its bound. Returns the number of messages that didn't, plus any
+ that overran their queue. With bmu set, an IVT the BMU never configured, an IVT the BMU lost and a
+ current or voltage fault on the pack at rest count as one more each. The temperature faults latch on
+ the zero readings from before the first IVT temperature frame, as they do on the car, so they are
+ only printed.
+\*****************************************************************************************************/
+int can_sim_print(const can_sim_config_t *config, const can_sim_result_t *result, bool check_bounds)
+{
+    int failures = 0;
+
+    printf("%-10s %-10s %8s %8s %10s %10s %10s %8s \n", "id", "node", "frames", "errors", "mean us", "worst us", "bound us", "queue us");
+    for (int m = 0; m < CAN_SIM_MESSAGES; m++)
+    {
+        const can_sim_stats_t *stats = &result->messages[m];
+        const can_schedule_msg_t *msg = can_sim_message(m);
+        if (stats->frames == 0 && stats->errors == 0)
+            continue;
+        bool scheduled = m < CAN_SCHEDULE_MESSAGES;
+        uint32_t bound = scheduled ? can_response_time_us(m) : 0;
+        bool failed = stats->overruns > 0 || (check_bounds && scheduled && stats->worst_response_us > bound);
+        printf("0x%-8lx %-10s %8lu %8lu %10lu %10lu %10lu %8lu %s\n", (unsigned long)msg->id, can_sim_node_name(can_sim_sender(msg->id)),
+               (unsigned long)stats->frames, (unsigned long)stats->errors,
+               (unsigned long)(stats->frames ? stats->total_response_us / stats->frames : 0), (unsigned long)stats->worst_response_us,
+               (unsigned long)bound, (unsigned long)stats->worst_queueing_us, failed ? "FAIL" : "");
+        if (failed)
+            failures++;
+    }
+    printf("bus load %lu.%02lu %%, stuff bits %lu.%02lu %% of frame bits, %lu error frames \n",
+           (unsigned long)(result->busy_bits * 100 / result->elapsed_bits),
+           (unsigned long)(result->busy_bits * 10000 / result->elapsed_bits % 100),
+           (unsigned long)(result->stuff_bits * 100 / result->busy_bits),
+           (unsigned long)(result->stuff_bits * 10000 / result->busy_bits % 100), (unsigned long)result->error_frames);
+    if (result->unmatched > 0)
+        printf("%lu frames with IDs the simulation doesn't know, not sent \n", (unsigned long)result->unmatched);
+    if (!config->bmu)
+        return failures;
+
+    for (int i = 0; i < 2; i++)
+    {
+        const char *name = can_sim_node_name(CAN_SIM_IVT_FRONT + i);
+        if (result->ivt_configs[i] == 0)
+        {
+            printf("%s: powered up at %lu ms, never configured FAIL \n", name, (unsigned long)result->ivt_restart_ms[i]);
+            failures++;
+            continue;
+        }
+        printf("%s: powered up at %lu ms, configured %lu ms later, %lu times in all, %lu frames to the BMU \n", name,
+               (unsigned long)result->ivt_restart_ms[i], (unsigned long)(result->ivt_configured_ms[i] - result->ivt_restart_ms[i]),
+               (unsigned long)result->ivt_configs[i], (unsigned long)result->ivt_frames[i]);
+    }
+    // Over current, under and over voltage
+    bool faults = (result->bmu_status & 0x07) != 0;
+    printf("BMU: status 0x%02X%s%s \n", result->bmu_status, result->ivt_lost ? ", IVT lost" : "", faults || result->ivt_lost ? " FAIL" : "");
+    return failures + faults + result->ivt_lost;
+}
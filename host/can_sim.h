@@ -0,0 +1,92 @@
+#ifndef CAN_SIM_H
+#define CAN_SIM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "can_schedule.h"
+
+/*****************************************************************************************************\
+ Simulated CAN bus at CAN_BITRATE, to check can_schedule.h against something closer to the real bus.
+ Every node on the car is an actor sending its messages from can_schedule[] with a random phase and
+ the listed jitter, plus stand-ins for the MPPTs, which aren't in the schedule. When the bus goes idle,
+ the lowest ID waiting anywhere wins arbitration. Each frame is built bit by bit with a random payload
+ and its real CRC, so it is exactly as long as its bit stuffing makes it. With error_ppm set, frames
+ are hit by an error at a random bit, followed by an error frame and a retransmission.
+
+ Messages sent in bursts (config_IVT(), the cell voltages) queue every frame of the burst at once under
+ the schedule's ID. For each message the worst and mean response time (release to end of frame) and
+ queueing delay (release to start of the successful frame) are kept.
+
+ With bmu set, the BMU node is the BMU itself (the sources in src/, built against mbed.h) and the IVT
+ nodes are two emulators (ivt_sim.h) on a pack at rest. The IVTs power up at a random time sending
+ every channel at the factory rate, U2 and U3 included, the BMU configures them over 0x411 when it sees
+ those, and from then on they send at the rates it programmed. The BMU gets every IVT frame as it
+ completes and runs a pass of its main loop every ms, with its tickers' flags set on time, and each
+ frame it writes is queued on the bus there and then. The other nodes stay scheduled stand-ins; their
+ random payloads aren't given to the BMU.
+\*****************************************************************************************************/
+
+// Nodes on the simulated bus
+typedef enum can_sim_node {
+    CAN_SIM_BMU,
+    CAN_SIM_IVT_FRONT,
+    CAN_SIM_IVT_REAR,
+    CAN_SIM_PCU_FRONT,
+    CAN_SIM_PCU_REAR,
+    CAN_SIM_DRIVER_CONTROLS,
+    CAN_SIM_CHARGER,
+    CAN_SIM_MPPT,
+    CAN_SIM_NODES
+} can_sim_node_t;
+
+#define CAN_SIM_MPPTS 3
+// U2 and U3 of each IVT, which config_IVT() turns off, but which run from power up until then
+#define CAN_SIM_IVT_EXTRAS 4
+#define CAN_SIM_MESSAGES (CAN_SCHEDULE_MESSAGES + CAN_SIM_MPPTS + CAN_SIM_IVT_EXTRAS)
+// Releases of one message that can be waiting at once, enough for the longest burst
+#define CAN_SIM_QUEUE 16
+// Error flag, worst case superposition of the other nodes' flags, delimiter and interframe space
+#define CAN_SIM_ERROR_FRAME_BITS 23
+
+typedef struct can_sim_config {
+    uint32_t duration_ms;
+    uint32_t seed;
+    uint32_t error_ppm;         // chance of each frame being hit by an error, per million
+    bool mppts;                 // add the MPPT stand-ins
+    bool bmu;                   // the BMU and emulated IVTs in place of their scheduled traffic
+} can_sim_config_t;
+
+typedef struct can_sim_stats {
+    uint32_t frames;
+    uint32_t errors;            // attempts lost to an error frame
+    uint32_t overruns;          // released with CAN_SIM_QUEUE already waiting, dropped
+    uint32_t worst_response_us;
+    uint32_t worst_queueing_us;
+    uint64_t total_response_us;
+} can_sim_stats_t;
+
+typedef struct can_sim_result {
+    can_sim_stats_t messages[CAN_SIM_MESSAGES];
+    uint64_t elapsed_bits;
+    uint64_t busy_bits;         // frames and error frames
+    uint64_t stuff_bits;
+    uint32_t error_frames;
+    uint32_t unmatched;         // frames sent with an ID no message above has, dropped
+    // With bmu set. IVTs front then rear.
+    uint32_t ivt_restart_ms[2]; // powered up
+    uint32_t ivt_configured_ms[2];
+    uint32_t ivt_configs[2];
+    uint32_t ivt_frames[2];
+    uint8_t bmu_status;         // BMU status byte 0 at the end
+    bool ivt_lost;
+} can_sim_result_t;
+
+const can_schedule_msg_t *can_sim_message(int m);
+can_sim_node_t can_sim_sender(uint32_t id);
+const char *can_sim_node_name(int node);
+int can_sim_frame_bits(uint32_t id, bool extended, const uint8_t *data, uint8_t dlc, int *stuff_bits);
+void can_sim_run(const can_sim_config_t *config, can_sim_result_t *result);
+int can_sim_print(const can_sim_config_t *config, const can_sim_result_t *result, bool check_bounds);
+
+#endif
@@ -0,0 +1,42 @@
+/*****************************************************************************************************\
+ Run the simulated CAN bus (can_sim.h) and compare what it measured with can_schedule.h.
+
+   can_sim [duration s] [seed] [error ppm] [mppts 0/1] [bmu 0/1]
+
+ Without errors, exits non-zero if a scheduled message took longer than its analysed worst case or a
+ sender's queue overflowed. Error frames aren't in the analysis, so with errors the bounds are only
+ printed for comparison. With bmu (the default), the BMU and IVT nodes are the real BMU and emulated
+ IVTs, and it also fails if the BMU didn't configure both IVTs, lost one, or set a current or voltage
+ fault on the pack at rest.
+\*****************************************************************************************************/
+
+#include <cstdio>
+#include <cstdlib>
+
+#include "can_sim.h"
+
+static can_sim_result_t result;
+
+int main(int argc, char **argv)
+{
+    can_sim_config_t config = {60000, 1, 0, true, true};
+
+    if (argc > 1)
+        config.duration_ms = (uint32_t)strtoul(argv[1], NULL, 0) * 1000;
+    if (argc > 2)
+        config.seed = (uint32_t)strtoul(argv[2], NULL, 0);
+    if (argc > 3)
+        config.error_ppm = (uint32_t)strtoul(argv[3], NULL, 0);
+    if (argc > 4)
+        config.mppts = strtoul(argv[4], NULL, 0) != 0;
+    if (argc > 5)
+        config.bmu = strtoul(argv[5], NULL, 0) != 0;
+
+    printf("CAN bus at %d bit/s for %lu s, seed %lu, %lu errors per million frames \n", CAN_BITRATE,
+           (unsigned long)(config.duration_ms / 1000), (unsigned long)config.seed, (unsigned long)config.error_ppm);
+    can_sim_run(&config, &result);
+    int failures = can_sim_print(&config, &result, config.error_ppm == 0);
+    if (failures > 0)
+        printf("%d checks failed \n", failures);
+    return failures > 0;
+}
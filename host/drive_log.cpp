@@ -0,0 +1,51 @@
+/*****************************************************************************************************\
+ Drive log loader, see drive_log.h.
+\*****************************************************************************************************/
+
+#include <cstdio>
+#include <cstdlib>
+
+#include "bmu_batch.h"
+#include "can_ids.h"
+#include "drive_log.h"
+
+bool drive_log_load(const char *path, drive_log_t *log, bool keep_profiles)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+        return false;
+
+    char line[256];
+    int number = 0;
+    log->name = path;
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        unsigned long time_ms, id;
+        unsigned int length;
+        char hex[17] = "";
+        number++;
+        if (line[0] == '#' || line[0] == '\n' || line[0] == '\r')
+            continue;
+        if (sscanf(line, "%lu,%lx,%u,%16[0-9a-fA-F]", &time_ms, &id, &length, hex) < 3 || length > 8)
+        {
+            fprintf(stderr, "%s:%d: not a frame \n", path, number);
+            fclose(file);
+            return false;
+        }
+        if (id == (unsigned long)BMU_PROFILE_ID && !keep_profiles)
+            continue;
+
+        uint8_t payload[8] = {0};
+        for (size_t i = 0; i < 8 && hex[i * 2] != '\0' && hex[i * 2 + 1] != '\0'; i++)
+        {
+            char byte[3] = {hex[i * 2], hex[i * 2 + 1], '\0'};
+            payload[i] = (uint8_t)strtoul(byte, NULL, 16);
+        }
+        log->timestamps_ms.push_back((uint32_t)time_ms);
+        log->ids.push_back((uint32_t)id | (id > 0x7FF ? BMU_BATCH_EXTENDED : 0));
+        log->lengths.push_back((uint8_t)length);
+        log->payloads.insert(log->payloads.end(), payload, payload + 8);
+    }
+    fclose(file);
+    return true;
+}
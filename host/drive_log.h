@@ -0,0 +1,25 @@
+#ifndef DRIVE_LOG_H
+#define DRIVE_LOG_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*****************************************************************************************************\
+ Recorded drive logs for the host tools. CSV, one frame per line: time in ms, ID in hex, DLC, payload
+ in hex. IDs above 0x7FF are extended. Lines starting with # are skipped.
+
+ The log is held as columns, the way bmu_process_batch() takes it.
+\*****************************************************************************************************/
+typedef struct drive_log {
+    std::string name;
+    std::vector<uint32_t> timestamps_ms;
+    std::vector<uint32_t> ids;              // BMU_BATCH_EXTENDED set for extended frames
+    std::vector<uint8_t> lengths;
+    std::vector<uint8_t> payloads;          // 8 bytes per frame
+} drive_log_t;
+
+// BMU_PROFILE_ID frames are dropped unless keep_profiles is set
+bool drive_log_load(const char *path, drive_log_t *log, bool keep_profiles);
+
+#endif
@@ -0,0 +1,143 @@
+/*****************************************************************************************************\
+ Coverage guided fuzzing of the receive path and the main loop, as a libFuzzer target:
+
+   make -C host fuzz_bmu && host/fuzz_bmu corpus/
+
+ Every 12 bytes of input are one frame for bmu_receive() followed by one pass of bmu_loop():
+
+    0       ms since the previous frame
+    1       the ID: an index into fuzz_ids, or past its end for a raw ID from bytes 2 and 3
+    2       low 3 bits added to the ID from fuzz_ids, or the low byte of a raw ID
+    3       DLC in the low 4 bits (mod 9), bit 4 the other frame format, bit 5 remote frame,
+            bit 6 the heartbeat is due, bit 7 the charger frame is due; bits 0-2 are also the high
+            bits of a raw ID
+    4-11    payload
+
+ The invariants (bmu_check_invariants()) must hold after every pass, or the input is reported and
+ the run stops. Each input starts from a context fresh from bmu_context_init(), which is a memset and
+ a few stores, so nothing carries over between inputs.
+
+ libFuzzer comes with clang. Without it, fuzz_bmu_standalone is the same target built with g++ and the
+ address and undefined behaviour sanitizers, with a main() that runs the inputs given as files, or
+ FUZZ_STANDALONE_RUNS random ones if there are none. make -C host check runs it that way.
+\*****************************************************************************************************/
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+#include "bmu.h"
+#include "can_ids.h"
+#include "charger.h"
+#include "checkpoint.h"
+#include "mbed.h"
+
+#define FUZZ_FRAME_BYTES 12
+
+// In main.cpp, which has no header of its own
+void bmu_context_init(bmu_context_t *ctx, const bmu_config_t *config);
+void bmu_receive(bmu_context_t *ctx, const CANMessage &msg, uint32_t now_ms);
+void bmu_loop(bmu_context_t *ctx, uint32_t now_ms);
+int bmu_check_invariants(const bmu_context_t *ctx);
+void CANDataSentCallback(void);
+extern CAN can;
+extern bool heartbeat_flag;
+extern bool charger_flag;
+extern checkpoint_ring_t checkpoints;
+
+// Everything bmu_receive() decodes, so most frames get past the ID switch
+static const uint32_t fuzz_ids[] = {
+    DRIVER_CONTROLS_ID, BMU_PROFILE_ID, CELL_VOLTAGES_BASE_ID, IVT_FRONT_BASE_ID, IVT_REAR_BASE_ID,
+    CELL_TEMPERATURES_FRONT_ID, CELL_TEMPERATURES_REAR_ID, CHARGER_STATUS_ID,
+};
+#define FUZZ_IDS (sizeof(fuzz_ids) / sizeof(fuzz_ids[0]))
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    static bmu_context_t ctx;
+    uint32_t now_ms = 0;
+
+    // As main() does, or every frame bmu_loop() sends waits out the CAN timeout
+    can.attach(&CANDataSentCallback, CAN::TxIrq);
+    bmu_context_init(&ctx, &bmu_profiles[BMU_PROFILE_RACE]);
+    checkpoint_init(&checkpoints);
+    heartbeat_flag = false;
+    charger_flag = false;
+    for (size_t at = 0; at + FUZZ_FRAME_BYTES <= size; at += FUZZ_FRAME_BYTES)
+    {
+        const uint8_t *frame = &data[at];
+        uint32_t id = frame[1] < FUZZ_IDS ? fuzz_ids[frame[1]] + (frame[2] & 0x7) : ((frame[3] & 0x7) << 8) | frame[2];
+        bool extended = (id == CHARGER_STATUS_ID) != ((frame[3] >> 4) & 1);
+        CANMessage msg(id, &frame[4], (frame[3] & 0xF) % 9, (frame[3] & 0x20) ? CANRemote : CANData,
+                       extended ? CANExtended : CANStandard);
+
+        now_ms += frame[0];
+        bmu_receive(&ctx, msg, now_ms);
+        heartbeat_flag = heartbeat_flag || (frame[3] & 0x40);
+        charger_flag = charger_flag || (frame[3] & 0x80);
+        bmu_loop(&ctx, now_ms);
+
+        int broken = bmu_check_invariants(&ctx);
+        if (broken)
+        {
+            fprintf(stderr, "invariants broken after frame %lu (id 0x%lX at %lu ms): 0x%02X \n",
+                    (unsigned long)(at / FUZZ_FRAME_BYTES), (unsigned long)id, (unsigned long)now_ms, broken);
+            abort();
+        }
+    }
+    return 0;
+}
+
+#ifdef FUZZ_STANDALONE
+#ifndef FUZZ_STANDALONE_RUNS
+#define FUZZ_STANDALONE_RUNS 20000
+#endif
+#define FUZZ_STANDALONE_MAX_FRAMES 256
+
+static uint32_t fuzz_random(uint32_t *state)
+{
+    //xorshift32
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+int main(int argc, char **argv)
+{
+    static uint8_t input[FUZZ_STANDALONE_MAX_FRAMES * FUZZ_FRAME_BYTES];
+
+    for (int i = 1; i < argc; i++)
+    {
+        FILE *file = fopen(argv[i], "rb");
+        if (file == NULL)
+        {
+            fprintf(stderr, "can't read %s \n", argv[i]);
+            return 2;
+        }
+        size_t size = fread(input, 1, sizeof(input), file);
+        fclose(file);
+        LLVMFuzzerTestOneInput(input, size);
+    }
+    if (argc > 1)
+        return 0;
+
+    uint32_t state = 0x2545F491;
+    for (int run = 0; run < FUZZ_STANDALONE_RUNS; run++)
+    {
+        size_t size = (fuzz_random(&state) % FUZZ_STANDALONE_MAX_FRAMES + 1) * FUZZ_FRAME_BYTES;
+        for (size_t i = 0; i < size; i++)
+            input[i] = fuzz_random(&state) >> 24;
+        // Mostly IDs from the table, and time moving slowly enough for the timeouts not to fire at once
+        for (size_t i = 0; i < size; i += FUZZ_FRAME_BYTES)
+        {
+            input[i] %= 64;
+            input[i + 1] %= FUZZ_IDS + 1;
+        }
+        LLVMFuzzerTestOneInput(input, size);
+    }
+    printf("fuzz: %d random inputs, invariants held \n", FUZZ_STANDALONE_RUNS);
+    return 0;
+}
+#endif
@@ -0,0 +1,168 @@
+#ifndef HOST_MBED_H
+#define HOST_MBED_H
+
+/*****************************************************************************************************\
+ Just enough of the mbed API for the BMU sources to build and run on a PC (see Makefile). Nothing here
+ touches hardware: pins read 0, flash reads back erased and the tickers never fire. CAN frames written
+ go to CAN::written if a host tool has set it (can_sim puts them on its simulated bus), and nowhere
+ otherwise. They count as sent at once, so the TxIrq handler runs inside write() and can_send()
+ doesn't wait out its timeout. The batch entry points (bmu_batch.h), fuzz_bmu and can_sim take their
+ time from the caller, so the clocks here only have to exist.
+
+ CANMessage is the real thing, as the batch entry points build one per frame.
+\*****************************************************************************************************/
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <sys/types.h>
+
+typedef enum PinName {
+    p5 = 5, p6, p7, p8, p9, p10, p11, p12, p13, p14, p15, p16, p17, p18, p19, p20, p21, p22, p23, p24,
+    p25, p26, p27, p28, p29, p30,
+    LED1 = 100, LED2, LED3, LED4, USBTX, USBRX,
+    NC = -1
+} PinName;
+
+typedef enum PortName { Port0, Port1, Port2, Port3, Port4 } PortName;
+
+namespace mbed {
+
+enum CANFormat { CANStandard = 0, CANExtended = 1, CANAny = 2 };
+enum CANType { CANData = 0, CANRemote = 1 };
+
+struct CANMessage {
+    unsigned int id;
+    unsigned char data[8];
+    unsigned char len;
+    CANFormat format;
+    CANType type;
+
+    CANMessage() : id(0), data(), len(8), format(CANStandard), type(CANData) {}
+    CANMessage(unsigned int _id, const unsigned char *_data, unsigned char _len = 8, CANType _type = CANData,
+               CANFormat _format = CANStandard)
+        : id(_id), data(), len(_len > 8 ? 8 : _len), format(_format), type(_type)
+    {
+        memcpy(data, _data, len);
+    }
+    CANMessage(unsigned int _id, const char *_data, unsigned char _len = 8, CANType _type = CANData,
+               CANFormat _format = CANStandard)
+        : CANMessage(_id, (const unsigned char *)_data, _len, _type, _format) {}
+};
+
+struct CAN {
+    enum IrqType { RxIrq = 0, TxIrq, EwIrq, DoIrq, WuIrq, EpIrq, AlIrq, BeIrq, IdIrq };
+    CAN(PinName rd, PinName td) : sent(NULL), written(NULL) {}
+    int frequency(int hz) { return 1; }
+    int write(CANMessage msg)
+    {
+        if (written)
+            written(msg);
+        if (sent)
+            sent();
+        return 1;
+    }
+    int read(CANMessage &msg, int handle = 0) { return 0; }
+    template <class F> void attach(F func, IrqType type = RxIrq)
+    {
+        if (type == TxIrq)
+            sent = func;
+    }
+    unsigned char rderror(void) { return 0; }
+    unsigned char tderror(void) { return 0; }
+    void reset(void) {}
+    void (*sent)(void);
+    void (*written)(const CANMessage &msg);     // not mbed, see above
+};
+
+struct DigitalIn {
+    DigitalIn(PinName pin) {}
+    int read(void) { return 0; }
+    operator int() { return 0; }
+};
+
+struct PortOut {
+    PortOut(PortName port, int mask = 0xFFFFFFFF) : value(0), mask(mask) {}
+    void write(int v) { value = v & mask; }
+    int read(void) { return value; }
+    PortOut &operator=(int v) { write(v); return *this; }
+    int value;
+    int mask;
+};
+
+struct Ticker {
+    template <class F, class D> void attach(F func, D interval) {}
+    void detach(void) {}
+};
+
+struct Timer {
+    Timer() : running(false), start_time(), total(0) {}
+    void start(void)
+    {
+        if (!running)
+            start_time = std::chrono::steady_clock::now();
+        running = true;
+    }
+    void stop(void)
+    {
+        total = elapsed_time();
+        running = false;
+    }
+    void reset(void)
+    {
+        start_time = std::chrono::steady_clock::now();
+        total = std::chrono::microseconds(0);
+    }
+    std::chrono::microseconds elapsed_time(void) const
+    {
+        if (!running)
+            return total;
+        return total + std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start_time);
+    }
+    bool running;
+    std::chrono::steady_clock::time_point start_time;
+    std::chrono::microseconds total;
+};
+
+struct FlashIAP {
+    int init(void) { return 0; }
+    int deinit(void) { return 0; }
+    int read(void *buffer, uint32_t addr, uint32_t size) { memset(buffer, 0xFF, size); return 0; }
+    int program(const void *buffer, uint32_t addr, uint32_t size) { return 0; }
+    int erase(uint32_t addr, uint32_t size) { return 0; }
+    uint32_t get_sector_size(uint32_t addr) const { return 32768; }
+    uint32_t get_flash_start(void) const { return 0; }
+    uint32_t get_flash_size(void) const { return 0x80000; }
+    uint32_t get_page_size(void) const { return 256; }
+    uint8_t get_erase_value(void) const { return 0xFF; }
+};
+
+struct FileHandle {
+    virtual ~FileHandle() {}
+};
+
+FileHandle *mbed_override_console(int fd);
+
+struct BufferedSerial : FileHandle {
+    BufferedSerial(PinName tx, PinName rx, int baud = 9600) {}
+    ssize_t read(void *buffer, size_t length) { return 0; }
+    ssize_t write(const void *buffer, size_t length) { return length; }
+    bool readable(void) { return false; }
+    template <class F> void sigio(F func) {}
+};
+
+} // namespace mbed
+
+using namespace mbed;
+
+// One BMU context per thread on the host, so there is nothing to lock out
+inline void core_util_critical_section_enter(void) {}
+inline void core_util_critical_section_exit(void) {}
+inline uint32_t core_util_atomic_incr_u32(volatile uint32_t *value, uint32_t delta)
+{
+    return *value += delta;
+}
+
+#endif
@@ -0,0 +1,200 @@
+/*****************************************************************************************************\
+ Replays a drive log through the BMU (bmu_process_batch()) and prints the time and BMU status byte 0 at
+ every change, as CSV. Checkpoints let a fault late in a drive be reached without replaying all of it:
+
+   replay [-p race|charge|test] [-s period_ms prefix] [-r checkpoint] [-l] log.csv
+
+   -s   write a checkpoint to <prefix><uptime_ms>.bmu every period_ms of log time
+   -r   start from a checkpoint instead of power up, and replay only the frames logged after it. The
+        file is one written by -s, or a line printed by the shell's checkpoint command.
+   -l   run the table driven fault engine in lockstep with the existing one (bmu_lockstep_batch()) and
+        print where they diverged instead of the status. Exits 1 if they did.
+
+ The profile (race by default) is the one a log starts with, and the config of a checkpoint that was
+ taken with a config that isn't built in. Profile frames in the log are kept, so the limits change
+ where they did in the car. Logs are in the drive_log.h format.
+\*****************************************************************************************************/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "bmu_batch.h"
+#include "drive_log.h"
+
+static void replay_usage(void)
+{
+    fprintf(stderr, "usage: replay [-p race|charge|test] [-s period_ms prefix] [-r checkpoint] [-l] log.csv \n");
+}
+
+// A checkpoint file, binary or the hex line from the shell
+static bool replay_read_checkpoint(const char *path, std::vector<uint8_t> *data)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+        return false;
+    std::vector<char> bytes;
+    char buffer[4096];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        bytes.insert(bytes.end(), buffer, buffer + n);
+    fclose(file);
+
+    static const char shell_prefix[] = "checkpoint ";
+    if (bytes.size() < sizeof(shell_prefix) || memcmp(bytes.data(), shell_prefix, sizeof(shell_prefix) - 1) != 0)
+    {
+        data->assign(bytes.begin(), bytes.end());
+        return true;
+    }
+    bytes.push_back('\0');
+    const char *hex = strchr(bytes.data(), ':');
+    if (hex == NULL)
+        return false;
+    for (hex++; *hex == ' '; hex++)
+        ;
+    for (; hex[0] != '\0' && hex[1] != '\0' && hex[0] != '\n' && hex[0] != '\r'; hex += 2)
+    {
+        char byte[3] = {hex[0], hex[1], '\0'};
+        data->push_back((uint8_t)strtoul(byte, NULL, 16));
+    }
+    return true;
+}
+
+static bool replay_write_checkpoint(const char *prefix, const bmu_context_t *ctx, uint32_t now_ms)
+{
+    std::vector<uint8_t> data(bmu_batch_checkpoint_size());
+    char path[1024];
+
+    bmu_batch_save(ctx, now_ms, data.data());
+    snprintf(path, sizeof(path), "%s%lu.bmu", prefix, (unsigned long)now_ms);
+    FILE *file = fopen(path, "wb");
+    if (file == NULL)
+        return false;
+    bool written = fwrite(data.data(), 1, data.size(), file) == data.size();
+    return fclose(file) == 0 && written;
+}
+
+int main(int argc, char **argv)
+{
+    static const char *const profile_names[] = {"race", "charge", "test"};
+    const bmu_config_t *config = bmu_batch_profile(0);
+    uint32_t save_period_ms = 0;
+    const char *save_prefix = NULL;
+    const char *restore_path = NULL;
+    const char *log_path = NULL;
+    bool lockstep = false;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+        {
+            config = NULL;
+            for (int p = 0; p < 3; p++)
+                if (strcmp(argv[i + 1], profile_names[p]) == 0)
+                    config = bmu_batch_profile(p);
+            i++;
+            if (config == NULL)
+            {
+                replay_usage();
+                return 2;
+            }
+        }
+        else if (strcmp(argv[i], "-s") == 0 && i + 2 < argc)
+        {
+            save_period_ms = strtoul(argv[i + 1], NULL, 0);
+            save_prefix = argv[i + 2];
+            i += 2;
+            if (save_period_ms == 0)
+            {
+                replay_usage();
+                return 2;
+            }
+        }
+        else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+            restore_path = argv[++i];
+        else if (strcmp(argv[i], "-l") == 0)
+            lockstep = true;
+        else if (log_path == NULL && argv[i][0] != '-')
+            log_path = argv[i];
+        else
+        {
+            replay_usage();
+            return 2;
+        }
+    }
+    if (log_path == NULL || (lockstep && save_prefix != NULL))
+    {
+        replay_usage();
+        return 2;
+    }
+
+    drive_log_t log;
+    if (!drive_log_load(log_path, &log, true))
+    {
+        fprintf(stderr, "can't read %s \n", log_path);
+        return 2;
+    }
+    int count = (int)log.ids.size();
+
+    bmu_context_t *ctx = (bmu_context_t *)malloc(bmu_batch_context_size());
+    bmu_batch_init(ctx, config);
+    int start = 0;
+    if (restore_path != NULL)
+    {
+        std::vector<uint8_t> data;
+        uint32_t uptime_ms;
+        if (!replay_read_checkpoint(restore_path, &data)
+            || !bmu_batch_restore(ctx, data.data(), (int)data.size(), config, &uptime_ms))
+        {
+            fprintf(stderr, "%s isn't a checkpoint this build can restore \n", restore_path);
+            return 2;
+        }
+        while (start < count && log.timestamps_ms[start] <= uptime_ms)
+            start++;
+    }
+
+    if (lockstep)
+    {
+        // The shadow starts from the same state, so only the engines can make them differ
+        bmu_context_t *shadow = (bmu_context_t *)malloc(bmu_batch_context_size());
+        lockstep_t divergences;
+        memcpy(shadow, ctx, bmu_batch_context_size());
+        lockstep_init(&divergences, 1);
+        if (start < count)
+            bmu_lockstep_batch(ctx, shadow, &divergences, &log.timestamps_ms[start], &log.ids[start], &log.lengths[start],
+                               &log.payloads[start * 8], count - start);
+        lockstep_print(&divergences);
+        free(shadow);
+        free(ctx);
+        return divergences.count != 0;
+    }
+
+    uint8_t status[6];
+    int previous = restore_path != NULL ? (uint8_t)ctx->BMU_status_array[0] : -1;
+    uint32_t next_save_ms = start < count ? log.timestamps_ms[start] + save_period_ms : 0;
+    printf("time_ms,status\n");
+    for (int i = start; i < count; i++)
+    {
+        // Only between frames with different times, so a restore knows where to pick up
+        uint32_t last_ms = i > start ? log.timestamps_ms[i - 1] : 0;
+        if (save_prefix != NULL && i > start && log.timestamps_ms[i] != last_ms && last_ms >= next_save_ms)
+        {
+            if (!replay_write_checkpoint(save_prefix, ctx, last_ms))
+            {
+                fprintf(stderr, "can't write a checkpoint to %s \n", save_prefix);
+                return 2;
+            }
+            while (next_save_ms <= last_ms)
+                next_save_ms += save_period_ms;
+        }
+        bmu_process_batch(ctx, &log.timestamps_ms[i], &log.ids[i], &log.lengths[i], &log.payloads[i * 8], 1, status);
+        if (status[0] != previous)
+        {
+            printf("%lu,0x%02X\n", (unsigned long)log.timestamps_ms[i], status[0]);
+            previous = status[0];
+        }
+    }
+    free(ctx);
+    return 0;
+}
@@ -0,0 +1,149 @@
+/*****************************************************************************************************\
+ Checks that a checkpoint carries everything the BMU needs to carry on. A two minute drive is made up
+ with the IVT emulator (ivt_sim.h): ignition on, healthy packs, then the front current ramps past the
+ discharge limit. It is run straight through, and again from a checkpoint taken half way that has been
+ through a file. From the checkpoint on, the two runs must give the same status frame after every
+ frame and end in the same state. A checkpoint with a byte flipped must be refused.
+
+   replay_test
+\*****************************************************************************************************/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "bmu_batch.h"
+#include "can_ids.h"
+#include "drive_log.h"
+#include "ivt_sim.h"
+
+#define REPLAY_TEST_MS 120000
+#define REPLAY_TEST_STEP_MS 5
+#define REPLAY_TEST_RAMP_MS 60000
+#define REPLAY_TEST_PEAK_MA 200000
+
+static void replay_test_add(drive_log_t *log, uint32_t time_ms, uint32_t id, const uint8_t *data, uint8_t length)
+{
+    uint8_t payload[8] = {0};
+
+    memcpy(payload, data, length);
+    log->timestamps_ms.push_back(time_ms);
+    log->ids.push_back(id);
+    log->lengths.push_back(length);
+    log->payloads.insert(log->payloads.end(), payload, payload + 8);
+}
+
+static void replay_test_drive(drive_log_t *log)
+{
+    const uint32_t bases[2] = {IVT_FRONT_BASE_ID, IVT_REAR_BASE_ID};
+    ivt_sim_t sims[2];
+    ivt_sim_frame_t frames[IVT_SIM_MAX_FRAMES];
+
+    for (int i = 0; i < 2; i++)
+        ivt_sim_init(&sims[i], bases[i], i + 1);
+    for (uint32_t now = 0; now < REPLAY_TEST_MS; now += REPLAY_TEST_STEP_MS)
+    {
+        if (now % DRIVER_CONTROLS_PERIOD_MS == 0)
+        {
+            const uint8_t ignition = 0x01;
+            replay_test_add(log, now, DRIVER_CONTROLS_ID, &ignition, 1);
+        }
+        int32_t current = now < REPLAY_TEST_RAMP_MS ? 0
+                          : (int32_t)((int64_t)REPLAY_TEST_PEAK_MA * (now - REPLAY_TEST_RAMP_MS) / (REPLAY_TEST_MS - REPLAY_TEST_RAMP_MS));
+        for (int i = 0; i < 2; i++)
+        {
+            ivt_sim_set_load(&sims[i], i == 0 ? current : current / 2, 60000, 250);
+            int count = ivt_sim_step(&sims[i], now, frames);
+            for (int j = 0; j < count; j++)
+                replay_test_add(log, now, frames[j].id, frames[j].data, 6);
+        }
+    }
+}
+
+static bool replay_test_through_file(const std::vector<uint8_t> &data, std::vector<uint8_t> *read)
+{
+    FILE *file = tmpfile();
+    if (file == NULL)
+        return false;
+    bool ok = fwrite(data.data(), 1, data.size(), file) == data.size();
+    rewind(file);
+    read->resize(data.size());
+    ok = ok && fread(read->data(), 1, read->size(), file) == read->size();
+    fclose(file);
+    return ok;
+}
+
+int main(void)
+{
+    drive_log_t log;
+    int size = bmu_batch_checkpoint_size();
+    int failures = 0;
+
+    replay_test_drive(&log);
+    int count = (int)log.ids.size();
+    int half = count / 2;
+    // Checkpoints go between frames with different times
+    while (half + 1 < count && log.timestamps_ms[half + 1] == log.timestamps_ms[half])
+        half++;
+
+    bmu_context_t *straight = (bmu_context_t *)calloc(1, bmu_batch_context_size());
+    bmu_context_t *restored = (bmu_context_t *)calloc(1, bmu_batch_context_size());
+    std::vector<uint8_t> status(count * 6), replayed(count * 6);
+    std::vector<uint8_t> checkpoint(size), read;
+
+    bmu_batch_init(straight, bmu_batch_profile(0));
+    bmu_process_batch(straight, &log.timestamps_ms[0], &log.ids[0], &log.lengths[0], &log.payloads[0], half + 1, &status[0]);
+    bmu_batch_save(straight, log.timestamps_ms[half], checkpoint.data());
+    bmu_process_batch(straight, &log.timestamps_ms[half + 1], &log.ids[half + 1], &log.lengths[half + 1],
+                      &log.payloads[(half + 1) * 8], count - half - 1, &status[(half + 1) * 6]);
+
+    uint32_t uptime_ms;
+    if (!replay_test_through_file(checkpoint, &read) || !bmu_batch_restore(restored, read.data(), size, NULL, &uptime_ms))
+    {
+        printf("replay: checkpoint at %lu ms didn't restore \n", (unsigned long)log.timestamps_ms[half]);
+        return 1;
+    }
+    if (uptime_ms != log.timestamps_ms[half])
+    {
+        printf("replay: checkpoint says %lu ms, taken at %lu ms \n", (unsigned long)uptime_ms, (unsigned long)log.timestamps_ms[half]);
+        failures++;
+    }
+    bmu_process_batch(restored, &log.timestamps_ms[half + 1], &log.ids[half + 1], &log.lengths[half + 1],
+                      &log.payloads[(half + 1) * 8], count - half - 1, &replayed[(half + 1) * 6]);
+
+    for (int i = half + 1; i < count; i++)
+    {
+        if (memcmp(&status[i * 6], &replayed[i * 6], 6) != 0)
+        {
+            printf("replay: status differs at %lu ms, frame %d \n", (unsigned long)log.timestamps_ms[i], i);
+            failures++;
+            break;
+        }
+    }
+    // Without a fault after the checkpoint there would be nothing to reproduce
+    if ((status[half * 6] & 0x01) || !(status[(count - 1) * 6] & 0x01))
+    {
+        printf("replay: over current didn't trip after the checkpoint \n");
+        failures++;
+    }
+    std::vector<uint8_t> end_straight(size), end_restored(size);
+    bmu_batch_save(straight, REPLAY_TEST_MS, end_straight.data());
+    bmu_batch_save(restored, REPLAY_TEST_MS, end_restored.data());
+    if (end_straight != end_restored || memcmp(straight, restored, bmu_batch_context_size()) != 0)
+    {
+        printf("replay: state differs at the end \n");
+        failures++;
+    }
+    read[size / 2] ^= 0x01;
+    if (bmu_batch_restore(restored, read.data(), size, NULL, &uptime_ms))
+    {
+        printf("replay: corrupt checkpoint restored \n");
+        failures++;
+    }
+
+    printf("replay: %d frames, checkpoint at %lu ms, %d failures \n", count, (unsigned long)log.timestamps_ms[half], failures);
+    free(straight);
+    free(restored);
+    return failures != 0;
+}
@@ -0,0 +1,338 @@
+/*****************************************************************************************************\
+ Parameter sweep over recorded drive logs. Every combination of the swept config values is run against
+ every log through bmu_process_batch(), spread over worker threads, and one row per (grid point, log)
+ is printed as CSV: how many times each fault tripped and when it first did.
+
+   sweep [-j threads] [-p race|charge|test] [field=values ...] log.csv ...
+
+ Fields are the bmu_config_t members (limits, hysteresis, timeouts, IVT rates); values are a comma
+ separated list or start:stop:step. Unswept fields keep the base profile's value (race by default).
+ Grid points whose IVT rates fail the CAN schedule analysis (bmu_batch_config_ok()) are skipped with a
+ note on stderr, and have no rows.
+
+ Logs are in the drive_log.h format. BMU_PROFILE_ID frames are dropped, they would swap the grid
+ point's config for a built in one.
+
+ Jobs are dealt out round robin to per worker deques up front. A worker takes from the back of its own
+ and, once that is empty, steals from the front of the others', so a few long logs don't leave the
+ other workers idle at the end.
+\*****************************************************************************************************/
+
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bmu_batch.h"
+#include "can_ids.h"
+#include "drive_log.h"
+
+#define SWEEP_FAULTS 5
+// Frames handed to bmu_process_batch() at a time, bounds the status buffer
+#define SWEEP_CHUNK 4096
+
+typedef struct sweep_field {
+    const char *name;
+    size_t offset;
+} sweep_field_t;
+
+#define SWEEP_FIELD(name) {#name, offsetof(bmu_config_t, name)}
+static const sweep_field_t sweep_fields[] = {
+    SWEEP_FIELD(max_discharge_current_ma),
+    SWEEP_FIELD(max_charge_current_ma),
+    SWEEP_FIELD(max_pack_voltage_mv),
+    SWEEP_FIELD(min_pack_voltage_mv),
+    SWEEP_FIELD(pack_voltage_hysteresis_mv),
+    SWEEP_FIELD(max_ivt_temperature),
+    SWEEP_FIELD(min_ivt_temperature),
+    SWEEP_FIELD(can_timeout_ms),
+    SWEEP_FIELD(ivt_timeout_ms),
+    SWEEP_FIELD(ivt_current_cycle_ms),
+    SWEEP_FIELD(ivt_cycle_ms),
+    SWEEP_FIELD(driver_controls_timeout_ms),
+};
+#define SWEEP_FIELDS (int)(sizeof(sweep_fields) / sizeof(sweep_fields[0]))
+
+// Status byte 0 bits 0-4, see update_BMU_status_array()
+static const char *const sweep_fault_names[SWEEP_FAULTS] = {
+    "over_current", "under_voltage", "over_voltage", "under_temperature", "over_temperature",
+};
+
+typedef struct sweep_axis {
+    int field;
+    std::vector<int> values;
+} sweep_axis_t;
+
+typedef struct sweep_result {
+    uint32_t frames;
+    uint32_t trips[SWEEP_FAULTS];
+    int64_t first_trip_ms[SWEEP_FAULTS];        // from the first frame of the log, -1 if never
+    int64_t unsafe_ms;                          // first time safe to drive was lost after being set
+    double ns_per_frame;
+} sweep_result_t;
+
+typedef struct sweep_job {
+    int point;
+    int log;
+} sweep_job_t;
+
+typedef struct sweep_worker {
+    std::mutex lock;
+    std::deque<sweep_job_t> jobs;
+} sweep_worker_t;
+
+static int sweep_find_field(const char *name, size_t length)
+{
+    for (int i = 0; i < SWEEP_FIELDS; i++)
+    {
+        if (strlen(sweep_fields[i].name) == length && strncmp(sweep_fields[i].name, name, length) == 0)
+            return i;
+    }
+    return -1;
+}
+
+static bool sweep_parse_axis(const char *arg, sweep_axis_t *axis)
+{
+    const char *equals = strchr(arg, '=');
+    if (equals == NULL || (axis->field = sweep_find_field(arg, equals - arg)) < 0)
+        return false;
+
+    const char *values = equals + 1;
+    int start, stop, step;
+    if (sscanf(values, "%d:%d:%d", &start, &stop, &step) == 3)
+    {
+        if (step == 0 || (stop - start) / step < 0)
+            return false;
+        for (int v = start; step > 0 ? v <= stop : v >= stop; v += step)
+            axis->values.push_back(v);
+        return true;
+    }
+    for (const char *p = values; *p != '\0';)
+    {
+        char *end;
+        axis->values.push_back((int)strtol(p, &end, 0));
+        if (end == p || (*end != ',' && *end != '\0'))
+            return false;
+        p = *end == ',' ? end + 1 : end;
+    }
+    return !axis->values.empty();
+}
+
+// Grid point n, the first axis varying slowest
+static void sweep_config(const bmu_config_t *base, const std::vector<sweep_axis_t> &axes, int point, bmu_config_t *config)
+{
+    *config = *base;
+    for (int a = (int)axes.size() - 1; a >= 0; a--)
+    {
+        int count = (int)axes[a].values.size();
+        *(int *)((char *)config + sweep_fields[axes[a].field].offset) = axes[a].values[point % count];
+        point /= count;
+    }
+}
+
+static void sweep_run(const bmu_config_t *config, const drive_log_t *log, sweep_result_t *result)
+{
+    bmu_context_t *ctx = new bmu_context_t;
+    std::vector<uint8_t> status(SWEEP_CHUNK * 6);
+    int count = (int)log->ids.size();
+    uint8_t previous = 0;
+    bool was_safe = false;
+
+    memset(result, 0, sizeof(*result));
+    for (int f = 0; f < SWEEP_FAULTS; f++)
+        result->first_trip_ms[f] = -1;
+    result->unsafe_ms = -1;
+    result->frames = count;
+    bmu_batch_init(ctx, config);
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < count; i += SWEEP_CHUNK)
+    {
+        int chunk = count - i < SWEEP_CHUNK ? count - i : SWEEP_CHUNK;
+        bmu_process_batch(ctx, &log->timestamps_ms[i], &log->ids[i], &log->lengths[i], &log->payloads[i * 8], chunk, status.data());
+        for (int k = 0; k < chunk; k++)
+        {
+            uint8_t now = status[k * 6];
+            int64_t elapsed_ms = (int64_t)log->timestamps_ms[i + k] - log->timestamps_ms[0];
+            uint8_t rising = now & ~previous;
+            for (int f = 0; f < SWEEP_FAULTS; f++)
+            {
+                if (!((rising >> f) & 1))
+                    continue;
+                result->trips[f]++;
+                if (result->first_trip_ms[f] < 0)
+                    result->first_trip_ms[f] = elapsed_ms;
+            }
+            bool safe = (now >> 5) & 1;
+            if (was_safe && !safe && result->unsafe_ms < 0)
+                result->unsafe_ms = elapsed_ms;
+            was_safe |= safe;
+            previous = now;
+        }
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    result->ns_per_frame = count ? (double)std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / count : 0;
+    delete ctx;
+}
+
+static bool sweep_take(std::vector<sweep_worker_t> &workers, int self, sweep_job_t *job)
+{
+    {
+        std::lock_guard<std::mutex> guard(workers[self].lock);
+        if (!workers[self].jobs.empty())
+        {
+            *job = workers[self].jobs.back();
+            workers[self].jobs.pop_back();
+            return true;
+        }
+    }
+    // Nothing is added once the workers start, so finding every deque empty means we're done
+    for (size_t i = 1; i < workers.size(); i++)
+    {
+        sweep_worker_t *victim = &workers[(self + i) % workers.size()];
+        std::lock_guard<std::mutex> guard(victim->lock);
+        if (!victim->jobs.empty())
+        {
+            *job = victim->jobs.front();
+            victim->jobs.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+static void sweep_usage(void)
+{
+    fprintf(stderr, "usage: sweep [-j threads] [-p race|charge|test] [field=a,b,c | field=start:stop:step ...] log.csv ... \n");
+    fprintf(stderr, "fields:");
+    for (int i = 0; i < SWEEP_FIELDS; i++)
+        fprintf(stderr, " %s", sweep_fields[i].name);
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char **argv)
+{
+    static const char *const profile_names[BMU_PROFILES] = {"race", "charge", "test"};
+    int threads = (int)std::thread::hardware_concurrency();
+    const bmu_config_t *base = bmu_batch_profile(BMU_PROFILE_RACE);
+    std::vector<sweep_axis_t> axes;
+    std::vector<drive_log_t> logs;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+            threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+        {
+            const char *name = argv[++i];
+            base = NULL;
+            for (int p = 0; p < BMU_PROFILES; p++)
+            {
+                if (strcmp(name, profile_names[p]) == 0)
+                    base = bmu_batch_profile(p);
+            }
+            if (base == NULL)
+            {
+                sweep_usage();
+                return 2;
+            }
+        }
+        else if (strchr(argv[i], '=') != NULL)
+        {
+            sweep_axis_t axis;
+            if (!sweep_parse_axis(argv[i], &axis))
+            {
+                fprintf(stderr, "bad sweep %s \n", argv[i]);
+                sweep_usage();
+                return 2;
+            }
+            axes.push_back(axis);
+        }
+        else
+        {
+            logs.emplace_back();
+            if (!drive_log_load(argv[i], &logs.back(), false))
+            {
+                fprintf(stderr, "can't read %s \n", argv[i]);
+                return 2;
+            }
+        }
+    }
+    if (logs.empty())
+    {
+        sweep_usage();
+        return 2;
+    }
+    if (threads < 1)
+        threads = 1;
+
+    int points = 1;
+    for (const sweep_axis_t &axis : axes)
+        points *= (int)axis.values.size();
+    std::vector<bmu_config_t> configs(points);
+    std::vector<bool> analysed(points);
+    int skipped = 0;
+    for (int p = 0; p < points; p++)
+    {
+        sweep_config(base, axes, p, &configs[p]);
+        analysed[p] = bmu_batch_config_ok(&configs[p]);
+        if (!analysed[p])
+        {
+            fprintf(stderr, "point %d: ivt_current_cycle_ms %d, ivt_cycle_ms %d fail the CAN schedule analysis, skipped \n", p,
+                    configs[p].ivt_current_cycle_ms, configs[p].ivt_cycle_ms);
+            skipped++;
+        }
+    }
+    if (skipped == points)
+        return 2;
+
+    int jobs = points * (int)logs.size();
+    std::vector<sweep_result_t> results(jobs);
+    std::vector<sweep_worker_t> workers(threads);
+    for (int j = 0, n = 0; j < jobs; j++)
+    {
+        if (analysed[j / (int)logs.size()])
+            workers[n++ % threads].jobs.push_back({j / (int)logs.size(), j % (int)logs.size()});
+    }
+
+    std::vector<std::thread> pool;
+    for (int w = 0; w < threads; w++)
+    {
+        pool.emplace_back([&, w]() {
+            sweep_job_t job;
+            while (sweep_take(workers, w, &job))
+                sweep_run(&configs[job.point], &logs[job.log], &results[job.point * logs.size() + job.log]);
+        });
+    }
+    for (std::thread &thread : pool)
+        thread.join();
+
+    printf("point");
+    for (const sweep_axis_t &axis : axes)
+        printf(",%s", sweep_fields[axis.field].name);
+    printf(",log,frames");
+    for (int f = 0; f < SWEEP_FAULTS; f++)
+        printf(",%s_trips,%s_first_ms", sweep_fault_names[f], sweep_fault_names[f]);
+    printf(",unsafe_ms,ns_per_frame\n");
+    for (int j = 0; j < jobs; j++)
+    {
+        const sweep_result_t *result = &results[j];
+        int point = j / (int)logs.size();
+        if (!analysed[point])
+            continue;
+        printf("%d", point);
+        for (const sweep_axis_t &axis : axes)
+            printf(",%d", *(const int *)((const char *)&configs[point] + sweep_fields[axis.field].offset));
+        printf(",%s,%lu", logs[j % logs.size()].name.c_str(), (unsigned long)result->frames);
+        for (int f = 0; f < SWEEP_FAULTS; f++)
+            printf(",%lu,%lld", (unsigned long)result->trips[f], (long long)result->first_trip_ms[f]);
+        printf(",%lld,%.1f\n", (long long)result->unsafe_ms, result->ns_per_frame);
+    }
+    return 0;
+}
@@ -4,6 +4,16 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "can_stats.h"
+#include "charger.h"
+#include "downsample.h"
+#include "event_stream.h"
+#include "ivt_align.h"
+#include "liveness.h"
+#include "pt.h"
+#include "relay.h"
+#include "soh.h"
+
 typedef struct ivt_state {
   int current;
   int voltage1;
@@ -15,6 +25,23 @@ typedef struct ivt_state {
   int energy;
 } ivt_state_t;
 
+// Front and rear IVT readings combined on time aligned pairs. The packs are in series, so both IVTs
+// should see the same current. The current and voltage checks take the worst of the two from the
+// aligned pair, or from the latest readings while there isn't a recent one (*_aligned false).
+typedef struct ivt_combined {
+  uint32_t time_ms;
+  int current_ma;           // mean of front and rear
+  int voltage_mv;           // front + rear
+  int power_w;
+  int current_mismatch_ma;  // front - rear
+  bool current_aligned;
+  bool voltage_aligned;
+  int max_current_ma;
+  int min_current_ma;
+  int max_voltage_mv;       // one pack, IVT voltage1
+  int min_voltage_mv;
+} ivt_combined_t;
+
 typedef struct bmu_state {
     bool over_current;
     bool under_voltage;
@@ -32,4 +59,100 @@ typedef struct bmu_state {
     uint8_t fan4_state;
 } bmu_state_t;
 
+// Limits, hysteresis, timeouts and IVT rates. The BMU logic only reads these through a pointer to the
+// active config, so a whole set can be swapped without touching the code.
+typedef struct bmu_config {
+    int max_discharge_current_ma;
+    int max_charge_current_ma;          // negative
+    int max_pack_voltage_mv;
+    int min_pack_voltage_mv;
+    int pack_voltage_hysteresis_mv;
+    int max_ivt_temperature;            // 0.1 degC
+    int min_ivt_temperature;            // 0.1 degC, both IVT temperature faults latch
+    int can_timeout_ms;
+    int ivt_timeout_ms;
+    int ivt_current_cycle_ms;
+    int ivt_cycle_ms;
+    int driver_controls_timeout_ms;     // controls node silent this long forces a shutdown
+} bmu_config_t;
+
+// Named configs, one bmu_config_t each in bmu_profiles (main.cpp). Picked by a BMU_PROFILE_ID frame or
+// the debug shell, and switched between passes so a pass never sees half of one and half of another.
+typedef enum bmu_profile {
+    BMU_PROFILE_RACE,
+    BMU_PROFILE_CHARGE,     // parked on the charger, driver controls usually off
+    BMU_PROFILE_TEST,       // bench, low current limits so a wiring fault trips early
+    BMU_PROFILES
+} bmu_profile_t;
+
+extern const bmu_config_t bmu_profiles[BMU_PROFILES];
+
+// Downsampled telemetry signals, each sent on BMU_TELEMETRY_BASE_ID + signal
+typedef enum telemetry_signal {
+    TELEMETRY_FRONT_CURRENT,        // 0.1A
+    TELEMETRY_REAR_CURRENT,         // 0.1A
+    TELEMETRY_MIN_CELL_VOLTAGE,     // mV
+    TELEMETRY_MAX_CELL_VOLTAGE,     // mV
+    TELEMETRY_SIGNALS
+} telemetry_signal_t;
+
+// Everything one BMU instance knows. Nothing in the BMU logic keeps state anywhere else, so several
+// instances can run side by side and the whole state can be copied in one go. Members are grouped by
+// how often they are touched. The layout isn't padding free: there is an odd number of single byte
+// members, and the member structs have tail padding of their own. Checkpoints write out each member
+// by name (checkpoint.cpp), so a new member has to be added there as well.
+typedef struct bmu_context {
+    // Read on every pass of the main loop
+    const bmu_config_t *config;
+    ivt_state_t ivt_front;
+    ivt_state_t ivt_rear;
+    liveness_t ivt_front_live;
+    liveness_t ivt_rear_live;
+    liveness_t driver_controls_live;
+    // Relay and IVT config sequences, stepped from the main loop while their flag below is set
+    pt_t precharge_pt;
+    pt_t discharge_pt;
+    pt_t ivt_config_pt;
+    relay_bank_t relays;
+    bmu_state_t BMU;
+    char BMU_status_array[6];
+    char previous_status;
+    bool error_flag;
+    bool ignition_demand;
+    bool previous_ignition_demand;
+    bool solar_demand;
+    bool currently_precharging;
+    bool currently_discharging;
+    bool ivt_config_pending;
+    bool ivt_configuring;
+    bool ivt_lost;
+    bool driver_controls_lost;
+    uint8_t profile_request;            // bmu_profile_t to switch to, BMU_PROFILES for none
+
+    // Once a second or less
+    uint32_t charger_last_ms;
+    uint32_t soh_saved_throughput_as;
+    charger_state_t charger;
+    soh_state_t soh_front;
+    soh_state_t soh_rear;
+    uint16_t cell_voltages[32];
+    uint8_t cell_temperatures[2][8];
+    uint32_t ivt_mismatch_count;
+    ivt_combined_t ivt_combined;
+    ivt_align_t current_align;
+    ivt_align_t voltage_align;
+    uint32_t telemetry_last_ms;
+    uint32_t led_last_ms;
+    uint32_t led_value;
+    uint32_t time_sync_last_ms;
+    uint8_t time_sync_sequence;
+    downsample_t telemetry[TELEMETRY_SIGNALS];
+    can_stats_t can_stats;
+    // Every transition; the CAN and console readers each have a cursor, checkpoints keep a copy
+    event_stream_t stream;
+    stream_cursor_t stream_can;
+    stream_cursor_t stream_console;
+    uint32_t stream_sent_ms;
+} bmu_context_t;
+
 #endif
\ No newline at end of file
@@ -0,0 +1,65 @@
+#ifndef BMU_BATCH_H
+#define BMU_BATCH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "bmu.h"
+#include "lockstep.h"
+
+/*****************************************************************************************************\
+ Run the receive and fault logic over a whole log in one call. Every argument is a column with one
+ entry per frame, so logs can be handed over as they are stored, without building a CANMessage per
+ frame on the caller's side:
+
+    timestamps_ms[i]  arrival time
+    ids[i]            CAN ID, with BMU_BATCH_EXTENDED set for extended frames
+    lengths[i]        DLC
+    payloads          8 bytes per frame, count * 8 in total
+    status            filled with the 6 byte BMU status frame after each input frame, count * 6
+
+ No relays are driven and nothing is sent. Returns the number of frames processed. Contexts are set up
+ with bmu_batch_init(), which takes any config; bmu_batch_profile() returns the built in ones by
+ bmu_profile_t, or NULL. The config is read through its pointer, so it must outlive the context.
+ bmu_batch_config_ok() says whether a config's IVT rates pass the CAN schedule analysis
+ (can_schedule_ivt_rates_ok()); the built in profiles always do, and configs that don't are refused by
+ host/sweep and host/bmu.py, as they describe a bus the BMU was never checked against.
+ Contexts share nothing, so separate ones can be run on separate threads. Callers that can't see
+ bmu.h (host/bmu.py) allocate bmu_batch_context_size() bytes for one.
+
+ bmu_batch_save() serialises a context as of now_ms into bmu_batch_checkpoint_size() bytes, in the same
+ format as the checkpoints the BMU takes and the shell dumps (checkpoint.h). bmu_batch_restore() loads
+ one of those into a context, with the config it was taken with, or custom if that wasn't a built in
+ profile. Its timestamps are left as they were, so the log carries on from the first frame logged after
+ *uptime_ms. Returns false if the bytes aren't a checkpoint this build can restore.
+
+ bmu_lockstep_batch() feeds the same frames to two BMUs, the existing fault engine on primary and the
+ table driven one (fault_engine.h) on shadow, and compares their status bits after every frame. Returns
+ the number of divergences logged in lockstep, which should be initialised with confirm_passes 1.
+ bmu_batch_lockstep_size() is sizeof(lockstep_t), for callers that mirror it (host/bmu.py).
+\*****************************************************************************************************/
+
+#define BMU_BATCH_EXTENDED 0x80000000
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int bmu_batch_context_size(void);
+void bmu_batch_init(bmu_context_t *ctx, const bmu_config_t *config);
+const bmu_config_t *bmu_batch_profile(int profile);
+bool bmu_batch_config_ok(const bmu_config_t *config);
+int bmu_process_batch(bmu_context_t *ctx, const uint32_t *timestamps_ms, const uint32_t *ids,
+                      const uint8_t *lengths, const uint8_t *payloads, int count, uint8_t *status);
+int bmu_batch_checkpoint_size(void);
+void bmu_batch_save(const bmu_context_t *ctx, uint32_t now_ms, uint8_t *data);
+bool bmu_batch_restore(bmu_context_t *ctx, const uint8_t *data, int size, const bmu_config_t *custom, uint32_t *uptime_ms);
+int bmu_batch_lockstep_size(void);
+int bmu_lockstep_batch(bmu_context_t *primary, bmu_context_t *shadow, lockstep_t *lockstep, const uint32_t *timestamps_ms,
+                       const uint32_t *ids, const uint8_t *lengths, const uint8_t *payloads, int count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
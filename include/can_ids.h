@@ -0,0 +1,64 @@
+#ifndef CAN_IDS_H
+#define CAN_IDS_H
+
+#include <stdint.h>
+
+/*****************************************************************************************************\
+ CAN IDs
+\*****************************************************************************************************/
+
+//Vehicle time sync from the BMU, high priority so the SYNC leaves as soon as it's queued
+const int32_t TIME_SYNC_ID = 0x100;
+const int32_t TIME_FOLLOW_UP_ID = 0x101;
+//BMU heartbeat CAN ID
+const int32_t BMU_CAN_ID = 0x400;
+//BMU state of health CAN ID
+const int32_t BMU_SOH_CAN_ID = 0x401;
+//Downsampled telemetry, one ID per signal from here (see bmu.h)
+const int32_t BMU_TELEMETRY_BASE_ID = 0x403;
+//Event stream, every state transition (see event_stream.h)
+const int32_t BMU_STREAM_CAN_ID = 0x407;
+//Limit profile command to the BMU, byte 0 is a bmu_profile_t (see bmu.h)
+const int32_t BMU_PROFILE_ID = 0x408;
+//Contactor command to the PCUs
+const int32_t CONTACTOR_ID = 0x34F;
+
+//Driver Controls CAN ID
+const int32_t DRIVER_CONTROLS_ID = 0x500;
+
+//PCU CAN IDs
+const int32_t CELL_VOLTAGES_BASE_ID = 0x360;
+const int32_t PCU_STATUS_FRONT    = 0x340;
+const int32_t PCU_STATUS_REAR     = 0x341;
+const int32_t CELL_TEMPERATURES_FRONT_ID = 0x550;
+const int32_t CELL_TEMPERATURES_REAR_ID = 0x562;
+
+//IVT CAN IDs. Config goes to both IVTs at once, results come back on base + channel.
+const int32_t IVT_CONFIG_ID = 0x411;
+const int32_t IVT_FRONT_BASE_ID = 0x520;
+const int32_t IVT_REAR_BASE_ID = 0x530;
+
+/*****************************************************************************************************\
+ Message rates, in ms. The IVT rates are what config_IVT() programs; the rest are what the other
+ nodes are built to send.
+\*****************************************************************************************************/
+#define IVT_CURRENT_CYCLE_MS 25
+#define IVT_CYCLE_MS 1000
+
+#define HEARTBEAT_PERIOD_MS 1000
+#define PCU_STATUS_PERIOD_MS 100
+#define CELL_VOLTAGES_PERIOD_MS 1000
+#define CELL_TEMPERATURES_PERIOD_MS 1000
+#define DRIVER_CONTROLS_PERIOD_MS 100
+#define CHARGER_FRAME_PERIOD_MS 1000
+#define CHARGER_STATUS_PERIOD_MS 1000
+// Events on the stream are sent as they happen, but no closer together than this
+#define BMU_STREAM_MIN_INTERVAL_MS 20
+// Telemetry goes out at a tenth of the IVT current rate
+#define TELEMETRY_PERIOD_MS 250
+// config_IVT() only runs when an IVT restarts; assume no more than once a second
+#define IVT_CONFIG_MIN_INTERVAL_MS 1000
+// Profile commands only come when someone changes the limits; assume no more than once a second
+#define BMU_PROFILE_MIN_INTERVAL_MS 1000
+
+#endif
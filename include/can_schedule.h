@@ -0,0 +1,176 @@
+#ifndef CAN_SCHEDULE_H
+#define CAN_SCHEDULE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "can_ids.h"
+#include "can_timing.h"
+#include "charger.h"
+#include "time_sync.h"
+
+// Keep headroom for traffic we don't know about (MPPTs, motor controller, telemetry)
+#define CAN_SCHEDULE_MAX_UTILISATION_PERCENT 50
+
+/*****************************************************************************************************\
+ Every frame the BMU sends or relies on. Deadlines are the periods; burst is the number of frames sent
+ back to back each period (config_IVT() sends 10). Jitter is how late the sender can queue a frame
+ relative to its nominal period.
+\*****************************************************************************************************/
+typedef struct can_schedule_msg {
+    uint32_t id;
+    uint8_t dlc;
+    bool extended;
+    uint8_t burst;
+    uint32_t period_us;
+    uint32_t jitter_us;
+} can_schedule_msg_t;
+
+constexpr can_schedule_msg_t can_schedule[] = {
+    // BMU transmit
+    {TIME_SYNC_ID, 1, false, 1, TIME_SYNC_PERIOD_MS * 1000, 0},
+    {TIME_FOLLOW_UP_ID, 8, false, 1, TIME_SYNC_PERIOD_MS * 1000, 0},
+    {BMU_CAN_ID, 6, false, 1, HEARTBEAT_PERIOD_MS * 1000, 0},
+    {BMU_SOH_CAN_ID, 8, false, 1, HEARTBEAT_PERIOD_MS * 1000, 0},
+    {BMU_TELEMETRY_BASE_ID, 8, false, 4, TELEMETRY_PERIOD_MS * 1000, 0},
+    {BMU_STREAM_CAN_ID, 8, false, 1, BMU_STREAM_MIN_INTERVAL_MS * 1000, 0},
+    {CONTACTOR_ID, 1, false, 1, HEARTBEAT_PERIOD_MS * 1000, 0},
+    {IVT_CONFIG_ID, 5, false, 10, IVT_CONFIG_MIN_INTERVAL_MS * 1000, 0},
+    {CHARGER_CONTROL_ID, 8, true, 1, CHARGER_FRAME_PERIOD_MS * 1000, 0},
+    // IVT results, rates as programmed by config_IVT()
+    {IVT_FRONT_BASE_ID + 0, 6, false, 1, IVT_CURRENT_CYCLE_MS * 1000, 0},
+    {IVT_FRONT_BASE_ID + 1, 6, false, 1, IVT_CYCLE_MS * 1000, 0},
+    {IVT_FRONT_BASE_ID + 4, 6, false, 1, IVT_CYCLE_MS * 1000, 0},
+    {IVT_FRONT_BASE_ID + 5, 6, false, 1, IVT_CYCLE_MS * 1000, 0},
+    {IVT_FRONT_BASE_ID + 6, 6, false, 1, IVT_CYCLE_MS * 1000, 0},
+    {IVT_FRONT_BASE_ID + 7, 6, false, 1, IVT_CYCLE_MS * 1000, 0},
+    {IVT_REAR_BASE_ID + 0, 6, false, 1, IVT_CURRENT_CYCLE_MS * 1000, 0},
+    {IVT_REAR_BASE_ID + 1, 6, false, 1, IVT_CYCLE_MS * 1000, 0},
+    {IVT_REAR_BASE_ID + 4, 6, false, 1, IVT_CYCLE_MS * 1000, 0},
+    {IVT_REAR_BASE_ID + 5, 6, false, 1, IVT_CYCLE_MS * 1000, 0},
+    {IVT_REAR_BASE_ID + 6, 6, false, 1, IVT_CYCLE_MS * 1000, 0},
+    {IVT_REAR_BASE_ID + 7, 6, false, 1, IVT_CYCLE_MS * 1000, 0},
+    // PCUs and driver controls
+    {PCU_STATUS_FRONT, 8, false, 1, PCU_STATUS_PERIOD_MS * 1000, 0},
+    {PCU_STATUS_REAR, 8, false, 1, PCU_STATUS_PERIOD_MS * 1000, 0},
+    // 0x360 - 0x367 sent back to back, nothing else sits between them
+    {CELL_VOLTAGES_BASE_ID, 8, false, 8, CELL_VOLTAGES_PERIOD_MS * 1000, 0},
+    {CELL_TEMPERATURES_FRONT_ID, 8, false, 1, CELL_TEMPERATURES_PERIOD_MS * 1000, 0},
+    {CELL_TEMPERATURES_REAR_ID, 8, false, 1, CELL_TEMPERATURES_PERIOD_MS * 1000, 0},
+    {DRIVER_CONTROLS_ID, 8, false, 1, DRIVER_CONTROLS_PERIOD_MS * 1000, 0},
+    {BMU_PROFILE_ID, 1, false, 1, BMU_PROFILE_MIN_INTERVAL_MS * 1000, 0},
+    {CHARGER_STATUS_ID, 8, true, 1, CHARGER_STATUS_PERIOD_MS * 1000, 0},
+};
+
+constexpr int CAN_SCHEDULE_MESSAGES = sizeof(can_schedule) / sizeof(can_schedule[0]);
+constexpr int CAN_BIT_TIME_US_X1000 = 1000000000 / CAN_BITRATE;
+
+/*****************************************************************************************************\
+ Arbitration order: the 11 bit base ID first, then a standard frame beats an extended one with the same
+ base ID (IDE is recessive), then the 18 bit extension. Lower key wins.
+\*****************************************************************************************************/
+constexpr uint32_t can_priority_key(const can_schedule_msg_t &msg)
+{
+    return msg.extended ? (((msg.id >> 18) & 0x7FF) << 19) | (1u << 18) | (msg.id & 0x3FFFF) : (msg.id & 0x7FF) << 19;
+}
+
+// Time a message's whole burst occupies the bus, in ns to keep the arithmetic exact
+constexpr uint32_t can_schedule_cost_ns(const can_schedule_msg_t &msg)
+{
+    return msg.burst * can_frame_bits(msg.dlc, msg.extended) * CAN_BIT_TIME_US_X1000;
+}
+
+/*****************************************************************************************************\
+ Worst case response time of message m of a message set in us, using the sufficient test from Davis et
+ al (2007):
+   w = max(B, C) + sum over higher priority k of ceil((w + J_k + tau_bit) / T_k) * C_k
+   R = J + w + C
+ where B is the longest lower priority frame, which can't be pre-empted once it has started. The set
+ is can_schedule, unless the IVT rates have been changed (can_schedule_ivt_rates_ok()).
+\*****************************************************************************************************/
+constexpr uint32_t can_response_time_us(const can_schedule_msg_t *set, int count, int m)
+{
+    uint32_t key = can_priority_key(set[m]);
+    uint32_t cost = can_schedule_cost_ns(set[m]);
+    uint32_t blocking = 0;
+    for (int k = 0; k < count; k++)
+    {
+        uint32_t frame = can_frame_bits(set[k].dlc, set[k].extended) * CAN_BIT_TIME_US_X1000;
+        if (can_priority_key(set[k]) > key && frame > blocking)
+            blocking = frame;
+    }
+
+    uint32_t start = blocking > cost ? blocking : cost;
+    uint32_t w = start;
+    for (int iteration = 0; iteration < 100; iteration++)
+    {
+        uint32_t next = start;
+        for (int k = 0; k < count; k++)
+        {
+            if (can_priority_key(set[k]) >= key)
+                continue;
+            uint64_t period = set[k].period_us * 1000ull;
+            uint64_t window = w + set[k].jitter_us * 1000ull + CAN_BIT_TIME_US_X1000;
+            next += (uint32_t)((window + period - 1) / period) * can_schedule_cost_ns(set[k]);
+        }
+        if (next == w)
+            break;
+        w = next;
+        // Past the deadline there's no point carrying on
+        if (w > set[m].period_us * 1000ull)
+            break;
+    }
+    return (set[m].jitter_us * 1000 + w + cost + 999) / 1000;
+}
+
+constexpr uint32_t can_response_time_us(int m)
+{
+    return can_response_time_us(can_schedule, CAN_SCHEDULE_MESSAGES, m);
+}
+
+// Bus utilisation in 0.01%
+constexpr uint32_t can_schedule_utilisation(const can_schedule_msg_t *set, int count)
+{
+    uint64_t total = 0;
+    for (int k = 0; k < count; k++)
+        total += (uint64_t)can_schedule_cost_ns(set[k]) * 10000 / (set[k].period_us * 1000ull);
+    return (uint32_t)total;
+}
+
+constexpr uint32_t can_schedule_utilisation(void)
+{
+    return can_schedule_utilisation(can_schedule, CAN_SCHEDULE_MESSAGES);
+}
+
+constexpr bool can_schedule_meets_deadlines(const can_schedule_msg_t *set, int count)
+{
+    for (int m = 0; m < count; m++)
+    {
+        if (can_response_time_us(set, count, m) > set[m].period_us)
+            return false;
+    }
+    return true;
+}
+
+constexpr bool can_schedule_meets_deadlines(void)
+{
+    return can_schedule_meets_deadlines(can_schedule, CAN_SCHEDULE_MESSAGES);
+}
+
+constexpr bool can_schedule_unique_ids(void)
+{
+    for (int m = 0; m < CAN_SCHEDULE_MESSAGES; m++)
+    {
+        for (int k = m + 1; k < CAN_SCHEDULE_MESSAGES; k++)
+        {
+            if (can_priority_key(can_schedule[m]) == can_priority_key(can_schedule[k]))
+                return false;
+        }
+    }
+    return true;
+}
+
+bool can_schedule_ivt_rates_ok(int current_cycle_ms, int cycle_ms);
+void can_schedule_print(void);
+
+#endif
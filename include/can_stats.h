@@ -0,0 +1,41 @@
+#ifndef CAN_STATS_H
+#define CAN_STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Number of transmit IDs tracked; any more are lumped into the last slot
+#define CAN_STATS_TX_IDS 8
+// Latency histogram buckets double from CAN_STATS_BUCKET_US, the last one catches everything above
+#define CAN_STATS_BUCKETS 8
+#define CAN_STATS_BUCKET_US 256
+
+typedef struct can_tx_stats {
+    uint32_t id;
+    uint8_t dlc;
+    bool extended;
+    uint32_t count;
+    uint32_t timeouts;
+    uint32_t last_latency_us;
+    uint32_t max_latency_us;
+    uint32_t total_latency_us;
+    uint16_t histogram[CAN_STATS_BUCKETS];
+} can_tx_stats_t;
+
+typedef struct can_stats {
+    can_tx_stats_t tx[CAN_STATS_TX_IDS];
+    uint32_t rx_frames;
+    uint32_t rx_dropped;        // frames with a known ID but the wrong format or too short
+    uint32_t arbitration_lost;
+    uint32_t error_warning;
+    uint32_t error_passive;
+    uint8_t max_tx_error_count;
+    uint8_t max_rx_error_count;
+} can_stats_t;
+
+void can_stats_init(can_stats_t *stats);
+void can_stats_record_tx(can_stats_t *stats, uint32_t id, uint8_t dlc, bool extended, uint32_t latency_us, bool sent);
+void can_stats_record_error_counts(can_stats_t *stats, uint8_t tx_errors, uint8_t rx_errors);
+void can_stats_print(const can_stats_t *stats);
+
+#endif
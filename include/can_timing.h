@@ -0,0 +1,34 @@
+#ifndef CAN_TIMING_H
+#define CAN_TIMING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define CAN_BITRATE 500000
+
+/*****************************************************************************************************\
+ Worst case frame length on the wire, including stuff bits, the CRC/ACK delimiters, end of frame and
+ interframe space. g is the number of bits exposed to stuffing besides the data field: 34 for an
+ 11-bit ID, 54 for a 29-bit ID (Davis et al, "Controller Area Network (CAN) schedulability analysis:
+ Refuted, revisited and revised").
+\*****************************************************************************************************/
+constexpr int can_frame_bits(int dlc, bool extended)
+{
+    return (extended ? 54 : 34) + 8 * dlc + 13 + ((extended ? 54 : 34) + 8 * dlc - 1) / 4;
+}
+
+// Best case (no stuffing) frame length, for the lower bound on latency
+constexpr int can_frame_bits_min(int dlc, bool extended)
+{
+    return (extended ? 54 : 34) + 8 * dlc + 13;
+}
+
+constexpr int can_frame_time_us(int dlc, bool extended)
+{
+    return (can_frame_bits(dlc, extended) * 1000000 + CAN_BITRATE - 1) / CAN_BITRATE;
+}
+
+static_assert(can_frame_bits(8, false) == 135, "8 byte standard frame is 135 bits worst case");
+static_assert(can_frame_bits(8, true) == 160, "8 byte extended frame is 160 bits worst case");
+
+#endif
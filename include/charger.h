@@ -0,0 +1,56 @@
+#ifndef CHARGER_H
+#define CHARGER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Elcon/TC-style charger protocol, 29-bit IDs, 250/500 kbit/s
+#define CHARGER_CONTROL_ID 0x1806E5F4
+#define CHARGER_STATUS_ID 0x18FF50E5
+
+// Charger status byte, bit set means fault
+#define CHARGER_STATUS_HARDWARE_FAILURE (1 << 0)
+#define CHARGER_STATUS_OVER_TEMPERATURE (1 << 1)
+#define CHARGER_STATUS_INPUT_VOLTAGE (1 << 2)
+#define CHARGER_STATUS_NO_BATTERY (1 << 3)
+#define CHARGER_STATUS_COMMS_TIMEOUT (1 << 4)
+// The charger reports no battery and comms timeout while it is idle, so only these stop a charge
+#define CHARGER_STATUS_FAULT_MASK (CHARGER_STATUS_HARDWARE_FAILURE | CHARGER_STATUS_OVER_TEMPERATURE | CHARGER_STATUS_INPUT_VOLTAGE)
+
+// Control byte sent to the charger
+#define CHARGER_CONTROL_START 0x00
+#define CHARGER_CONTROL_STOP 0x01
+
+// Front and rear packs are in series, 2 x 16S
+#define CHARGER_SERIES_CELLS 32
+
+// CC/CV profile. Cell voltages in 100uV to match cell_voltages[], temperatures in 0.1 degC to match the IVT.
+#define CHARGER_CC_CURRENT_MA 20000
+#define CHARGER_CUTOFF_CURRENT_MA 1000
+#define CHARGER_CV_CELL_VOLTAGE 41500
+#define CHARGER_TAPER_WINDOW 500
+#define CHARGER_RECHARGE_HYSTERESIS 1000
+#define CHARGER_SLEW_MA 2000
+
+#define CHARGER_MIN_TEMPERATURE 0
+#define CHARGER_COLD_TEMPERATURE 100
+#define CHARGER_DERATE_TEMPERATURE 450
+#define CHARGER_MAX_TEMPERATURE 550
+
+typedef struct charger_state {
+    bool present;
+    bool cv_phase;
+    bool charge_complete;
+    uint8_t status;
+    int current_request_ma;
+    int voltage_request_mv;
+    int output_voltage_mv;
+    int output_current_ma;
+} charger_state_t;
+
+void charger_init(charger_state_t *charger);
+void charger_update(charger_state_t *charger, int max_cell_voltage, int ivt_temperature, bool fault);
+void charger_encode_control(const charger_state_t *charger, char data[8]);
+void charger_decode_status(charger_state_t *charger, const unsigned char data[8]);
+
+#endif
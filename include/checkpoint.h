@@ -0,0 +1,54 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "bmu.h"
+
+// Bump CHECKPOINT_VERSION whenever the fields written by checkpoint.cpp change, old checkpoints can't be
+// restored after that. CHECKPOINT_BYTES is the size of one, header and CRC included.
+#define CHECKPOINT_MAGIC 0x424D5543
+#define CHECKPOINT_VERSION 17
+#define CHECKPOINT_BYTES 1306
+// Snapshots kept in RAM, the oldest is overwritten. 4 slots cover the last 3-4 minutes.
+#define CHECKPOINT_SLOTS 4
+#define CHECKPOINT_PERIOD_MS 60000
+
+/*****************************************************************************************************\
+ One BMU instance serialised field by field, so the same bytes restore on the car and on a PC:
+
+    magic       4 bytes
+    version     2
+    size        2, CHECKPOINT_BYTES
+    uptime_ms   4, when it was taken
+    profile     1, bmu_profile_t of the config in use, BMU_PROFILES for one that isn't built in
+    state       every bmu_context_t member but the config pointer, in declaration order
+    crc         4, crc32() of everything before it
+
+ Every value is little endian at the width of its field (bool and char 1 byte, int 4), with no padding,
+ so the layout doesn't depend on the compiler or the word size.
+\*****************************************************************************************************/
+typedef struct bmu_checkpoint {
+    uint32_t uptime_ms;
+    uint8_t data[CHECKPOINT_BYTES];
+} bmu_checkpoint_t;
+
+typedef struct checkpoint_ring {
+    bmu_checkpoint_t slot[CHECKPOINT_SLOTS];
+    uint32_t last_ms;
+    uint8_t next;
+    uint8_t count;
+    bool frozen;
+} checkpoint_ring_t;
+
+void checkpoint_init(checkpoint_ring_t *ring);
+void checkpoint_take(checkpoint_ring_t *ring, const bmu_context_t *ctx, uint32_t now_ms);
+void checkpoint_tick(checkpoint_ring_t *ring, const bmu_context_t *ctx, uint32_t now_ms);
+const bmu_checkpoint_t *checkpoint_get(const checkpoint_ring_t *ring, int age);
+void checkpoint_save(const bmu_context_t *ctx, uint32_t now_ms, uint8_t data[CHECKPOINT_BYTES]);
+bool checkpoint_check(const uint8_t *data, int size, uint32_t *uptime_ms);
+bool checkpoint_restore(bmu_context_t *ctx, const uint8_t *data, int size, const bmu_config_t *custom, uint32_t now_ms);
+void checkpoint_dump(const bmu_checkpoint_t *checkpoint);
+
+#endif
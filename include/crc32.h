@@ -0,0 +1,9 @@
+#ifndef CRC32_H
+#define CRC32_H
+
+#include <stdint.h>
+
+// Standard reflected CRC-32 (as used by zip/ethernet), bitwise so it needs no table in flash
+uint32_t crc32(const void *data, uint32_t size);
+
+#endif
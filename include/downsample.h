@@ -0,0 +1,31 @@
+#ifndef DOWNSAMPLE_H
+#define DOWNSAMPLE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*****************************************************************************************************\
+ Reduces a fast signal to one min/max/mean/last tuple per interval, updated as each sample arrives so
+ nothing is buffered. Min and max keep every spike; the mean is integer sum / count, rounded.
+\*****************************************************************************************************/
+typedef struct downsample {
+    int32_t sum;
+    int16_t min;
+    int16_t max;
+    int16_t last;
+    uint16_t count;
+} downsample_t;
+
+typedef struct downsample_result {
+    int16_t min;
+    int16_t max;
+    int16_t mean;
+    int16_t last;
+} downsample_result_t;
+
+void downsample_reset(downsample_t *ds);
+void downsample_add(downsample_t *ds, int32_t value);
+bool downsample_take(downsample_t *ds, downsample_result_t *result);
+void downsample_encode(const downsample_result_t *result, char data[8]);
+
+#endif
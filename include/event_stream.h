@@ -0,0 +1,64 @@
+#ifndef EVENT_STREAM_H
+#define EVENT_STREAM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Must be a power of two. Readers that fall this far behind lose the oldest events.
+#define EVENT_STREAM_SIZE 32
+
+/*****************************************************************************************************\
+ Every BMU state transition as a typed, timestamped record. Anything that changes state emits one
+ event, and each consumer (the console, the CAN stream, the shell, the frozen checkpoints) reads the
+ same ring with its own cursor, so instrumenting a transition is one write however many consumers
+ there are. This is the only record of transitions on the BMU.
+
+ Emitting is lock free and safe from the receive interrupt as well as the main loop: a slot is claimed
+ with an atomic increment and published by writing its sequence number last. Readers never hold the
+ writers up; one that gets lapped skips ahead and counts what it missed.
+\*****************************************************************************************************/
+typedef enum stream_event_type {
+    STREAM_FAULT_SET,       // arg: BMU_status_array[0] bit, value: highest IVT current in 0.1A
+    STREAM_FAULT_CLEAR,     // as above
+    STREAM_RELAY_CLOSE,     // arg: relay_t
+    STREAM_RELAY_OPEN,      // arg: relay_t
+    STREAM_IGNITION,        // arg: 1 on, 0 off; value: 1 if a fault dropped it
+    STREAM_PRECHARGE,       // arg: 0 started, 1 finished
+    STREAM_DISCHARGE,       // arg: 0 started, 1 finished
+    STREAM_IVT_CONFIG,      // arg: 0 started, 1 finished
+    STREAM_TIMEOUT,         // arg: stream_source_t, value: 1 lost, 0 back
+    STREAM_PROFILE,         // arg: bmu_profile_t asked for, value: 0 now in use, 1 refused with HV live
+    STREAM_EVENT_TYPES
+} stream_event_type_t;
+
+typedef enum stream_source {
+    STREAM_SOURCE_IVT,
+    STREAM_SOURCE_DRIVER_CONTROLS,
+} stream_source_t;
+
+typedef struct stream_event {
+    uint32_t sequence;      // event number + 1, 0 while the slot is being written
+    uint32_t time_ms;
+    uint8_t type;
+    uint8_t arg;
+    int16_t value;
+} stream_event_t;
+
+typedef struct event_stream {
+    stream_event_t events[EVENT_STREAM_SIZE];
+    volatile uint32_t head;     // events emitted since power up
+} event_stream_t;
+
+// A consumer's position in the stream
+typedef struct stream_cursor {
+    uint32_t next;
+    uint32_t lost;
+} stream_cursor_t;
+
+void event_stream_init(event_stream_t *stream);
+void event_stream_emit(event_stream_t *stream, uint32_t time_ms, stream_event_type_t type, uint8_t arg, int16_t value);
+bool event_stream_read(const event_stream_t *stream, stream_cursor_t *cursor, stream_event_t *event);
+void event_stream_encode(const stream_event_t *event, char data[8]);
+const char *event_stream_name(int type);
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef FAULT_ENGINE_H
+#define FAULT_ENGINE_H
+
+#include <stdint.h>
+
+#include "bmu.h"
+
+/*****************************************************************************************************\
+ Table driven fault engine, the candidate to replace check_cells() + update_BMU_status_array(). Each
+ limit is one row (reading, config limit and hysteresis, direction, latch, the flag it sets) and each
+ status bit is one row, so a new check is a line in a table rather than another if/else.
+
+ It prints nothing and drives nothing. Until it has run in lockstep (lockstep.h) against the existing
+ engine without diverging, it only ever runs on the shadow BMU. Like check_cells(), it takes current
+ and voltage from ctx->ivt_combined, so ivt_combine() runs first.
+\*****************************************************************************************************/
+void fault_engine_step(bmu_context_t *ctx, uint32_t now_ms);
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef IVT_ALIGN_H
+#define IVT_ALIGN_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*****************************************************************************************************\
+ Pairs front and rear IVT readings of the same quantity taken at the same moment. The two IVTs free
+ run, so the latest values can be up to a whole cycle apart. Pairs are taken at the older of the two
+ latest timestamps: the side that has that sample uses it, the other side interpolates between its
+ two samples either side, or takes its nearest one if that is within the tolerance. A side that has
+ fallen further behind than max_gap_ms has gone quiet, and there is no pair until it reports again.
+\*****************************************************************************************************/
+
+typedef struct ivt_sample {
+    uint32_t time_ms;
+    int32_t value;
+} ivt_sample_t;
+
+typedef struct ivt_align_channel {
+    ivt_sample_t previous;
+    ivt_sample_t last;
+    uint8_t count;              // samples held, up to 2
+} ivt_align_channel_t;
+
+typedef struct ivt_align {
+    ivt_align_channel_t front;
+    ivt_align_channel_t rear;
+    uint16_t tolerance_ms;      // furthest a sample can be from the pair time and still be used as is
+    uint16_t max_gap_ms;        // furthest apart two samples can be and still be interpolated between
+} ivt_align_t;
+
+typedef struct ivt_pair {
+    uint32_t time_ms;
+    int32_t front;
+    int32_t rear;
+} ivt_pair_t;
+
+void ivt_align_init(ivt_align_t *align, uint16_t cycle_ms);
+void ivt_align_add(ivt_align_channel_t *channel, uint32_t time_ms, int32_t value);
+bool ivt_align_pair(const ivt_align_t *align, ivt_pair_t *pair);
+
+#endif
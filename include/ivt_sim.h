@@ -0,0 +1,80 @@
+#ifndef IVT_SIM_H
+#define IVT_SIM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define IVT_SIM_CHANNELS 8
+// Rate every channel runs at out of the box, before config_IVT() has been at it
+#define IVT_SIM_DEFAULT_CYCLE_MS 100
+// Enough for every channel falling due in the same step
+#define IVT_SIM_MAX_FRAMES IVT_SIM_CHANNELS
+
+// Result channels, base ID + channel
+typedef enum ivt_sim_channel_id {
+    IVT_SIM_CURRENT,        // mA
+    IVT_SIM_VOLTAGE1,       // mV
+    IVT_SIM_VOLTAGE2,
+    IVT_SIM_VOLTAGE3,
+    IVT_SIM_TEMPERATURE,    // 0.1 degC
+    IVT_SIM_POWER,          // W
+    IVT_SIM_CHARGE,         // As
+    IVT_SIM_ENERGY,         // Wh
+} ivt_sim_channel_id_t;
+
+/*****************************************************************************************************\
+ A stand-in for one IVT on the bus, for the bench scenarios and for host tests, with no hardware
+ dependencies. It takes the same 0x411 commands config_IVT() sends and sends result frames on
+ base + channel the way the IVT does: mux byte, message counter, value big endian in bytes 2-5.
+
+ Like the real thing it powers up running every channel, U2 and U3 included, at the default rate, and
+ only takes channel set up commands in stop mode. It doesn't answer commands; the BMU never reads the
+ answers.
+
+ The caller sets the load (current, open circuit voltage, temperature) as it changes. The pack voltage
+ sags by current * resistance, and the current can be given uniform noise. Power, charge and energy
+ are integrated from what was sent, so they stay consistent with it.
+\*****************************************************************************************************/
+typedef struct ivt_sim_channel {
+    uint32_t next_ms;
+    uint16_t cycle_ms;
+    uint8_t mode;               // 0x00 off, 0x02 cyclic
+    uint8_t counter;
+} ivt_sim_channel_t;
+
+typedef struct ivt_sim_frame {
+    uint32_t id;
+    uint8_t data[6];
+} ivt_sim_frame_t;
+
+typedef struct ivt_sim {
+    ivt_sim_channel_t channels[IVT_SIM_CHANNELS];
+    uint32_t base_id;
+    bool running;
+    bool start_pending;         // start mode received, takes effect on the next step
+    // Load and physics
+    int32_t current_ma;
+    int32_t ocv_mv;
+    int32_t temperature;        // 0.1 degC
+    int32_t resistance_mohm;
+    int32_t noise_ma;           // current reads up to this much either side of the load
+    uint32_t noise_state;
+    uint32_t quiet_until_ms;    // dropped off the bus until then
+    uint32_t last_ms;
+    int64_t charge_uas;
+    int64_t energy_nws;
+    // For timing config and recovery
+    uint32_t restart_ms;
+    uint32_t configured_ms;     // last time start mode took effect
+    uint32_t configs;
+    uint32_t rejected;          // set up commands while running, which the IVT ignores
+    uint32_t frames;
+} ivt_sim_t;
+
+void ivt_sim_init(ivt_sim_t *sim, uint32_t base_id, uint32_t seed);
+void ivt_sim_restart(ivt_sim_t *sim, uint32_t now_ms);
+void ivt_sim_set_load(ivt_sim_t *sim, int32_t current_ma, int32_t ocv_mv, int32_t temperature);
+bool ivt_sim_receive(ivt_sim_t *sim, uint32_t id, const uint8_t *data, uint8_t length);
+int ivt_sim_step(ivt_sim_t *sim, uint32_t now_ms, ivt_sim_frame_t *frames);
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef LED_H
+#define LED_H
+
+#include <stdint.h>
+
+/*****************************************************************************************************\
+ Status LEDs on the mbed. They're worked out from the BMU state every LED_RENDER_MS rather than written
+ wherever a flag changes, and the port is only written when the result is different.
+
+ LED1 is on when safe to drive. With a fault it blinks the fault code instead: that many 250ms flashes,
+ then a 1s gap.
+\*****************************************************************************************************/
+typedef enum led {
+    LED_SAFE,
+    LED_CONTACTOR,
+    LED_SOLAR,
+    LED_CHARGING,
+    LEDS
+} led_t;
+
+#define LED_BIT(led) (1u << (led))
+
+// LED1 - LED4 are P1.18, P1.20, P1.21 and P1.23
+#define LED_SAFE_PIN 18
+#define LED_CONTACTOR_PIN 20
+#define LED_SOLAR_PIN 21
+#define LED_CHARGING_PIN 23
+#define LED_PORT_MASK ((1u << LED_SAFE_PIN) | (1u << LED_CONTACTOR_PIN) | (1u << LED_SOLAR_PIN) | (1u << LED_CHARGING_PIN))
+
+// Half a blink and the gap after a fault code. The LEDs are worked out a few times per half blink so
+// the flashes stay even whatever the loop is doing.
+#define LED_BLINK_MS 250
+#define LED_CODE_GAP_MS 1000
+#define LED_RENDER_MS 50
+
+// Fault codes, the lowest one wins if there are several
+#define LED_CODE_NONE 0
+#define LED_CODE_OVER_CURRENT 1
+#define LED_CODE_UNDER_VOLTAGE 2
+#define LED_CODE_OVER_VOLTAGE 3
+#define LED_CODE_UNDER_TEMPERATURE 4
+#define LED_CODE_OVER_TEMPERATURE 5
+#define LED_CODE_CONTROLS_LOST 6
+#define LED_CODE_IVT_LOST 7
+
+uint32_t led_render(uint8_t lit, uint8_t fault_code, uint32_t now_ms);
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef LIMIT_CHECK_H
+#define LIMIT_CHECK_H
+
+/*****************************************************************************************************\
+ One step of a limit check with hysteresis. The shape of the check (which side of the limit is bad and
+ whether a fault latches) is a template parameter, so each instantiation compiles down to a compare
+ and a couple of ands with no branches. The numbers are arguments, so they can come from the config.
+
+ A fault trips when the value goes past the limit and clears once it is back inside the limit by the
+ hysteresis. A latching check never clears by itself.
+\*****************************************************************************************************/
+
+enum limit_direction {
+    LIMIT_ABOVE,        // fault when the value is above the limit
+    LIMIT_BELOW,        // fault when the value is below the limit
+};
+
+template <limit_direction Direction, bool Latch>
+struct limit_check {
+    static constexpr bool step(bool tripped, int value, int limit, int hysteresis)
+    {
+        // Once tripped, the limit moves back into the healthy range by the hysteresis
+        return (Latch && tripped) || (Direction == LIMIT_ABOVE ? value > limit - tripped * hysteresis
+                                                               : value < limit + tripped * hysteresis);
+    }
+};
+
+typedef limit_check<LIMIT_ABOVE, false> over_limit;
+typedef limit_check<LIMIT_BELOW, false> under_limit;
+typedef limit_check<LIMIT_ABOVE, true> over_limit_latched;
+typedef limit_check<LIMIT_BELOW, true> under_limit_latched;
+
+static_assert(!over_limit::step(false, 100, 100, 10) && over_limit::step(false, 101, 100, 10), "trips above the limit");
+static_assert(over_limit::step(true, 91, 100, 10) && !over_limit::step(true, 90, 100, 10), "clears past the hysteresis");
+static_assert(!under_limit::step(false, 100, 100, 10) && under_limit::step(false, 99, 100, 10), "trips below the limit");
+static_assert(under_limit::step(true, 109, 100, 10) && !under_limit::step(true, 110, 100, 10), "clears past the hysteresis");
+static_assert(over_limit_latched::step(true, 0, 100, 10) && under_limit_latched::step(true, 200, 100, 10), "latches");
+
+#endif
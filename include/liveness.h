@@ -0,0 +1,34 @@
+#ifndef LIVENESS_H
+#define LIVENESS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*****************************************************************************************************\
+ Supervision of a periodic frame from another node. Each frame just stamps the time; the main loop
+ asks whether the node has gone quiet. A node that has never been heard from counts from power up,
+ so a board that is dead from the start is caught too.
+\*****************************************************************************************************/
+typedef struct liveness {
+    uint32_t last_ms;
+    uint32_t frames;
+} liveness_t;
+
+static inline void liveness_feed(liveness_t *live, uint32_t now_ms)
+{
+    live->last_ms = now_ms;
+    live->frames++;
+}
+
+// Time since the last frame, or since power up if there hasn't been one
+static inline uint32_t liveness_age_ms(const liveness_t *live, uint32_t now_ms)
+{
+    return now_ms - live->last_ms;
+}
+
+static inline bool liveness_expired(const liveness_t *live, uint32_t now_ms, uint32_t timeout_ms)
+{
+    return liveness_age_ms(live, now_ms) > timeout_ms;
+}
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef LOCKSTEP_H
+#define LOCKSTEP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Must be a power of two. Later divergences overwrite the oldest.
+#define LOCKSTEP_LOG_SIZE 16
+
+// Status bits the fault engine owns. Precharged/discharged come from the relay sequences, which only
+// the primary BMU runs.
+#define LOCKSTEP_MASK0 0x3F
+#define LOCKSTEP_MASK1 0x09
+
+/*****************************************************************************************************\
+ Compares the status bits from two fault engines fed the same frames, and logs each point where they
+ start to disagree or disagree differently.
+
+ On the car the shadow can see a frame one pass before the primary does, so a difference only counts
+ once it has lasted confirm_passes compares. Replayed logs have no such skew and use 1.
+\*****************************************************************************************************/
+typedef struct lockstep_divergence {
+    uint32_t time_ms;
+    uint8_t primary[2];
+    uint8_t shadow[2];
+} lockstep_divergence_t;
+
+typedef struct lockstep {
+    lockstep_divergence_t log[LOCKSTEP_LOG_SIZE];
+    uint32_t count;             // divergences logged since lockstep_init()
+    uint32_t compares;
+    uint32_t started_ms;        // when the current difference was first seen
+    uint8_t confirm_passes;
+    uint8_t run;                // consecutive compares with the current difference
+    uint8_t last[4];            // primary and shadow bits of the last logged or pending difference
+} lockstep_t;
+
+// C linkage, so host/bmu.py can set one up for bmu_lockstep_batch() (bmu_batch.h)
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void lockstep_init(lockstep_t *lockstep, uint8_t confirm_passes);
+bool lockstep_compare(lockstep_t *lockstep, uint32_t now_ms, const char *primary, const char *shadow);
+void lockstep_print(const lockstep_t *lockstep);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
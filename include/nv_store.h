@@ -0,0 +1,15 @@
+#ifndef NV_STORE_H
+#define NV_STORE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Records are appended to the last flash sector, one program page each, and the sector is only erased
+// once it is full. The newest valid record wins on load.
+#define NV_STORE_MAGIC 0x424D5531
+#define NV_STORE_SLOT_SIZE 256
+
+bool nv_store_load(void *data, uint32_t size);
+bool nv_store_save(const void *data, uint32_t size);
+
+#endif
@@ -0,0 +1,125 @@
+#ifndef OCV_TABLE_H
+#define OCV_TABLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// OCV -> SoC tables are sampled every 16mV from 3000mV, so the index is a subtract and a shift.
+#define OCV_GRID_MIN_MV 3000
+#define OCV_GRID_SHIFT 4
+#define OCV_GRID_POINTS 77
+
+// SoC -> OCV tables are sampled every 8 x 0.1% from 0%, the last point is past 100% and clamped.
+#define SOC_GRID_SHIFT 3
+#define SOC_GRID_POINTS 127
+
+// One table per temperature, 0, 20 and 40 degC. Temperatures are in 0.1 degC like the IVT.
+#define OCV_TEMPERATURE_STEP 200
+#define OCV_TEMPERATURES 3
+
+typedef struct ocv_point {
+    int16_t mv;
+    int16_t soc;
+} ocv_point_t;
+
+/*****************************************************************************************************\
+ Compile time table generation. The cell datasheet gives OCV at a handful of uneven SoC points; these
+ resample the piecewise linear curve onto the uniform grids so lookups never have to search.
+\*****************************************************************************************************/
+template <size_t N>
+constexpr int ocv_curve_soc(const ocv_point_t (&curve)[N], int mv)
+{
+    if (mv <= curve[0].mv)
+        return curve[0].soc;
+    for (size_t i = 1; i < N; i++)
+    {
+        if (mv < curve[i].mv)
+            return curve[i - 1].soc + (curve[i].soc - curve[i - 1].soc) * (mv - curve[i - 1].mv) / (curve[i].mv - curve[i - 1].mv);
+    }
+    return curve[N - 1].soc;
+}
+
+template <size_t N>
+constexpr int ocv_curve_mv(const ocv_point_t (&curve)[N], int soc)
+{
+    if (soc <= curve[0].soc)
+        return curve[0].mv;
+    for (size_t i = 1; i < N; i++)
+    {
+        if (soc < curve[i].soc)
+            return curve[i - 1].mv + (curve[i].mv - curve[i - 1].mv) * (soc - curve[i - 1].soc) / (curve[i].soc - curve[i - 1].soc);
+    }
+    return curve[N - 1].mv;
+}
+
+struct ocv_table {
+    uint16_t soc[OCV_GRID_POINTS];
+    uint16_t mv[SOC_GRID_POINTS];
+
+    template <size_t N>
+    constexpr ocv_table(const ocv_point_t (&curve)[N]) : soc{}, mv{}
+    {
+        for (int i = 0; i < OCV_GRID_POINTS; i++)
+            soc[i] = ocv_curve_soc(curve, OCV_GRID_MIN_MV + (i << OCV_GRID_SHIFT));
+        for (int i = 0; i < SOC_GRID_POINTS; i++)
+            mv[i] = ocv_curve_mv(curve, i << SOC_GRID_SHIFT);
+    }
+};
+
+extern const ocv_table ocv_tables[OCV_TEMPERATURES];
+
+/*****************************************************************************************************\
+ Lookups. All integer, no division except by the constant temperature step.
+\*****************************************************************************************************/
+constexpr int ocv_table_soc(const ocv_table &table, int mv)
+{
+    int offset = mv - OCV_GRID_MIN_MV;
+    if (offset <= 0)
+        return table.soc[0];
+    int index = offset >> OCV_GRID_SHIFT;
+    if (index >= OCV_GRID_POINTS - 1)
+        return table.soc[OCV_GRID_POINTS - 1];
+    int frac = offset & ((1 << OCV_GRID_SHIFT) - 1);
+    return table.soc[index] + (((table.soc[index + 1] - table.soc[index]) * frac) >> OCV_GRID_SHIFT);
+}
+
+constexpr int ocv_table_mv(const ocv_table &table, int soc)
+{
+    if (soc <= 0)
+        return table.mv[0];
+    if (soc >= 1000)
+        soc = 1000;
+    int index = soc >> SOC_GRID_SHIFT;
+    int frac = soc & ((1 << SOC_GRID_SHIFT) - 1);
+    return table.mv[index] + (((table.mv[index + 1] - table.mv[index]) * frac) >> SOC_GRID_SHIFT);
+}
+
+// SoC in 0.1% from a rested cell voltage in mV, blended between the two nearest temperature tables
+static inline int ocv_to_soc(int mv, int temperature)
+{
+    if (temperature <= 0)
+        return ocv_table_soc(ocv_tables[0], mv);
+    if (temperature >= (OCV_TEMPERATURES - 1) * OCV_TEMPERATURE_STEP)
+        return ocv_table_soc(ocv_tables[OCV_TEMPERATURES - 1], mv);
+    int index = temperature / OCV_TEMPERATURE_STEP;
+    int frac = temperature - index * OCV_TEMPERATURE_STEP;
+    int low = ocv_table_soc(ocv_tables[index], mv);
+    int high = ocv_table_soc(ocv_tables[index + 1], mv);
+    return low + (high - low) * frac / OCV_TEMPERATURE_STEP;
+}
+
+// Rested cell voltage in mV for a SoC in 0.1%
+static inline int soc_to_ocv(int soc, int temperature)
+{
+    if (temperature <= 0)
+        return ocv_table_mv(ocv_tables[0], soc);
+    if (temperature >= (OCV_TEMPERATURES - 1) * OCV_TEMPERATURE_STEP)
+        return ocv_table_mv(ocv_tables[OCV_TEMPERATURES - 1], soc);
+    int index = temperature / OCV_TEMPERATURE_STEP;
+    int frac = temperature - index * OCV_TEMPERATURE_STEP;
+    int low = ocv_table_mv(ocv_tables[index], soc);
+    int high = ocv_table_mv(ocv_tables[index + 1], soc);
+    return low + (high - low) * frac / OCV_TEMPERATURE_STEP;
+}
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef PT_H
+#define PT_H
+
+#include <stdint.h>
+
+/*****************************************************************************************************\
+ Protothreads, after Dunkels. A sequence is written as a plain function that is called again on every
+ pass of the main loop; it runs until it has to wait, returns, and picks up where it left off next
+ time. The resume point is a line number in a switch, so the whole frame is the pt_t below. Locals
+ don't survive a wait, keep anything needed across one in the pt_t or the context.
+
+ Don't use a switch inside a protothread body, and don't declare variables that live across a wait.
+\*****************************************************************************************************/
+typedef struct pt {
+    uint16_t lc;
+    // Loop counter for the body, kept across waits
+    uint16_t i;
+    uint32_t wake_ms;
+} pt_t;
+
+#define PT_WAITING 0
+#define PT_ENDED 1
+
+#define PT_INIT(pt) ((pt)->lc = 0)
+
+#define PT_BEGIN(pt) switch ((pt)->lc) { case 0:
+
+#define PT_END(pt) } (pt)->lc = 0; return PT_ENDED
+
+// Return to the caller until condition holds, re-checking it on every call
+#define PT_WAIT_UNTIL(pt, condition)        \
+    do {                                    \
+        (pt)->lc = __LINE__;                \
+        case __LINE__:                      \
+        if (!(condition))                   \
+            return PT_WAITING;              \
+    } while (0)
+
+// now_ms must be the caller's current time, it's read again each time the thread is resumed
+#define PT_SLEEP_MS(pt, now_ms, ms)                                                 \
+    do {                                                                            \
+        (pt)->wake_ms = (now_ms) + (ms);                                            \
+        PT_WAIT_UNTIL(pt, (int32_t)((now_ms) - (pt)->wake_ms) >= 0);                \
+    } while (0)
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef RELAY_H
+#define RELAY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*****************************************************************************************************\
+ Commanded state of the BMU's relays. Everything here is in terms of the contacts, closed or open; the
+ discharge relay's pin is active low (dischg_disable) and relay_port_value() takes care of that.
+
+ Opening is always allowed and happens at once, it's the safe direction. Closing is refused if it would
+ break an interlock or if the relay opened less than its dwell time ago.
+\*****************************************************************************************************/
+typedef enum relay {
+    RELAY_PRECHARGE,
+    RELAY_DISCHARGE,
+    RELAY_HVDC,
+    RELAY_SOLAR,
+    RELAYS
+} relay_t;
+
+#define RELAY_BIT(relay) (1u << (relay))
+
+// All four outputs are on GPIO port 0 (p7 = P0.7, p8 = P0.6, p5 = P0.9, p11 = P0.18), so one masked
+// port write changes any combination of them together
+#define RELAY_PRECHARGE_PIN 7
+#define RELAY_DISCHARGE_PIN 6
+#define RELAY_HVDC_PIN 9
+#define RELAY_SOLAR_PIN 18
+#define RELAY_PORT_MASK ((1u << RELAY_PRECHARGE_PIN) | (1u << RELAY_DISCHARGE_PIN) | (1u << RELAY_HVDC_PIN) | (1u << RELAY_SOLAR_PIN))
+
+// Minimum time a relay stays open before it can be closed again
+#define RELAY_MIN_OPEN_MS 100
+
+typedef struct relay_bank {
+    uint32_t changed_ms[RELAYS];
+    uint32_t refusals;          // refused requests; a sequence retrying the same close counts once
+    uint32_t readback_errors;
+    uint8_t closed;             // RELAY_BIT()s
+    uint8_t waiting;            // closes of the last refused request, until one succeeds
+} relay_bank_t;
+
+void relay_init(relay_bank_t *bank);
+bool relay_apply(relay_bank_t *bank, uint8_t open, uint8_t close, uint32_t now_ms);
+uint32_t relay_port_value(const relay_bank_t *bank);
+
+static inline bool relay_closed(const relay_bank_t *bank, relay_t relay)
+{
+    return bank->closed & RELAY_BIT(relay);
+}
+
+#endif
@@ -0,0 +1,93 @@
+#ifndef SCENARIO_H
+#define SCENARIO_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*****************************************************************************************************\
+ Timed bench scenarios for the HV sequencing. A scenario is a few lines of text, one statement per line,
+ all times in ms from the start:
+
+    # comment
+    at 0     ignition on
+    at 0     current front 0                 set the front IVT current in mA
+    at 500   current rear 80000 over 2000    ramp to 80A over 2s
+    at 0     voltage front 60000             IVT pack voltage in mV
+    at 0     temperature rear 250            IVT temperature in 0.1 degC
+    at 3000  dropout front 1500              front IVT goes quiet for 1.5s
+    at 3000  dropout controls 600            driver controls go quiet
+    at 3000  restart front                   front IVT power cycles and comes back unconfigured
+    at 0     noise rear 2000                 rear IVT current reads up to 2A either side of the load
+    at 0     resistance front 20             front pack voltage sags 20 mOhm * current
+    at 0     detect on                       state of the precharge detect input
+    at 4000  expect safe 1                   status bit or relay output must read 0 or 1
+    end 6000
+
+ The driver controls frame is repeated with the last ignition state every DRIVER_CONTROLS_PERIOD_MS.
+ The IVTs are emulated (ivt_sim.h), so their frames come at the rates config_IVT() programmed.
+ Statements must be in time order. scenario_compile() turns the text into a flat event array once, so
+ running a scenario is just walking the array.
+\*****************************************************************************************************/
+
+#define SCENARIO_MAX_EVENTS 64
+
+typedef enum scenario_event_type {
+    SCENARIO_IGNITION,
+    SCENARIO_CURRENT,
+    SCENARIO_VOLTAGE,
+    SCENARIO_TEMPERATURE,
+    SCENARIO_DROPOUT,
+    SCENARIO_DETECT,
+    SCENARIO_EXPECT,
+    SCENARIO_RESTART,
+    SCENARIO_NOISE,
+    SCENARIO_RESISTANCE,
+} scenario_event_type_t;
+
+// IVT targets, and the driver controls for dropouts
+#define SCENARIO_FRONT 0
+#define SCENARIO_REAR 1
+#define SCENARIO_CONTROLS 2
+
+// Things an expect can check. The status ones are bits of BMU_status_array, the relays are outputs.
+typedef enum scenario_check {
+    SCENARIO_CHECK_OVER_CURRENT,
+    SCENARIO_CHECK_UNDER_VOLTAGE,
+    SCENARIO_CHECK_OVER_VOLTAGE,
+    SCENARIO_CHECK_UNDER_TEMPERATURE,
+    SCENARIO_CHECK_OVER_TEMPERATURE,
+    SCENARIO_CHECK_SAFE,
+    SCENARIO_CHECK_CHARGING,
+    SCENARIO_CHECK_PRECHARGED,
+    SCENARIO_CHECK_DISCHARGED,
+    SCENARIO_CHECK_CONTROLS_LOST,
+    SCENARIO_CHECK_PRECHARGE_RELAY,
+    SCENARIO_CHECK_DISCHARGE_DISABLE,
+    SCENARIO_CHECK_HVDC_RELAY,
+    SCENARIO_CHECKS
+} scenario_check_t;
+
+typedef struct scenario_event {
+    uint32_t time_ms;
+    uint32_t duration_ms;   // ramp time for current/voltage/temperature, length of a dropout
+    int32_t value;
+    uint8_t type;           // scenario_event_type_t
+    uint8_t target;         // SCENARIO_FRONT/REAR, or a scenario_check_t for expects
+    uint16_t line;          // for reporting failed expects
+} scenario_event_t;
+
+typedef struct scenario {
+    scenario_event_t events[SCENARIO_MAX_EVENTS];
+    int count;
+    uint32_t end_ms;
+} scenario_t;
+
+// Returns 0 on success, otherwise the line number of the first bad statement
+int scenario_compile(const char *text, scenario_t *scenario);
+const char *scenario_check_name(int check);
+
+// Built in bench scenarios, see scenario_bench.cpp
+extern const char *const scenario_bench[];
+extern const int scenario_bench_count;
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef SHELL_H
+#define SHELL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Longest command line, anything longer is thrown away
+#define SHELL_LINE 32
+
+/*****************************************************************************************************\
+ Debug shell on the USB serial port. Characters are fed in as they arrive and a line is parsed once
+ it's complete; main.cpp carries the commands out.
+
+    help              list the commands
+    status            BMU flags, relays and pack readings
+    ivt               raw readings from both IVTs
+    cells             cell voltages and temperatures
+    can               CAN latency histograms and error counters
+    events            what the event stream still holds, oldest first
+    log <level>       0 quiet, 1 messages on state changes, 2 also the status every heartbeat
+    profile <n>       switch limits, 0 race, 1 charge, 2 test
+    shadow <0|1>      stop or (re)start the shadow fault engine, see lockstep.h
+    lockstep          divergences between the fault engines so far
+    checkpoint <n>    hex dump of the checkpoint n back, 0 the newest (checkpoint.h)
+\*****************************************************************************************************/
+typedef enum shell_command {
+    SHELL_NONE,         // empty line
+    SHELL_HELP,
+    SHELL_STATUS,
+    SHELL_IVT,
+    SHELL_CELLS,
+    SHELL_CAN,
+    SHELL_EVENTS,
+    SHELL_LOG,
+    SHELL_PROFILE,
+    SHELL_SHADOW,
+    SHELL_LOCKSTEP,
+    SHELL_CHECKPOINT,
+    SHELL_UNKNOWN,
+} shell_command_t;
+
+typedef struct shell {
+    char line[SHELL_LINE];
+    uint8_t length;
+    bool overflow;
+} shell_t;
+
+extern const char shell_help[];
+
+void shell_init(shell_t *shell);
+bool shell_feed(shell_t *shell, char c);
+shell_command_t shell_parse(const char *line, int32_t *argument);
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef SOH_H
+#define SOH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Each pack is 16S48P, nominal 3.4Ah cells. Capacities are kept in As to match the IVT charge counter.
+#define SOH_NOMINAL_CAPACITY_AS (48 * 3400 * 36 / 10)
+#define SOH_NOMINAL_CELL_VOLTAGE_MV 3600
+#define SOH_SERIES_CELLS 16
+
+// Pack is at rest (current below SOH_REST_CURRENT_MA) long enough for the OCV to be meaningful
+#define SOH_REST_CURRENT_MA 500
+#define SOH_REST_TIME_MS (20 * 60 * 1000)
+// Only trust a capacity measurement across at least this much SoC swing, in 0.1%
+#define SOH_MIN_DELTA_SOC 300
+// New measurements are blended in with weight 1/SOH_FILTER
+#define SOH_FILTER 4
+// Charge counter jumps bigger than this are an IVT reset, not throughput
+#define SOH_MAX_CHARGE_STEP_AS 1000
+
+typedef struct soh_persist {
+    int32_t capacity_as;
+    uint32_t discharge_throughput_as;
+} soh_persist_t;
+
+typedef struct soh_state {
+    soh_persist_t persist;
+    // Net charge out of the pack since power up, built from IVT charge counter deltas
+    int32_t net_charge_as;
+    int32_t last_charge_as;
+    int32_t anchor_charge_as;
+    uint32_t rest_ms;
+    int16_t anchor_soc;
+    int16_t soc;
+    bool have_charge;
+    bool have_anchor;
+    bool dirty;
+} soh_state_t;
+
+void soh_init(soh_state_t *soh, const soh_persist_t *persist);
+void soh_update(soh_state_t *soh, int charge_as, int current_ma, int pack_voltage_mv, int temperature, uint32_t dt_ms);
+int soh_health(const soh_state_t *soh);
+int soh_equivalent_cycles_x10(const soh_state_t *soh);
+int soh_usable_energy_wh(const soh_state_t *soh, int cells);
+
+#endif
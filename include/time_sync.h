@@ -0,0 +1,24 @@
+#ifndef TIME_SYNC_H
+#define TIME_SYNC_H
+
+#include <stdint.h>
+
+/*****************************************************************************************************\
+ Vehicle time, two step. The BMU is the master and its uptime in us is the vehicle time.
+
+ Once a second the BMU sends a SYNC frame (1 byte: sequence) and notes the moment it actually left
+ the controller. It then sends a FOLLOW_UP (sequence, reserved byte, that moment as a 48 bit big endian
+ us count). Other nodes timestamp the SYNC when it arrives and, once the FOLLOW_UP comes in, know their
+ local clock's offset from vehicle time to within the receive interrupt latency. Two consecutive
+ pairs give their drift.
+\*****************************************************************************************************/
+
+#define TIME_SYNC_PERIOD_MS 1000
+
+void time_sync_encode_sync(uint8_t sequence, char data[1]);
+void time_sync_encode_follow_up(uint8_t sequence, uint64_t sync_tx_us, char data[8]);
+
+// Receiver side, for nodes that share this code. Offset to add to a local time to get vehicle time.
+int64_t time_sync_offset_us(uint64_t sync_rx_local_us, const unsigned char follow_up[8]);
+
+#endif
@@ -0,0 +1,54 @@
+/*****************************************************************************************************\
+ Schedulability of the BMU's CAN message set. The analysis in can_schedule.h runs at compile time, so
+ changing a period, DLC or IVT cycle time that breaks a deadline or overloads the bus fails the build.
+\*****************************************************************************************************/
+
+#include <cstdio>
+
+#include "can_schedule.h"
+
+static_assert(can_schedule_unique_ids(), "Two messages in the CAN schedule share an ID");
+static_assert(can_schedule_meets_deadlines(), "A CAN message can miss its deadline, see can_schedule_print()");
+static_assert(can_schedule_utilisation() <= CAN_SCHEDULE_MAX_UTILISATION_PERCENT * 100, "CAN bus utilisation too high");
+
+/*****************************************************************************************************\
+ The static analysis only covers the IVT rates in can_schedule, IVT_CURRENT_CYCLE_MS and IVT_CYCLE_MS,
+ which every built in profile uses. A config with other rates (host/sweep, host/bmu.py) gets the same
+ analysis at run time: the IVT results take the new periods and the set must still meet every deadline
+ and stay inside the utilisation limit. config_IVT() sends the cycle time as 16 bits.
+\*****************************************************************************************************/
+bool can_schedule_ivt_rates_ok(int current_cycle_ms, int cycle_ms)
+{
+    can_schedule_msg_t set[CAN_SCHEDULE_MESSAGES];
+
+    if (current_cycle_ms <= 0 || current_cycle_ms > 0xFFFF || cycle_ms <= 0 || cycle_ms > 0xFFFF)
+        return false;
+    for (int m = 0; m < CAN_SCHEDULE_MESSAGES; m++)
+    {
+        set[m] = can_schedule[m];
+        uint32_t base = set[m].id & ~0xFu;
+        if (set[m].extended || (base != (uint32_t)IVT_FRONT_BASE_ID && base != (uint32_t)IVT_REAR_BASE_ID))
+            continue;
+        set[m].period_us = (set[m].id == base ? current_cycle_ms : cycle_ms) * 1000;
+    }
+    return can_schedule_meets_deadlines(set, CAN_SCHEDULE_MESSAGES)
+           && can_schedule_utilisation(set, CAN_SCHEDULE_MESSAGES) <= CAN_SCHEDULE_MAX_UTILISATION_PERCENT * 100;
+}
+
+/*****************************************************************************************************\
+ Print the response time of every message and the total bus utilisation, debugging only.
+\*****************************************************************************************************/
+void can_schedule_print(void)
+{
+    printf("CAN schedule at %d bit/s \n", CAN_BITRATE);
+    printf("==================================== \n");
+    for (int m = 0; m < CAN_SCHEDULE_MESSAGES; m++)
+    {
+        printf("0x%lx: dlc %d x%d, period %lu us, worst case response %lu us \n",
+               (unsigned long)can_schedule[m].id, can_schedule[m].dlc, can_schedule[m].burst,
+               (unsigned long)can_schedule[m].period_us, (unsigned long)can_response_time_us(m));
+    }
+    printf("utilisation: %lu.%02lu %% \n", (unsigned long)(can_schedule_utilisation() / 100),
+           (unsigned long)(can_schedule_utilisation() % 100));
+    printf("\n");
+}
@@ -0,0 +1,93 @@
+/*****************************************************************************************************\
+ Statistics on how the BMU's own frames fare on the real bus: time from can.write() to the transmit
+ interrupt for each ID, arbitration losses and the controller's error counters. Latency above the
+ frame's own time on the wire (see can_timing.h) is time spent queued behind higher priority traffic
+ or retransmitting after errors.
+\*****************************************************************************************************/
+
+#include <cstdio>
+#include <cstring>
+
+#include "can_stats.h"
+#include "can_timing.h"
+
+void can_stats_init(can_stats_t *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+}
+
+static can_tx_stats_t *can_stats_slot(can_stats_t *stats, uint32_t id)
+{
+    for (int i = 0; i < CAN_STATS_TX_IDS - 1; i++)
+    {
+        if (stats->tx[i].count == 0 && stats->tx[i].timeouts == 0)
+        {
+            stats->tx[i].id = id;
+            return &stats->tx[i];
+        }
+        if (stats->tx[i].id == id)
+            return &stats->tx[i];
+    }
+    return &stats->tx[CAN_STATS_TX_IDS - 1];
+}
+
+void can_stats_record_tx(can_stats_t *stats, uint32_t id, uint8_t dlc, bool extended, uint32_t latency_us, bool sent)
+{
+    can_tx_stats_t *tx = can_stats_slot(stats, id);
+    tx->id = id;
+    tx->dlc = dlc;
+    tx->extended = extended;
+    if (!sent)
+    {
+        tx->timeouts++;
+        return;
+    }
+    tx->count++;
+    tx->last_latency_us = latency_us;
+    tx->total_latency_us += latency_us;
+    if (latency_us > tx->max_latency_us)
+        tx->max_latency_us = latency_us;
+
+    int bucket = 0;
+    while (bucket < CAN_STATS_BUCKETS - 1 && latency_us >= ((uint32_t)CAN_STATS_BUCKET_US << bucket))
+        bucket++;
+    tx->histogram[bucket]++;
+}
+
+void can_stats_record_error_counts(can_stats_t *stats, uint8_t tx_errors, uint8_t rx_errors)
+{
+    if (tx_errors > stats->max_tx_error_count)
+        stats->max_tx_error_count = tx_errors;
+    if (rx_errors > stats->max_rx_error_count)
+        stats->max_rx_error_count = rx_errors;
+}
+
+/*****************************************************************************************************\
+ Print a table of the stats over serial, debugging only.
+\*****************************************************************************************************/
+void can_stats_print(const can_stats_t *stats)
+{
+    printf("CAN stats \n");
+    printf("==================================== \n");
+    printf("rx_frames: %lu, rx_dropped: %lu, arbitration_lost: %lu, error_warning: %lu, error_passive: %lu \n",
+           (unsigned long)stats->rx_frames, (unsigned long)stats->rx_dropped, (unsigned long)stats->arbitration_lost,
+           (unsigned long)stats->error_warning, (unsigned long)stats->error_passive);
+    printf("max TEC: %u, max REC: %u \n", stats->max_tx_error_count, stats->max_rx_error_count);
+    for (int i = 0; i < CAN_STATS_TX_IDS; i++)
+    {
+        const can_tx_stats_t *tx = &stats->tx[i];
+        if (tx->count == 0 && tx->timeouts == 0)
+            continue;
+        printf("0x%lx: sent %lu, timeouts %lu, frame %d us, last %lu us, max %lu us, mean %lu us \n",
+               (unsigned long)tx->id, (unsigned long)tx->count, (unsigned long)tx->timeouts,
+               can_frame_time_us(tx->dlc, tx->extended), (unsigned long)tx->last_latency_us,
+               (unsigned long)tx->max_latency_us,
+               (unsigned long)(tx->count ? tx->total_latency_us / tx->count : 0));
+        printf("    histogram:");
+        for (int bucket = 0; bucket < CAN_STATS_BUCKETS - 1; bucket++)
+            printf(" <%d:%u", CAN_STATS_BUCKET_US << bucket, tx->histogram[bucket]);
+        printf(" >=%d:%u", CAN_STATS_BUCKET_US << (CAN_STATS_BUCKETS - 2), tx->histogram[CAN_STATS_BUCKETS - 1]);
+        printf("\n");
+    }
+    printf("\n");
+}
@@ -0,0 +1,108 @@
+/*****************************************************************************************************\
+ CC/CV charge control. The BMU works out how much current the pack can take and streams it to the
+ charger; the charger regulates its output to whichever of the voltage or current limit is hit first.
+
+ Constant current until the highest cell gets within CHARGER_TAPER_WINDOW of the CV target, then the
+ current request tapers proportionally so the pack approaches full without tripping over-voltage.
+ Charging finishes once the taper falls below the cutoff current.
+\*****************************************************************************************************/
+
+#include "charger.h"
+
+void charger_init(charger_state_t *charger)
+{
+    charger->present = false;
+    charger->cv_phase = false;
+    charger->charge_complete = false;
+    charger->status = 0;
+    charger->current_request_ma = 0;
+    charger->voltage_request_mv = 0;
+    charger->output_voltage_mv = 0;
+    charger->output_current_ma = 0;
+}
+
+/*****************************************************************************************************\
+ Current allowed at a given temperature: nothing below freezing, half rate when cold, and a linear
+ derate down to zero between CHARGER_DERATE_TEMPERATURE and CHARGER_MAX_TEMPERATURE.
+\*****************************************************************************************************/
+static int temperature_limit_ma(int temperature)
+{
+    if (temperature <= CHARGER_MIN_TEMPERATURE || temperature >= CHARGER_MAX_TEMPERATURE)
+        return 0;
+    if (temperature < CHARGER_COLD_TEMPERATURE)
+        return CHARGER_CC_CURRENT_MA / 2;
+    if (temperature > CHARGER_DERATE_TEMPERATURE)
+        return CHARGER_CC_CURRENT_MA * (CHARGER_MAX_TEMPERATURE - temperature)
+               / (CHARGER_MAX_TEMPERATURE - CHARGER_DERATE_TEMPERATURE);
+    return CHARGER_CC_CURRENT_MA;
+}
+
+/*****************************************************************************************************\
+ Called once per charger frame. max_cell_voltage is in 100uV. ivt_temperature is the hotter IVT's
+ temperature in 0.1 degC, the closest the BMU gets to a pack temperature while cell temperatures aren't
+ checked. fault is anything that must stop the charge.
+\*****************************************************************************************************/
+void charger_update(charger_state_t *charger, int max_cell_voltage, int ivt_temperature, bool fault)
+{
+    int request;
+    int headroom = CHARGER_CV_CELL_VOLTAGE - max_cell_voltage;
+
+    // Restart a finished charge once the pack has settled far enough below the target
+    if (charger->charge_complete && headroom > CHARGER_RECHARGE_HYSTERESIS)
+        charger->charge_complete = false;
+
+    charger->cv_phase = headroom < CHARGER_TAPER_WINDOW;
+
+    if (!charger->present || fault || charger->charge_complete || (charger->status & CHARGER_STATUS_FAULT_MASK) || headroom <= 0)
+        request = 0;
+    else if (charger->cv_phase)
+        request = CHARGER_CC_CURRENT_MA * headroom / CHARGER_TAPER_WINDOW;
+    else
+        request = CHARGER_CC_CURRENT_MA;
+
+    int temperature_limit = temperature_limit_ma(ivt_temperature);
+    bool derated = request > temperature_limit;
+    if (derated)
+        request = temperature_limit;
+
+    // Ramp up gently but always drop straight away
+    if (request > charger->current_request_ma + CHARGER_SLEW_MA)
+        request = charger->current_request_ma + CHARGER_SLEW_MA;
+
+    // A low request only means the pack is full if the taper set it, not the temperature derate
+    if (charger->cv_phase && charger->present && !fault && !derated && request < CHARGER_CUTOFF_CURRENT_MA)
+    {
+        charger->charge_complete = true;
+        request = 0;
+    }
+
+    charger->current_request_ma = request;
+    // Each cell at the CV target; cell voltage is in 100uV so divide by 10 for mV
+    charger->voltage_request_mv = (CHARGER_CV_CELL_VOLTAGE / 10) * CHARGER_SERIES_CELLS;
+}
+
+/*****************************************************************************************************\
+ Build the 8 byte control frame: max voltage and max current in 0.1V/0.1A big endian, then the
+ start/stop byte.
+\*****************************************************************************************************/
+void charger_encode_control(const charger_state_t *charger, char data[8])
+{
+    int voltage = charger->voltage_request_mv / 100;
+    int current = charger->current_request_ma / 100;
+
+    data[0] = (voltage >> 8) & 0xFF;
+    data[1] = voltage & 0xFF;
+    data[2] = (current >> 8) & 0xFF;
+    data[3] = current & 0xFF;
+    data[4] = current > 0 ? CHARGER_CONTROL_START : CHARGER_CONTROL_STOP;
+    data[5] = 0x00;
+    data[6] = 0x00;
+    data[7] = 0x00;
+}
+
+void charger_decode_status(charger_state_t *charger, const unsigned char data[8])
+{
+    charger->output_voltage_mv = ((data[0] << 8) | data[1]) * 100;
+    charger->output_current_ma = ((data[2] << 8) | data[3]) * 100;
+    charger->status = data[4];
+}
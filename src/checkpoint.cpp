@@ -0,0 +1,418 @@
+/*****************************************************************************************************\
+ Periodic snapshots of the whole BMU state.
+
+ Reproducing a fault that happened late in a drive otherwise means replaying the whole drive. A
+ snapshot is taken every CHECKPOINT_PERIOD_MS into a small RAM ring; when a fault trips, the ring is
+ frozen so the run-up to it is kept. A checkpoint can be dumped as hex from the debug shell, and
+ checkpoint_restore() puts a BMU instance back into that state so only the logged frames after it
+ need feeding through bmu_receive(). host/replay does that on a PC.
+\*****************************************************************************************************/
+
+#include <cstdio>
+#include <cstring>
+#include <mbed.h>
+
+#include "checkpoint.h"
+#include "crc32.h"
+
+#define CHECKPOINT_HEADER_BYTES 13
+
+// Where the next field goes to or comes from. Fields past CHECKPOINT_BYTES are skipped but still
+// counted, so a CHECKPOINT_BYTES that is out of date shows up in at once the state has been walked.
+typedef struct checkpoint_io {
+    uint8_t *data;
+    int at;
+    bool load;
+} checkpoint_io_t;
+
+#define CHECKPOINT_FIELD(io, field) checkpoint_field(io, (void *)&(field), sizeof(field))
+
+static void checkpoint_field(checkpoint_io_t *io, void *field, int bytes)
+{
+    uint8_t *p = io->data + io->at;
+    uint32_t value = 0;
+
+    io->at += bytes;
+    if (io->at > CHECKPOINT_BYTES)
+        return;
+    if (io->load)
+    {
+        for (int i = bytes - 1; i >= 0; i--)
+            value = value << 8 | p[i];
+        uint8_t value8 = value;
+        uint16_t value16 = value;
+        memcpy(field, bytes == 1 ? (void *)&value8 : bytes == 2 ? (void *)&value16 : (void *)&value, bytes);
+    }
+    else
+    {
+        uint8_t value8;
+        uint16_t value16;
+        if (bytes == 1)
+            memcpy(&value8, field, 1), value = value8;
+        else if (bytes == 2)
+            memcpy(&value16, field, 2), value = value16;
+        else
+            memcpy(&value, field, 4);
+        for (int i = 0; i < bytes; i++)
+            p[i] = value >> (8 * i);
+    }
+}
+
+static void checkpoint_ivt(checkpoint_io_t *io, ivt_state_t *ivt)
+{
+    CHECKPOINT_FIELD(io, ivt->current);
+    CHECKPOINT_FIELD(io, ivt->voltage1);
+    CHECKPOINT_FIELD(io, ivt->voltage2);
+    CHECKPOINT_FIELD(io, ivt->voltage3);
+    CHECKPOINT_FIELD(io, ivt->temperature);
+    CHECKPOINT_FIELD(io, ivt->power);
+    CHECKPOINT_FIELD(io, ivt->charge);
+    CHECKPOINT_FIELD(io, ivt->energy);
+}
+
+static void checkpoint_liveness(checkpoint_io_t *io, liveness_t *live)
+{
+    CHECKPOINT_FIELD(io, live->last_ms);
+    CHECKPOINT_FIELD(io, live->frames);
+}
+
+static void checkpoint_pt(checkpoint_io_t *io, pt_t *pt)
+{
+    CHECKPOINT_FIELD(io, pt->lc);
+    CHECKPOINT_FIELD(io, pt->i);
+    CHECKPOINT_FIELD(io, pt->wake_ms);
+}
+
+static void checkpoint_soh(checkpoint_io_t *io, soh_state_t *soh)
+{
+    CHECKPOINT_FIELD(io, soh->persist.capacity_as);
+    CHECKPOINT_FIELD(io, soh->persist.discharge_throughput_as);
+    CHECKPOINT_FIELD(io, soh->net_charge_as);
+    CHECKPOINT_FIELD(io, soh->last_charge_as);
+    CHECKPOINT_FIELD(io, soh->anchor_charge_as);
+    CHECKPOINT_FIELD(io, soh->rest_ms);
+    CHECKPOINT_FIELD(io, soh->anchor_soc);
+    CHECKPOINT_FIELD(io, soh->soc);
+    CHECKPOINT_FIELD(io, soh->have_charge);
+    CHECKPOINT_FIELD(io, soh->have_anchor);
+    CHECKPOINT_FIELD(io, soh->dirty);
+}
+
+static void checkpoint_align_channel(checkpoint_io_t *io, ivt_align_channel_t *channel)
+{
+    CHECKPOINT_FIELD(io, channel->previous.time_ms);
+    CHECKPOINT_FIELD(io, channel->previous.value);
+    CHECKPOINT_FIELD(io, channel->last.time_ms);
+    CHECKPOINT_FIELD(io, channel->last.value);
+    CHECKPOINT_FIELD(io, channel->count);
+}
+
+static void checkpoint_align(checkpoint_io_t *io, ivt_align_t *align)
+{
+    checkpoint_align_channel(io, &align->front);
+    checkpoint_align_channel(io, &align->rear);
+    CHECKPOINT_FIELD(io, align->tolerance_ms);
+    CHECKPOINT_FIELD(io, align->max_gap_ms);
+}
+
+static void checkpoint_can_stats(checkpoint_io_t *io, can_stats_t *stats)
+{
+    for (int i = 0; i < CAN_STATS_TX_IDS; i++)
+    {
+        can_tx_stats_t *tx = &stats->tx[i];
+        CHECKPOINT_FIELD(io, tx->id);
+        CHECKPOINT_FIELD(io, tx->dlc);
+        CHECKPOINT_FIELD(io, tx->extended);
+        CHECKPOINT_FIELD(io, tx->count);
+        CHECKPOINT_FIELD(io, tx->timeouts);
+        CHECKPOINT_FIELD(io, tx->last_latency_us);
+        CHECKPOINT_FIELD(io, tx->max_latency_us);
+        CHECKPOINT_FIELD(io, tx->total_latency_us);
+        for (int j = 0; j < CAN_STATS_BUCKETS; j++)
+            CHECKPOINT_FIELD(io, tx->histogram[j]);
+    }
+    CHECKPOINT_FIELD(io, stats->rx_frames);
+    CHECKPOINT_FIELD(io, stats->rx_dropped);
+    CHECKPOINT_FIELD(io, stats->arbitration_lost);
+    CHECKPOINT_FIELD(io, stats->error_warning);
+    CHECKPOINT_FIELD(io, stats->error_passive);
+    CHECKPOINT_FIELD(io, stats->max_tx_error_count);
+    CHECKPOINT_FIELD(io, stats->max_rx_error_count);
+}
+
+static void checkpoint_stream(checkpoint_io_t *io, event_stream_t *stream)
+{
+    for (int i = 0; i < EVENT_STREAM_SIZE; i++)
+    {
+        stream_event_t *event = &stream->events[i];
+        CHECKPOINT_FIELD(io, event->sequence);
+        CHECKPOINT_FIELD(io, event->time_ms);
+        CHECKPOINT_FIELD(io, event->type);
+        CHECKPOINT_FIELD(io, event->arg);
+        CHECKPOINT_FIELD(io, event->value);
+    }
+    CHECKPOINT_FIELD(io, stream->head);
+}
+
+static void checkpoint_cursor(checkpoint_io_t *io, stream_cursor_t *cursor)
+{
+    CHECKPOINT_FIELD(io, cursor->next);
+    CHECKPOINT_FIELD(io, cursor->lost);
+}
+
+/*****************************************************************************************************\
+ Every member of bmu_context_t but config, in declaration order. Saving and loading both walk this, so
+ they can't disagree about the layout; a member added to the context has to be added here too.
+\*****************************************************************************************************/
+static void checkpoint_context(checkpoint_io_t *io, bmu_context_t *ctx)
+{
+    checkpoint_ivt(io, &ctx->ivt_front);
+    checkpoint_ivt(io, &ctx->ivt_rear);
+    checkpoint_liveness(io, &ctx->ivt_front_live);
+    checkpoint_liveness(io, &ctx->ivt_rear_live);
+    checkpoint_liveness(io, &ctx->driver_controls_live);
+    checkpoint_pt(io, &ctx->precharge_pt);
+    checkpoint_pt(io, &ctx->discharge_pt);
+    checkpoint_pt(io, &ctx->ivt_config_pt);
+    for (int i = 0; i < RELAYS; i++)
+        CHECKPOINT_FIELD(io, ctx->relays.changed_ms[i]);
+    CHECKPOINT_FIELD(io, ctx->relays.refusals);
+    CHECKPOINT_FIELD(io, ctx->relays.readback_errors);
+    CHECKPOINT_FIELD(io, ctx->relays.closed);
+    CHECKPOINT_FIELD(io, ctx->relays.waiting);
+    CHECKPOINT_FIELD(io, ctx->BMU.over_current);
+    CHECKPOINT_FIELD(io, ctx->BMU.under_voltage);
+    CHECKPOINT_FIELD(io, ctx->BMU.over_voltage);
+    CHECKPOINT_FIELD(io, ctx->BMU.under_temperature);
+    CHECKPOINT_FIELD(io, ctx->BMU.over_temperature);
+    CHECKPOINT_FIELD(io, ctx->BMU.safe_to_drive);
+    CHECKPOINT_FIELD(io, ctx->BMU.charging_state);
+    CHECKPOINT_FIELD(io, ctx->BMU.precharge_state);
+    CHECKPOINT_FIELD(io, ctx->BMU.discharge_state);
+    CHECKPOINT_FIELD(io, ctx->BMU.contactor_state);
+    CHECKPOINT_FIELD(io, ctx->BMU.fan1_state);
+    CHECKPOINT_FIELD(io, ctx->BMU.fan2_state);
+    CHECKPOINT_FIELD(io, ctx->BMU.fan3_state);
+    CHECKPOINT_FIELD(io, ctx->BMU.fan4_state);
+    for (int i = 0; i < 6; i++)
+        CHECKPOINT_FIELD(io, ctx->BMU_status_array[i]);
+    CHECKPOINT_FIELD(io, ctx->previous_status);
+    CHECKPOINT_FIELD(io, ctx->error_flag);
+    CHECKPOINT_FIELD(io, ctx->ignition_demand);
+    CHECKPOINT_FIELD(io, ctx->previous_ignition_demand);
+    CHECKPOINT_FIELD(io, ctx->solar_demand);
+    CHECKPOINT_FIELD(io, ctx->currently_precharging);
+    CHECKPOINT_FIELD(io, ctx->currently_discharging);
+    CHECKPOINT_FIELD(io, ctx->ivt_config_pending);
+    CHECKPOINT_FIELD(io, ctx->ivt_configuring);
+    CHECKPOINT_FIELD(io, ctx->ivt_lost);
+    CHECKPOINT_FIELD(io, ctx->driver_controls_lost);
+    CHECKPOINT_FIELD(io, ctx->profile_request);
+
+    CHECKPOINT_FIELD(io, ctx->charger_last_ms);
+    CHECKPOINT_FIELD(io, ctx->soh_saved_throughput_as);
+    CHECKPOINT_FIELD(io, ctx->charger.present);
+    CHECKPOINT_FIELD(io, ctx->charger.cv_phase);
+    CHECKPOINT_FIELD(io, ctx->charger.charge_complete);
+    CHECKPOINT_FIELD(io, ctx->charger.status);
+    CHECKPOINT_FIELD(io, ctx->charger.current_request_ma);
+    CHECKPOINT_FIELD(io, ctx->charger.voltage_request_mv);
+    CHECKPOINT_FIELD(io, ctx->charger.output_voltage_mv);
+    CHECKPOINT_FIELD(io, ctx->charger.output_current_ma);
+    checkpoint_soh(io, &ctx->soh_front);
+    checkpoint_soh(io, &ctx->soh_rear);
+    for (int i = 0; i < 32; i++)
+        CHECKPOINT_FIELD(io, ctx->cell_voltages[i]);
+    for (int pack = 0; pack < 2; pack++)
+        for (int i = 0; i < 8; i++)
+            CHECKPOINT_FIELD(io, ctx->cell_temperatures[pack][i]);
+    CHECKPOINT_FIELD(io, ctx->ivt_mismatch_count);
+    CHECKPOINT_FIELD(io, ctx->ivt_combined.time_ms);
+    CHECKPOINT_FIELD(io, ctx->ivt_combined.current_ma);
+    CHECKPOINT_FIELD(io, ctx->ivt_combined.voltage_mv);
+    CHECKPOINT_FIELD(io, ctx->ivt_combined.power_w);
+    CHECKPOINT_FIELD(io, ctx->ivt_combined.current_mismatch_ma);
+    CHECKPOINT_FIELD(io, ctx->ivt_combined.current_aligned);
+    CHECKPOINT_FIELD(io, ctx->ivt_combined.voltage_aligned);
+    CHECKPOINT_FIELD(io, ctx->ivt_combined.max_current_ma);
+    CHECKPOINT_FIELD(io, ctx->ivt_combined.min_current_ma);
+    CHECKPOINT_FIELD(io, ctx->ivt_combined.max_voltage_mv);
+    CHECKPOINT_FIELD(io, ctx->ivt_combined.min_voltage_mv);
+    checkpoint_align(io, &ctx->current_align);
+    checkpoint_align(io, &ctx->voltage_align);
+    CHECKPOINT_FIELD(io, ctx->telemetry_last_ms);
+    CHECKPOINT_FIELD(io, ctx->led_last_ms);
+    CHECKPOINT_FIELD(io, ctx->led_value);
+    CHECKPOINT_FIELD(io, ctx->time_sync_last_ms);
+    CHECKPOINT_FIELD(io, ctx->time_sync_sequence);
+    for (int i = 0; i < TELEMETRY_SIGNALS; i++)
+    {
+        CHECKPOINT_FIELD(io, ctx->telemetry[i].sum);
+        CHECKPOINT_FIELD(io, ctx->telemetry[i].min);
+        CHECKPOINT_FIELD(io, ctx->telemetry[i].max);
+        CHECKPOINT_FIELD(io, ctx->telemetry[i].last);
+        CHECKPOINT_FIELD(io, ctx->telemetry[i].count);
+    }
+    checkpoint_can_stats(io, &ctx->can_stats);
+    checkpoint_stream(io, &ctx->stream);
+    checkpoint_cursor(io, &ctx->stream_can);
+    checkpoint_cursor(io, &ctx->stream_console);
+    CHECKPOINT_FIELD(io, ctx->stream_sent_ms);
+}
+
+void checkpoint_init(checkpoint_ring_t *ring)
+{
+    memset(ring, 0, sizeof(*ring));
+}
+
+/*****************************************************************************************************\
+ Serialise ctx as it is at now_ms into data, see checkpoint.h for the layout.
+\*****************************************************************************************************/
+void checkpoint_save(const bmu_context_t *ctx, uint32_t now_ms, uint8_t data[CHECKPOINT_BYTES])
+{
+    checkpoint_io_t io = {data, 0, false};
+    uint32_t magic = CHECKPOINT_MAGIC;
+    uint16_t version = CHECKPOINT_VERSION;
+    uint16_t size = CHECKPOINT_BYTES;
+    uint8_t profile = BMU_PROFILES;
+
+    for (int i = 0; i < BMU_PROFILES; i++)
+        if (ctx->config == &bmu_profiles[i])
+            profile = i;
+    CHECKPOINT_FIELD(&io, magic);
+    CHECKPOINT_FIELD(&io, version);
+    CHECKPOINT_FIELD(&io, size);
+    CHECKPOINT_FIELD(&io, now_ms);
+    CHECKPOINT_FIELD(&io, profile);
+    // The receive interrupt writes into the context, so take it all in one go. Walking it is a few
+    // thousand cycles, once a minute.
+    core_util_critical_section_enter();
+    checkpoint_context(&io, (bmu_context_t *)ctx);
+    core_util_critical_section_exit();
+    // Never restorable if the fields and CHECKPOINT_BYTES disagree
+    if (io.at != CHECKPOINT_BYTES - 4)
+        memset(data, 0, CHECKPOINT_BYTES);
+    io.at = CHECKPOINT_BYTES - 4;
+    uint32_t crc = crc32(data, io.at);
+    CHECKPOINT_FIELD(&io, crc);
+}
+
+void checkpoint_take(checkpoint_ring_t *ring, const bmu_context_t *ctx, uint32_t now_ms)
+{
+    bmu_checkpoint_t *checkpoint = &ring->slot[ring->next];
+
+    checkpoint_save(ctx, now_ms, checkpoint->data);
+    checkpoint->uptime_ms = now_ms;
+
+    ring->last_ms = now_ms;
+    ring->next = (ring->next + 1) % CHECKPOINT_SLOTS;
+    if (ring->count < CHECKPOINT_SLOTS)
+        ring->count++;
+}
+
+// Called from the heartbeat, takes a snapshot once per period unless a fault has frozen the ring (see
+// bmu_loop() for which faults do)
+void checkpoint_tick(checkpoint_ring_t *ring, const bmu_context_t *ctx, uint32_t now_ms)
+{
+    if (ring->frozen)
+        return;
+    if (ring->count == 0 || now_ms - ring->last_ms >= CHECKPOINT_PERIOD_MS)
+        checkpoint_take(ring, ctx, now_ms);
+}
+
+// age 0 is the newest checkpoint, NULL if there aren't that many
+const bmu_checkpoint_t *checkpoint_get(const checkpoint_ring_t *ring, int age)
+{
+    if (age < 0 || age >= ring->count)
+        return NULL;
+    return &ring->slot[(ring->next + CHECKPOINT_SLOTS - 1 - age) % CHECKPOINT_SLOTS];
+}
+
+// Whether the size bytes at data are a checkpoint this build can restore, and when it was taken
+bool checkpoint_check(const uint8_t *data, int size, uint32_t *uptime_ms)
+{
+    checkpoint_io_t io = {(uint8_t *)data, 0, true};
+    uint32_t magic = 0;
+    uint16_t version = 0;
+    uint16_t bytes = 0;
+    uint32_t crc = 0;
+
+    if (size != CHECKPOINT_BYTES)
+        return false;
+    CHECKPOINT_FIELD(&io, magic);
+    CHECKPOINT_FIELD(&io, version);
+    CHECKPOINT_FIELD(&io, bytes);
+    CHECKPOINT_FIELD(&io, *uptime_ms);
+    io.at = CHECKPOINT_BYTES - 4;
+    CHECKPOINT_FIELD(&io, crc);
+    return magic == CHECKPOINT_MAGIC && version == CHECKPOINT_VERSION && bytes == CHECKPOINT_BYTES
+           && crc == crc32(data, CHECKPOINT_BYTES - 4);
+}
+
+static void checkpoint_shift_align(ivt_align_t *align, uint32_t shift)
+{
+    align->front.previous.time_ms += shift;
+    align->front.last.time_ms += shift;
+    align->rear.previous.time_ms += shift;
+    align->rear.last.time_ms += shift;
+}
+
+/*****************************************************************************************************\
+ Load a checkpoint into a BMU instance. It gets the built in profile the checkpoint was taken with, or
+ custom if that wasn't one of them; with no custom config such a checkpoint is refused.
+
+ Timestamps in the state were taken from the uptime when the checkpoint was made, so every one of them,
+ the streamed events included, is moved along to now_ms. That keeps each timeout, rate limit and sample
+ pairing where it was. Durations (soh rest_ms) stay as they are. A replay that carries on with the
+ log's own timestamps passes the checkpoint's uptime_ms, and nothing moves.
+\*****************************************************************************************************/
+bool checkpoint_restore(bmu_context_t *ctx, const uint8_t *data, int size, const bmu_config_t *custom, uint32_t now_ms)
+{
+    checkpoint_io_t io = {(uint8_t *)data, CHECKPOINT_HEADER_BYTES - 1, true};
+    uint32_t uptime_ms;
+    uint8_t profile;
+
+    if (!checkpoint_check(data, size, &uptime_ms))
+        return false;
+    CHECKPOINT_FIELD(&io, profile);
+    const bmu_config_t *config = profile < BMU_PROFILES ? &bmu_profiles[profile] : custom;
+    if (config == NULL)
+        return false;
+
+    uint32_t shift = now_ms - uptime_ms;
+
+    core_util_critical_section_enter();
+    memset(ctx, 0, sizeof(*ctx));
+    checkpoint_context(&io, ctx);
+    ctx->config = config;
+    ctx->ivt_front_live.last_ms += shift;
+    ctx->ivt_rear_live.last_ms += shift;
+    ctx->driver_controls_live.last_ms += shift;
+    ctx->charger_last_ms += shift;
+    ctx->precharge_pt.wake_ms += shift;
+    ctx->discharge_pt.wake_ms += shift;
+    ctx->ivt_config_pt.wake_ms += shift;
+    for (int i = 0; i < RELAYS; i++)
+        ctx->relays.changed_ms[i] += shift;
+    checkpoint_shift_align(&ctx->current_align, shift);
+    checkpoint_shift_align(&ctx->voltage_align, shift);
+    ctx->ivt_combined.time_ms += shift;
+    ctx->telemetry_last_ms += shift;
+    ctx->led_last_ms += shift;
+    ctx->time_sync_last_ms += shift;
+    for (int i = 0; i < EVENT_STREAM_SIZE; i++)
+        ctx->stream.events[i].time_ms += shift;
+    ctx->stream_sent_ms += shift;
+    core_util_critical_section_exit();
+    return true;
+}
+
+// One line of hex per checkpoint so it can be cut straight out of the serial log and handed to
+// host/replay. A few KB of text, so only the shell's checkpoint command prints it.
+void checkpoint_dump(const bmu_checkpoint_t *checkpoint)
+{
+    printf("checkpoint %lu ms: ", (unsigned long)checkpoint->uptime_ms);
+    for (int i = 0; i < CHECKPOINT_BYTES; i++)
+        printf("%02X", checkpoint->data[i]);
+    printf("\n");
+}
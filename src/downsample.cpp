@@ -0,0 +1,53 @@
+#include "downsample.h"
+
+void downsample_reset(downsample_t *ds)
+{
+    ds->sum = 0;
+    ds->min = INT16_MAX;
+    ds->max = INT16_MIN;
+    ds->last = 0;
+    ds->count = 0;
+}
+
+// Values outside int16 are clamped, the units are picked so that only happens on a bad reading
+void downsample_add(downsample_t *ds, int32_t value)
+{
+    int16_t v = value > INT16_MAX ? INT16_MAX : (value < INT16_MIN ? INT16_MIN : value);
+
+    // Past this the sum could overflow, so the rest of the interval only updates min/max/last
+    if (ds->count < UINT16_MAX)
+    {
+        ds->sum += v;
+        ds->count++;
+    }
+    if (v < ds->min)
+        ds->min = v;
+    if (v > ds->max)
+        ds->max = v;
+    ds->last = v;
+}
+
+// Finish the interval. Returns false if there were no samples in it.
+bool downsample_take(downsample_t *ds, downsample_result_t *result)
+{
+    if (ds->count == 0)
+        return false;
+    result->min = ds->min;
+    result->max = ds->max;
+    result->mean = (ds->sum + (ds->sum >= 0 ? ds->count / 2 : -(ds->count / 2))) / ds->count;
+    result->last = ds->last;
+    downsample_reset(ds);
+    return true;
+}
+
+// min, max, mean, last as big endian int16
+void downsample_encode(const downsample_result_t *result, char data[8])
+{
+    const int16_t values[4] = {result->min, result->max, result->mean, result->last};
+
+    for (int i = 0; i < 4; i++)
+    {
+        data[i * 2] = (values[i] >> 8) & 0xFF;
+        data[i * 2 + 1] = values[i] & 0xFF;
+    }
+}
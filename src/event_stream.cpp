@@ -0,0 +1,109 @@
+/*****************************************************************************************************\
+ Typed event stream, see event_stream.h.
+
+ Writers and readers only share the head counter and each slot's sequence number. The fences stop the
+ compiler moving the payload stores past the sequence store (or the loads the other way); the M3 has
+ one core and doesn't reorder its own stores, so that's all the ordering the receive interrupt needs.
+\*****************************************************************************************************/
+
+#include <atomic>
+#include <cstring>
+#include <mbed.h>
+
+#include "event_stream.h"
+
+#define EVENT_STREAM_INDEX(n) ((n) & (EVENT_STREAM_SIZE - 1))
+
+static const char *const event_stream_names[STREAM_EVENT_TYPES] = {
+    "fault set",
+    "fault clear",
+    "relay close",
+    "relay open",
+    "ignition",
+    "precharge",
+    "discharge",
+    "IVT config",
+    "timeout",
+    "profile",
+};
+
+void event_stream_init(event_stream_t *stream)
+{
+    memset(stream, 0, sizeof(*stream));
+}
+
+void event_stream_emit(event_stream_t *stream, uint32_t time_ms, stream_event_type_t type, uint8_t arg, int16_t value)
+{
+    uint32_t n = core_util_atomic_incr_u32(&stream->head, 1) - 1;
+    stream_event_t *slot = &stream->events[EVENT_STREAM_INDEX(n)];
+    volatile uint32_t *sequence = &slot->sequence;
+
+    *sequence = 0;
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    slot->time_ms = time_ms;
+    slot->type = type;
+    slot->arg = arg;
+    slot->value = value;
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    *sequence = n + 1;
+}
+
+/*****************************************************************************************************\
+ Next event for this cursor. Returns false if there's nothing new, or the next event is still being
+ written; either way try again later.
+\*****************************************************************************************************/
+bool event_stream_read(const event_stream_t *stream, stream_cursor_t *cursor, stream_event_t *event)
+{
+    while (true)
+    {
+        uint32_t head = stream->head;
+        if (cursor->next == head)
+            return false;
+        // Lapped, the oldest events this reader hadn't got to are gone
+        if (head - cursor->next > EVENT_STREAM_SIZE)
+        {
+            cursor->lost += head - EVENT_STREAM_SIZE - cursor->next;
+            cursor->next = head - EVENT_STREAM_SIZE;
+        }
+
+        const stream_event_t *slot = &stream->events[EVENT_STREAM_INDEX(cursor->next)];
+        const volatile uint32_t *sequence = &slot->sequence;
+        uint32_t before = *sequence;
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        event->time_ms = slot->time_ms;
+        event->type = slot->type;
+        event->arg = slot->arg;
+        event->value = slot->value;
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        uint32_t after = *sequence;
+
+        int32_t age = (int32_t)(before - (cursor->next + 1));
+        // Claimed but not written yet (0, or still the previous lap's number)
+        if (before == 0 || age < 0)
+            return false;
+        // Overwritten before or while it was copied, go round and skip ahead
+        if (age > 0 || after != before)
+            continue;
+        event->sequence = before;
+        cursor->next++;
+        return true;
+    }
+}
+
+// One event per frame: big endian time, type, arg, big endian value
+void event_stream_encode(const stream_event_t *event, char data[8])
+{
+    data[0] = (event->time_ms >> 24) & 0xFF;
+    data[1] = (event->time_ms >> 16) & 0xFF;
+    data[2] = (event->time_ms >> 8) & 0xFF;
+    data[3] = event->time_ms & 0xFF;
+    data[4] = event->type;
+    data[5] = event->arg;
+    data[6] = (event->value >> 8) & 0xFF;
+    data[7] = event->value & 0xFF;
+}
+
+const char *event_stream_name(int type)
+{
+    return type >= 0 && type < STREAM_EVENT_TYPES ? event_stream_names[type] : "?";
+}
@@ -0,0 +1,121 @@
+/*****************************************************************************************************\
+ Table driven fault engine, see fault_engine.h. It is meant to give exactly the status bits the
+ existing engine in main.cpp gives; anything else is a divergence for lockstep to report.
+\*****************************************************************************************************/
+
+#include <cstddef>
+
+#include "fault_engine.h"
+#include "limit_check.h"
+
+typedef int (*fault_reading_t)(const bmu_context_t *ctx);
+
+typedef struct fault_rule {
+    fault_reading_t reading;
+    int bmu_config_t::*limit;
+    int limit_offset;                   // added to the limit, -1 makes an above check trip at the limit
+    int bmu_config_t::*hysteresis;      // NULL for none
+    limit_direction direction;
+    bool latch;
+    bool bmu_state_t::*flag;
+} fault_rule_t;
+
+// Current and voltage from the aligned IVT pair, see ivt_combine() in main.cpp
+static int max_current(const bmu_context_t *ctx)
+{
+    return ctx->ivt_combined.max_current_ma;
+}
+
+static int min_current(const bmu_context_t *ctx)
+{
+    return ctx->ivt_combined.min_current_ma;
+}
+
+static int max_voltage(const bmu_context_t *ctx)
+{
+    return ctx->ivt_combined.max_voltage_mv;
+}
+
+static int min_voltage(const bmu_context_t *ctx)
+{
+    return ctx->ivt_combined.min_voltage_mv;
+}
+
+static int max_temperature(const bmu_context_t *ctx)
+{
+    return ctx->ivt_front.temperature > ctx->ivt_rear.temperature ? ctx->ivt_front.temperature : ctx->ivt_rear.temperature;
+}
+
+static int min_temperature(const bmu_context_t *ctx)
+{
+    return ctx->ivt_front.temperature < ctx->ivt_rear.temperature ? ctx->ivt_front.temperature : ctx->ivt_rear.temperature;
+}
+
+// Rows feeding the same flag are ORed, each one sees the flag as it was before this pass
+static const fault_rule_t fault_rules[] = {
+    {max_current, &bmu_config_t::max_discharge_current_ma, -1, NULL, LIMIT_ABOVE, false, &bmu_state_t::over_current},
+    {min_current, &bmu_config_t::max_charge_current_ma, 0, NULL, LIMIT_BELOW, false, &bmu_state_t::over_current},
+    {max_voltage, &bmu_config_t::max_pack_voltage_mv, 0, &bmu_config_t::pack_voltage_hysteresis_mv, LIMIT_ABOVE, false, &bmu_state_t::over_voltage},
+    {min_voltage, &bmu_config_t::min_pack_voltage_mv, 0, &bmu_config_t::pack_voltage_hysteresis_mv, LIMIT_BELOW, false, &bmu_state_t::under_voltage},
+    {max_temperature, &bmu_config_t::max_ivt_temperature, 0, NULL, LIMIT_ABOVE, true, &bmu_state_t::over_temperature},
+    {min_temperature, &bmu_config_t::min_ivt_temperature, 0, NULL, LIMIT_BELOW, true, &bmu_state_t::under_temperature},
+};
+
+#define FAULT_RULES (int)(sizeof(fault_rules) / sizeof(fault_rules[0]))
+
+// BMU_status_array[0] bits 0-4, in bit order
+static bool bmu_state_t::*const fault_bits[] = {
+    &bmu_state_t::over_current,
+    &bmu_state_t::under_voltage,
+    &bmu_state_t::over_voltage,
+    &bmu_state_t::under_temperature,
+    &bmu_state_t::over_temperature,
+};
+
+static bool fault_rule_step(const fault_rule_t *rule, bool tripped, int value, const bmu_config_t *config)
+{
+    int limit = config->*rule->limit + rule->limit_offset;
+    int hysteresis = rule->hysteresis ? config->*rule->hysteresis : 0;
+    if (rule->direction == LIMIT_ABOVE)
+        return rule->latch ? over_limit_latched::step(tripped, value, limit, hysteresis) : over_limit::step(tripped, value, limit, hysteresis);
+    return rule->latch ? under_limit_latched::step(tripped, value, limit, hysteresis) : under_limit::step(tripped, value, limit, hysteresis);
+}
+
+void fault_engine_step(bmu_context_t *ctx, uint32_t now_ms)
+{
+    bmu_state_t before = ctx->BMU;
+
+    // Every flag a rule feeds is worked out afresh from the readings
+    for (int i = 0; i < FAULT_RULES; i++)
+        ctx->BMU.*fault_rules[i].flag = false;
+    for (int i = 0; i < FAULT_RULES; i++)
+    {
+        const fault_rule_t *rule = &fault_rules[i];
+        if (fault_rule_step(rule, before.*rule->flag, rule->reading(ctx), ctx->config))
+            ctx->BMU.*rule->flag = true;
+    }
+    ctx->BMU.charging_state = max_current(ctx) < 0;
+
+    ctx->ivt_lost = liveness_expired(&ctx->ivt_front_live, now_ms, ctx->config->ivt_timeout_ms)
+                    || liveness_expired(&ctx->ivt_rear_live, now_ms, ctx->config->ivt_timeout_ms);
+    ctx->driver_controls_lost = liveness_expired(&ctx->driver_controls_live, now_ms, ctx->config->driver_controls_timeout_ms);
+
+    uint8_t faults = 0;
+    for (int i = 0; i < (int)(sizeof(fault_bits) / sizeof(fault_bits[0])); i++)
+        faults |= ctx->BMU.*fault_bits[i] << i;
+    ctx->error_flag = faults || ctx->ivt_lost || ctx->driver_controls_lost;
+    ctx->BMU.safe_to_drive = !ctx->error_flag;
+    if (ctx->error_flag && ctx->ignition_demand)
+    {
+        ctx->ignition_demand = false;
+        ctx->previous_ignition_demand = true;
+    }
+
+    ctx->BMU_status_array[0] = faults | ctx->BMU.safe_to_drive << 5;
+    ctx->BMU_status_array[1] = ctx->BMU.charging_state << 0 | ctx->BMU.precharge_state << 1 | ctx->BMU.discharge_state << 2
+                               | ctx->driver_controls_lost << 3;
+    ctx->BMU_status_array[2] = ctx->BMU.fan1_state;
+    ctx->BMU_status_array[3] = ctx->BMU.fan2_state;
+    ctx->BMU_status_array[4] = ctx->BMU.fan3_state;
+    ctx->BMU_status_array[5] = ctx->BMU.fan4_state;
+}
@@ -0,0 +1,56 @@
+#include <cstring>
+
+#include "ivt_align.h"
+
+// Tolerance is half a cycle, so a sample is never used for the slot of its neighbour; interpolation
+// is allowed across up to one missed frame
+void ivt_align_init(ivt_align_t *align, uint16_t cycle_ms)
+{
+    memset(align, 0, sizeof(*align));
+    align->tolerance_ms = cycle_ms / 2;
+    align->max_gap_ms = cycle_ms * 2 + cycle_ms / 2;
+}
+
+void ivt_align_add(ivt_align_channel_t *channel, uint32_t time_ms, int32_t value)
+{
+    channel->previous = channel->last;
+    channel->last.time_ms = time_ms;
+    channel->last.value = value;
+    if (channel->count < 2)
+        channel->count++;
+}
+
+// Value of one side at time_ms, which is never after its last sample
+static bool ivt_align_value(const ivt_align_t *align, const ivt_align_channel_t *channel, uint32_t time_ms, int32_t *value)
+{
+    uint32_t since_previous = time_ms - channel->previous.time_ms;
+    uint32_t gap = channel->last.time_ms - channel->previous.time_ms;
+
+    if (channel->last.time_ms == time_ms)
+        *value = channel->last.value;
+    else if (channel->count == 2 && since_previous <= gap && gap > 0 && gap <= align->max_gap_ms)
+        *value = channel->previous.value + (int32_t)(((int64_t)channel->last.value - channel->previous.value) * since_previous / gap);
+    else if (channel->last.time_ms - time_ms <= align->tolerance_ms)
+        *value = channel->last.value;
+    else
+        return false;
+    return true;
+}
+
+// Returns false if there is no coherent pair yet, or one IVT has gone quiet: a pair further behind the
+// other side's latest sample than an interpolation could span would hide what that side sees now
+bool ivt_align_pair(const ivt_align_t *align, ivt_pair_t *pair)
+{
+    if (align->front.count == 0 || align->rear.count == 0)
+        return false;
+
+    // The older of the two latest samples; wrap safe
+    bool front_older = (int32_t)(align->front.last.time_ms - align->rear.last.time_ms) < 0;
+    uint32_t time_ms = front_older ? align->front.last.time_ms : align->rear.last.time_ms;
+    uint32_t newest_ms = front_older ? align->rear.last.time_ms : align->front.last.time_ms;
+    if (newest_ms - time_ms > align->max_gap_ms)
+        return false;
+
+    pair->time_ms = time_ms;
+    return ivt_align_value(align, &align->front, time_ms, &pair->front) && ivt_align_value(align, &align->rear, time_ms, &pair->rear);
+}
@@ -0,0 +1,159 @@
+/*****************************************************************************************************\
+ Emulated IVT, see ivt_sim.h. Config commands are decoded the way IVT_config_command() in main.cpp
+ builds them.
+\*****************************************************************************************************/
+
+#include <cstring>
+
+#include "can_ids.h"
+#include "ivt_sim.h"
+
+#define IVT_SIM_SET_MODE 0x34
+#define IVT_SIM_SET_CHANNEL 0x20
+#define IVT_SIM_CYCLIC 0x02
+
+// Factory state: running, every channel cyclic at the default rate, all due at now_ms
+static void ivt_sim_defaults(ivt_sim_t *sim, uint32_t now_ms)
+{
+    for (int i = 0; i < IVT_SIM_CHANNELS; i++)
+    {
+        sim->channels[i].next_ms = now_ms;
+        sim->channels[i].cycle_ms = IVT_SIM_DEFAULT_CYCLE_MS;
+        sim->channels[i].mode = IVT_SIM_CYCLIC;
+        sim->channels[i].counter = 0;
+    }
+    sim->running = true;
+    sim->start_pending = false;
+    sim->charge_uas = 0;
+    sim->energy_nws = 0;
+    sim->last_ms = now_ms;
+}
+
+void ivt_sim_init(ivt_sim_t *sim, uint32_t base_id, uint32_t seed)
+{
+    memset(sim, 0, sizeof(*sim));
+    sim->base_id = base_id;
+    // xorshift never leaves 0
+    sim->noise_state = seed ? seed : 1;
+    ivt_sim_defaults(sim, 0);
+}
+
+// Power cycle the IVT. The load and physics belong to the pack, so they stay.
+void ivt_sim_restart(ivt_sim_t *sim, uint32_t now_ms)
+{
+    ivt_sim_defaults(sim, now_ms);
+    sim->restart_ms = now_ms;
+}
+
+void ivt_sim_set_load(ivt_sim_t *sim, int32_t current_ma, int32_t ocv_mv, int32_t temperature)
+{
+    sim->current_ma = current_ma;
+    sim->ocv_mv = ocv_mv;
+    sim->temperature = temperature;
+}
+
+/*****************************************************************************************************\
+ Take one frame sent to the IVTs. Returns true if it was a command this IVT carried out.
+\*****************************************************************************************************/
+bool ivt_sim_receive(ivt_sim_t *sim, uint32_t id, const uint8_t *data, uint8_t length)
+{
+    if (id != (uint32_t)IVT_CONFIG_ID || length < 2)
+        return false;
+
+    uint8_t command = data[0];
+    if (command == IVT_SIM_SET_MODE)
+    {
+        sim->running = false;
+        // Results start again from the next step, so the caller's clock sets the phase
+        sim->start_pending = data[1] == 0x01;
+        return true;
+    }
+    if (command >= IVT_SIM_SET_CHANNEL && command < IVT_SIM_SET_CHANNEL + IVT_SIM_CHANNELS && length >= 4)
+    {
+        if (sim->running || sim->start_pending)
+        {
+            sim->rejected++;
+            return false;
+        }
+        ivt_sim_channel_t *channel = &sim->channels[command - IVT_SIM_SET_CHANNEL];
+        channel->mode = data[1];
+        channel->cycle_ms = (uint16_t)(data[2] << 8 | data[3]);
+        return true;
+    }
+    return false;
+}
+
+static int32_t ivt_sim_noise(ivt_sim_t *sim)
+{
+    if (sim->noise_ma <= 0)
+        return 0;
+    //xorshift32
+    sim->noise_state ^= sim->noise_state << 13;
+    sim->noise_state ^= sim->noise_state >> 17;
+    sim->noise_state ^= sim->noise_state << 5;
+    return (int32_t)(sim->noise_state % (2 * (uint32_t)sim->noise_ma + 1)) - sim->noise_ma;
+}
+
+/*****************************************************************************************************\
+ Advance to now_ms and fill frames with the results that fell due, at most IVT_SIM_MAX_FRAMES. Returns
+ how many. Channels that fell more than a cycle behind skip the missed cycles rather than bursting.
+\*****************************************************************************************************/
+int ivt_sim_step(ivt_sim_t *sim, uint32_t now_ms, ivt_sim_frame_t *frames)
+{
+    int32_t current = sim->current_ma + ivt_sim_noise(sim);
+    int32_t voltage = sim->ocv_mv - (int32_t)((int64_t)current * sim->resistance_mohm / 1000);
+    uint32_t elapsed_ms = now_ms - sim->last_ms;
+    int count = 0;
+
+    sim->last_ms = now_ms;
+    sim->charge_uas += (int64_t)current * elapsed_ms;
+    sim->energy_nws += (int64_t)current * voltage * elapsed_ms;
+
+    if (sim->start_pending)
+    {
+        sim->start_pending = false;
+        sim->running = true;
+        for (int i = 0; i < IVT_SIM_CHANNELS; i++)
+            sim->channels[i].next_ms = now_ms;
+        sim->configured_ms = now_ms;
+        sim->configs++;
+    }
+    if (!sim->running)
+        return 0;
+
+    for (int i = 0; i < IVT_SIM_CHANNELS; i++)
+    {
+        ivt_sim_channel_t *channel = &sim->channels[i];
+        if (channel->mode != IVT_SIM_CYCLIC || channel->cycle_ms == 0 || (int32_t)(now_ms - channel->next_ms) < 0)
+            continue;
+        channel->next_ms += channel->cycle_ms;
+        if ((int32_t)(now_ms - channel->next_ms) >= 0)
+            channel->next_ms = now_ms + channel->cycle_ms;
+        channel->counter = (channel->counter + 1) & 0x0F;
+        if ((int32_t)(now_ms - sim->quiet_until_ms) < 0)
+            continue;
+
+        int32_t value;
+        switch (i)
+        {
+            case IVT_SIM_CURRENT: value = current; break;
+            case IVT_SIM_VOLTAGE1: value = voltage; break;
+            case IVT_SIM_TEMPERATURE: value = sim->temperature; break;
+            case IVT_SIM_POWER: value = (int32_t)((int64_t)current * voltage / 1000000); break;
+            case IVT_SIM_CHARGE: value = (int32_t)(sim->charge_uas / 1000000); break;
+            case IVT_SIM_ENERGY: value = (int32_t)(sim->energy_nws / 3600000000000LL); break;
+            // U2 and U3 aren't wired on the car
+            default: value = 0; break;
+        }
+        ivt_sim_frame_t *frame = &frames[count++];
+        frame->id = sim->base_id + i;
+        frame->data[0] = (uint8_t)i;
+        frame->data[1] = channel->counter;
+        frame->data[2] = (uint8_t)(value >> 24);
+        frame->data[3] = (uint8_t)(value >> 16);
+        frame->data[4] = (uint8_t)(value >> 8);
+        frame->data[5] = (uint8_t)value;
+        sim->frames++;
+    }
+    return count;
+}
@@ -0,0 +1,31 @@
+/*****************************************************************************************************\
+ Status LED rendering, see led.h.
+\*****************************************************************************************************/
+
+#include "led.h"
+
+static const uint8_t led_pin[LEDS] = {LED_SAFE_PIN, LED_CONTACTOR_PIN, LED_SOLAR_PIN, LED_CHARGING_PIN};
+
+// Port 1 value for the LEDs in lit (LED_BIT()s), to be written through LED_PORT_MASK. A fault code
+// takes over LED1, the blink phase comes from now_ms so nothing has to be kept between calls.
+uint32_t led_render(uint8_t lit, uint8_t fault_code, uint32_t now_ms)
+{
+    uint32_t value = 0;
+
+    if (fault_code != LED_CODE_NONE)
+    {
+        uint32_t flashes_ms = (uint32_t)fault_code * 2 * LED_BLINK_MS;
+        uint32_t phase = now_ms % (flashes_ms + LED_CODE_GAP_MS);
+        if (phase < flashes_ms && (phase / LED_BLINK_MS) % 2 == 0)
+            lit |= LED_BIT(LED_SAFE);
+        else
+            lit &= ~LED_BIT(LED_SAFE);
+    }
+
+    for (int i = 0; i < LEDS; i++)
+    {
+        if (lit & LED_BIT(i))
+            value |= 1u << led_pin[i];
+    }
+    return value;
+}
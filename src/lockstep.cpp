@@ -0,0 +1,61 @@
+/*****************************************************************************************************\
+ Lockstep comparison of two fault engines, see lockstep.h.
+\*****************************************************************************************************/
+
+#include <cstdio>
+#include <cstring>
+
+#include "lockstep.h"
+
+void lockstep_init(lockstep_t *lockstep, uint8_t confirm_passes)
+{
+    memset(lockstep, 0, sizeof(*lockstep));
+    lockstep->confirm_passes = confirm_passes > 0 ? confirm_passes : 1;
+}
+
+/*****************************************************************************************************\
+ Compare one pair of status frames. Returns true when this compare logged a new divergence.
+\*****************************************************************************************************/
+bool lockstep_compare(lockstep_t *lockstep, uint32_t now_ms, const char *primary, const char *shadow)
+{
+    uint8_t bits[4] = {(uint8_t)(primary[0] & LOCKSTEP_MASK0), (uint8_t)(primary[1] & LOCKSTEP_MASK1),
+                       (uint8_t)(shadow[0] & LOCKSTEP_MASK0), (uint8_t)(shadow[1] & LOCKSTEP_MASK1)};
+
+    lockstep->compares++;
+    if (bits[0] == bits[2] && bits[1] == bits[3])
+    {
+        lockstep->run = 0;
+        return false;
+    }
+    // A new difference, or a different one from last time, starts its own run
+    if (lockstep->run == 0 || memcmp(bits, lockstep->last, sizeof(bits)) != 0)
+    {
+        memcpy(lockstep->last, bits, sizeof(bits));
+        lockstep->started_ms = now_ms;
+        lockstep->run = 0;
+    }
+    if (lockstep->run < UINT8_MAX)
+        lockstep->run++;
+    if (lockstep->run != lockstep->confirm_passes)
+        return false;
+
+    lockstep_divergence_t *divergence = &lockstep->log[lockstep->count & (LOCKSTEP_LOG_SIZE - 1)];
+    divergence->time_ms = lockstep->started_ms;
+    memcpy(divergence->primary, &bits[0], 2);
+    memcpy(divergence->shadow, &bits[2], 2);
+    lockstep->count++;
+    return true;
+}
+
+void lockstep_print(const lockstep_t *lockstep)
+{
+    uint32_t first = lockstep->count > LOCKSTEP_LOG_SIZE ? lockstep->count - LOCKSTEP_LOG_SIZE : 0;
+
+    printf("lockstep: %lu compares, %lu divergences \n", (unsigned long)lockstep->compares, (unsigned long)lockstep->count);
+    for (uint32_t n = first; n < lockstep->count; n++)
+    {
+        const lockstep_divergence_t *divergence = &lockstep->log[n & (LOCKSTEP_LOG_SIZE - 1)];
+        printf("%lu ms: primary 0x%02X 0x%02X, shadow 0x%02X 0x%02X \n", (unsigned long)divergence->time_ms,
+               divergence->primary[0], divergence->primary[1], divergence->shadow[0], divergence->shadow[1]);
+    }
+}
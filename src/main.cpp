@@ -20,6 +20,12 @@
 
     IVT monitoring: Configures and monitors current, voltage and temperature of both the 
     IVT in front and rear battery pack; if max charging or discharging current is exceeded then shut everything off. 
+
+    Charger control: When a charger is connected, work out the CC/CV current limit from the highest cell voltage
+    and temperature and stream it to the charger so that charge tapers off near full.
+
+    State of health: Estimate each pack's capacity from IVT charge throughput between rested OCV readings,
+    count equivalent full cycles and keep both in flash across power cycles.
 \*****************************************************************************************************/
 
 //TO DO: ADD TIMEOUT FOR CELL TEMPERATURE, IVT AND CELL VOLTAGE READINGS
@@ -30,18 +36,61 @@
 #include <mbed.h>
 
 #include "bmu.h"
-
+#include "bmu_batch.h"
+#include "can_ids.h"
+#include "can_schedule.h"
+#include "can_stats.h"
+#include "charger.h"
+#include "checkpoint.h"
+#include "fault_engine.h"
+#include "ivt_sim.h"
+#include "led.h"
+#include "limit_check.h"
+#include "lockstep.h"
+#include "nv_store.h"
+#include "pt.h"
+#include "relay.h"
+#include "scenario.h"
+#include "shell.h"
+#include "soh.h"
+#include "time_sync.h"
+
+// Log level at power up, the shell's log command changes it: 0 quiet, 1 messages on state changes,
+// 2 also the BMU status every heartbeat. Host builds (see host/Makefile) set it to 0.
+#ifndef BMU_LOG_LEVEL
+#define BMU_LOG_LEVEL 2
+#endif
 // DEBUG flag
-#define BMU_DEBUG 1 
-
-//definitions and i/o assignment
-#define PRECHG_ENABLE p7
-#define DISCHG_DISABLE p8
+#define BMU_DEBUG (bmu_log_level >= 1)
+// Bench build that runs the scenarios in scenario_bench.cpp instead of the BMU. Never put it in the car.
+// host/Makefile builds the same bench for the PC with -DBMU_SCENARIO=1.
+#ifndef BMU_SCENARIO
+#define BMU_SCENARIO 0
+#endif
+// Run the table driven fault engine on a shadow BMU alongside the real one from power up and log where
+// their status bits differ. The shadow drives nothing, so this is fine on the car. The shell can also
+// start and stop it.
+#define BMU_SHADOW 0
+// Debug build that checks bmu_check_invariants() at the end of every pass of the main loop and prints
+// what broke. The bench scenarios and host/fuzz_bmu check them themselves.
+#ifndef BMU_CHECK_INVARIANTS
+#define BMU_CHECK_INVARIANTS 0
+#endif
+// A difference has to last this many passes to count, the shadow can be a frame ahead of the primary
+#define LOCKSTEP_CONFIRM_PASSES 2
+
+//definitions and i/o assignment, the relay outputs are in relay.h
 #define PRECHG_DETECT p15
-#define HVDC_ENABLE p5
 
 #define MAX_DISCHARGE_MAH 100000
 #define MAX_CHARGE_MAH -100000
+// On the charger only the auxiliaries draw from the pack
+#define CHARGE_PROFILE_MAX_DISCHARGE_MA 20000
+// Bench supplies and test loads stay well under these
+#define TEST_PROFILE_MAX_DISCHARGE_MA 10000
+#define TEST_PROFILE_MAX_CHARGE_MA -10000
+// Limits in use from power up
+#define BMU_DEFAULT_PROFILE BMU_PROFILE_RACE
 
 #define MAX_CELL_VOLTAGE 42000
 #define MIN_CELL_VOLTAGE 30000
@@ -56,7 +105,8 @@
 
 #define MAX_IVT_TEMPERATURE 75
 #define MIN_IVT_TEMPERATURE 2
-#define IVT_TEMPERATURE_HYSTERESIS 1
+// Charging warms the shunt with no airflow from driving
+#define CHARGE_PROFILE_MAX_IVT_TEMPERATURE 60
 
 #define MAX_CELL_TEMPERATURE 60
 #define MIN_CELL_TEMPERATURE 1
@@ -64,49 +114,75 @@
 
 #define CAN_TIMEOUT_MS 100
 #define IVT_TIMEOUT_MS 1000
+// Driver controls send every 100ms, so this is several missed frames in a row
+#define DRIVER_CONTROLS_TIMEOUT_MS 500
+// The driver controls are normally off while charging, so in practice never
+#define CHARGE_PROFILE_DRIVER_CONTROLS_TIMEOUT_MS INT32_MAX
 
-// Chrono-based elapsed_time for timer class
-using namespace std::chrono;
+// The charger stops by itself if it doesn't hear from us for 5s
+#define CHARGER_TIMEOUT_MS 5000
 
-/*****************************************************************************************************\
- CAN IDs
-\*****************************************************************************************************/
+// Each battery pack is 16S
+#define CELLS_PER_PACK 16
 
-//BMU heartbeat CAN ID
-const int32_t BMU_CAN_ID = 0x400;
+// Front and rear currents further apart than this on an aligned pair are counted as a mismatch
+#define IVT_MISMATCH_MA 2000
 
-//Driver Controls CAN ID
-const int32_t DRIVER_CONTROLS_ID = 0x500;
+// Save SoH to flash after this much discharge throughput, 1% of a pack
+#define SOH_SAVE_THROUGHPUT_AS (SOH_NOMINAL_CAPACITY_AS / 100)
 
-//PCU CAN IDs
-const int32_t CELL_VOLTAGES_BASE_ID = 0x360;
-const int32_t PCU_STATUS_FRONT    = 0x340;
-const int32_t PCU_STATUS_REAR     = 0x341;
+// Relay sequence timings. The settle time lets the precharge detect input catch up before it's trusted.
+#define PRECHARGE_SETTLE_MS 500
+#define CONTACTOR_OVERLAP_MS 100
+// Gap between IVT config commands; the IVT only needs 50us, but we can only wait in whole ms
+#define IVT_CONFIG_GAP_MS 1
 
-DigitalOut prechg_enable(PRECHG_ENABLE);
-DigitalOut dischg_disable(DISCHG_DISABLE);
-DigitalOut hvdc_enable(HVDC_ENABLE);
+// Chrono-based elapsed_time for timer class
+using namespace std::chrono;
+
+// Precharge, discharge, HV box and solar relays. Only relay_switch() writes them.
+PortOut relay_port(Port0, RELAY_PORT_MASK);
 DigitalIn prechg_detect(PRECHG_DETECT);
 
-// LEDs output to display status
-DigitalOut safe_indic(LED1);
-DigitalOut contactor_indic(LED2);
-DigitalOut solar_indic(LED3);
-DigitalOut charge_indic(LED4);
-DigitalOut solar_enable(p11);
+// LEDs output to display status, only led_update() writes them
+PortOut led_port(Port1, LED_PORT_MASK);
 
 
-//Serial port for debugging. Note that overuse of pc.printf() can mess up the CAN routines.
-// Serial is deprecated in mbedos 6, use printf instead
-// Serial pc(USBTX, USBRX);
+//Serial port for debugging. Note that overuse of printf() can mess up the CAN routines.
+//printf goes out through pc as well, so the shell and the debug messages share the port
+BufferedSerial pc(USBTX, USBRX);
+uint8_t bmu_log_level = BMU_LOG_LEVEL;
+// Set from the serial interrupt when something arrives, the shell does nothing until then
+volatile bool shell_flag;
+shell_t shell;
+
+FileHandle *mbed::mbed_override_console(int fd)
+{
+    return &pc;
+}
 
 //CAN setup
 CAN can(p30, p29);
 CANMessage received_msg;
 
-bmu_state_t BMU;
-ivt_state_t ivt_front;
-ivt_state_t ivt_rear;
+// The one BMU this board runs. Only main() and the interrupt handlers touch it directly, everything
+// else is handed a pointer.
+bmu_context_t bmu;
+
+// Fed the same frames as bmu while shadow_enabled, but runs the candidate fault engine and drives nothing
+bmu_context_t shadow;
+volatile bool shadow_enabled;
+lockstep_t lockstep;
+
+// Recent snapshots of bmu, frozen by the first real fault so the lead up to it can be replayed. The
+// shell's checkpoint command dumps them.
+checkpoint_ring_t checkpoints;
+
+// What gets kept in flash for state of health
+typedef struct soh_record {
+    soh_persist_t front;
+    soh_persist_t rear;
+} soh_record_t;
 
 /*
 // Variables to store status of front IVT
@@ -125,104 +201,114 @@ int rear_IVT_temperature;
 int rear_IVT_power;
 int rear_IVT_energy;
 */
-//Cell voltages and temperatures stored in these arrays. We have more than enough RAM to do this.
-uint16_t cell_voltages[32];
-uint8_t cell_temperatures[2][8];
-
-// Max and min battery pack voltages, as well as voltage hysteresis, in 1mV. These don't change.
-const int max_battery_pack_voltage_mv = MAX_BATTERY_PACK_VOTAGE_MV;
-const int min_battery_pack_voltage_mv = MIN_BATTERY_PACK_VOLTAGE_MV;
-const int battery_pack_hysteresis = BATTERY_PACK_VOLTAGE_HYSTERESIS;
-// These are the values that do change due to hysteresis
-int temp_max_battery_pack_voltage_mv;
-int temp_min_battery_pack_voltage_mv;
-
-// Disabled as we are not monitoring individual cell voltage
-/*
-//Min and Max cell voltages, as well as voltage hysteresis, in 100μV. These don't change.
-const int max_cell_voltage = MAX_CELL_VOLTAGE; 
-const int min_cell_voltage = MIN_CELL_VOLTAGE;
-const int voltage_hysteresis = VOLTAGE_HYSTERESIS;
-// These are the values that do change due to hysteresis.
-int temp_max_cell_voltage;
-int temp_min_cell_voltage;
-*/
-
-//Max allowable current, in mA. This doesn't change.
-const int max_current = MAX_DISCHARGE_MAH;
-const int max_charging_current = MAX_CHARGE_MAH; //this needs to be negative
-
-// Disabled as we are not monitoring individual cell voltage
-/*
-//Max allowable cell (not IVT) temperature, in ˚C. These don't change.
-const uint8_t max_cell_temperature = MAX_CELL_TEMPERATURE;
-const uint8_t min_cell_temperature = MIN_CELL_TEMPERATURE;
-const uint8_t temperature_hysteresis = TEMPERATURE_HYSTERESIS;
-//These are the values that do change due to hysteresis.
-uint8_t temp_min_cell_temperature;
-uint8_t temp_max_cell_temperature;
-*/
+// Current limits in mA, pack voltages and hysteresis in 1mV, IVT temperatures in 0.1 degC, indexed by
+// bmu_profile_t. The IVT rates must be the same in all of them, the IVTs are only configured at start up.
+const bmu_config_t bmu_profiles[BMU_PROFILES] = {
+    // BMU_PROFILE_RACE
+    {
+        MAX_DISCHARGE_MAH,
+        MAX_CHARGE_MAH,
+        MAX_BATTERY_PACK_VOTAGE_MV,
+        MIN_BATTERY_PACK_VOLTAGE_MV,
+        BATTERY_PACK_VOLTAGE_HYSTERESIS,
+        MAX_IVT_TEMPERATURE * 10,
+        MIN_IVT_TEMPERATURE * 10,
+        CAN_TIMEOUT_MS,
+        IVT_TIMEOUT_MS,
+        IVT_CURRENT_CYCLE_MS,
+        IVT_CYCLE_MS,
+        DRIVER_CONTROLS_TIMEOUT_MS,
+    },
+    // BMU_PROFILE_CHARGE
+    {
+        CHARGE_PROFILE_MAX_DISCHARGE_MA,
+        MAX_CHARGE_MAH,
+        MAX_BATTERY_PACK_VOTAGE_MV,
+        MIN_BATTERY_PACK_VOLTAGE_MV,
+        BATTERY_PACK_VOLTAGE_HYSTERESIS,
+        CHARGE_PROFILE_MAX_IVT_TEMPERATURE * 10,
+        MIN_IVT_TEMPERATURE * 10,
+        CAN_TIMEOUT_MS,
+        IVT_TIMEOUT_MS,
+        IVT_CURRENT_CYCLE_MS,
+        IVT_CYCLE_MS,
+        CHARGE_PROFILE_DRIVER_CONTROLS_TIMEOUT_MS,
+    },
+    // BMU_PROFILE_TEST
+    {
+        TEST_PROFILE_MAX_DISCHARGE_MA,
+        TEST_PROFILE_MAX_CHARGE_MA,
+        MAX_BATTERY_PACK_VOTAGE_MV,
+        MIN_BATTERY_PACK_VOLTAGE_MV,
+        BATTERY_PACK_VOLTAGE_HYSTERESIS,
+        MAX_IVT_TEMPERATURE * 10,
+        MIN_IVT_TEMPERATURE * 10,
+        CAN_TIMEOUT_MS,
+        IVT_TIMEOUT_MS,
+        IVT_CURRENT_CYCLE_MS,
+        IVT_CYCLE_MS,
+        DRIVER_CONTROLS_TIMEOUT_MS,
+    },
+};
+
+static const char *const bmu_profile_names[BMU_PROFILES] = {"race", "charge", "test"};
 
 //Function prototypes
 void CANRecieveRoutine(void);
-bool can_send(CANMessage msg);
+void bmu_context_init(bmu_context_t *ctx, const bmu_config_t *config);
+void bmu_receive(bmu_context_t *ctx, const CANMessage &msg, uint32_t now_ms);
+bool can_send(bmu_context_t *ctx, CANMessage msg);
 void CANDataSentCallback(void);
-void precharge(void);
-void discharge(void);
-void update_relays(void);
-void check_cells(void);
-void update_BMU_status_array(void);
-void config_IVT(void);
+void CANArbitrationLostCallback(void);
+void CANErrorWarningCallback(void);
+void CANErrorPassiveCallback(void);
+void precharge(bmu_context_t *ctx, uint32_t now_ms);
+void discharge(bmu_context_t *ctx, uint32_t now_ms);
+char precharge_step(bmu_context_t *ctx, uint32_t now_ms);
+char discharge_step(bmu_context_t *ctx, uint32_t now_ms);
+void update_relays(bmu_context_t *ctx, uint32_t now_ms);
+void check_cells(bmu_context_t *ctx);
+void update_BMU_status_array(bmu_context_t *ctx, uint32_t now_ms);
+void bmu_fault_step(bmu_context_t *ctx, uint32_t now_ms);
+void bmu_profile_step(bmu_context_t *ctx, uint32_t now_ms);
+void shadow_start(const bmu_context_t *ctx);
+void shadow_step(const bmu_context_t *ctx, uint32_t now_ms);
+void config_IVT(bmu_context_t *ctx, uint32_t now_ms);
+char config_IVT_step(bmu_context_t *ctx, uint32_t now_ms);
+void sequences_step(bmu_context_t *ctx, uint32_t now_ms);
 void set_heartbeat_flag(void);
-void beat(void);
-void print_bmu_status(void);
+void beat(bmu_context_t *ctx, uint32_t now_ms);
+void print_bmu_status(bmu_context_t *ctx);
+void set_charger_flag(void);
+void set_shell_flag(void);
+void charger_frame(bmu_context_t *ctx, uint32_t now_ms);
+void soh_init_from_flash(bmu_context_t *ctx);
+void soh_tick(bmu_context_t *ctx);
+void telemetry_sample_cells(bmu_context_t *ctx);
+void telemetry_send(bmu_context_t *ctx);
+void time_sync_send(bmu_context_t *ctx);
+void ivt_combine(bmu_context_t *ctx);
+void bmu_loop(bmu_context_t *ctx, uint32_t now_ms);
+int scenario_run_bench(bmu_context_t *ctx);
+void shell_poll(bmu_context_t *ctx);
+int bmu_check_invariants(const bmu_context_t *ctx);
 
 //Heartbeat ticker and various flags
 Ticker heartbeat;
-Timer IVT_timer;
-unsigned long IVT_time;
+Ticker charger_ticker;
+// Free running since boot, all timestamps are taken from this
+Timer uptime;
 
 bool CAN_data_sent;
+//Uptime in us when the last frame finished transmitting, for time sync
+uint64_t CAN_data_sent_us;
 bool heartbeat_flag;
-bool error_flag;
-bool over_voltage_flag = false;
-bool under_voltage_flag = false;
-bool over_temperature_flag = false;
-bool under_temperature_flag = false;
-bool ignition_demand = false;
-bool previous_ignition_demand = false;
-bool solar_demand = false;
-bool currently_precharging;
-bool currently_discharging;
-
-//various CAN messages set up as char arrays.
-char contactor_array[1];
-char BMU_status_array[6] = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+bool charger_flag;
 
 //IVT config messages
-char stop_mode[5] = {0x34, 0x00, 0x00, 0x00, 0x00};
-char start_mode[5] = {0x34, 0x01, 0x01, 0x00, 0x00};
-char IVT_current_setup[4] = {0x20, 0x02, 0x00, 0x19};
-char IVT_voltage1_setup[4] = {0x21, 0x02, 0x03, 0xE8};
-char IVT_voltage2_setup[4] = {0x22, 0x00, 0x03, 0xE8};
-char IVT_voltage3_setup[4] = {0x23, 0x00, 0x03, 0xE8};
-char IVT_temperature_setup[4] = {0x24, 0x02, 0x03, 0xE8};
-char IVT_charge_setup[4] = {0x25, 0x02, 0x03, 0xE8};
-char IVT_power_setup[4] = {0x26, 0x02, 0x03, 0xE8};
-char IVT_energy_setup[4] = {0x27, 0x02, 0x03, 0xE8};
-
-// By sending a CAN msg with ID 0x411, both the front and rear IVT will be configured
-// The CAN ID of the front and rear IVT is not changed
-CANMessage stop_msg(0x411, stop_mode, 5);
-CANMessage start_msg(0x411, start_mode, 5);
-CANMessage current_setup_msg(0x411, IVT_current_setup, 4);
-CANMessage voltage1_setup_msg(0x411, IVT_voltage1_setup, 4);
-CANMessage voltage2_setup_msg(0x411, IVT_voltage2_setup, 4);
-CANMessage voltage3_setup_msg(0x411, IVT_voltage3_setup, 4);
-CANMessage temperature_setup_msg(0x411, IVT_temperature_setup, 4);
-CANMessage charge_setup_msg(0x411, IVT_charge_setup, 4);
-CANMessage power_setup_msg(0x411, IVT_power_setup, 4);
-CANMessage energy_setup_msg(0x411, IVT_energy_setup, 4);
+const char stop_mode[5] = {0x34, 0x00, 0x00, 0x00, 0x00};
+const char start_mode[5] = {0x34, 0x01, 0x01, 0x00, 0x00};
+
 
 /*
 //A struct to contain all the stuff the BMU puts in its heartbeat
@@ -244,75 +330,377 @@ struct BMU_status {
 } BMU;
 */
 
-//This is used to store the error flags; you'll see its use later in the main loop.
-char previous_status = 0x00;
+// Stands in for prechg_detect in bench builds
+bool scenario_detect;
+// The emulated front and rear IVTs while a scenario runs, which hear the IVT config instead of the bus
+ivt_sim_t *scenario_ivts;
+
+static bool precharge_detected(void)
+{
+  if (BMU_SCENARIO)
+    return scenario_detect;
+  return prechg_detect;
+}
+
+/*****************************************************************************************************\
+ Apply a relay command to the bank and write all the relay pins in one go. The pins are read back
+ straight after, anything that didn't take (a shorted or fought output) is counted.
+\*****************************************************************************************************/
+static bool relay_switch(bmu_context_t *ctx, uint8_t open, uint8_t close, uint32_t now_ms)
+{
+  uint8_t before = ctx->relays.closed;
+  bool done = relay_apply(&ctx->relays, open, close, now_ms);
+  for (int i = 0; i < RELAYS; i++)
+  {
+    if ((before ^ ctx->relays.closed) & RELAY_BIT(i))
+      event_stream_emit(&ctx->stream, now_ms, relay_closed(&ctx->relays, (relay_t)i) ? STREAM_RELAY_CLOSE : STREAM_RELAY_OPEN, i, 0);
+  }
+  uint32_t value = relay_port_value(&ctx->relays);
+  relay_port = value;
+  if (((uint32_t)relay_port.read() & RELAY_PORT_MASK) != value)
+    ctx->relays.readback_errors++;
+  return done;
+}
+
+// Bring the pins in line with a freshly initialised bank
+static void relay_write(bmu_context_t *ctx)
+{
+  relay_switch(ctx, 0, 0, 0);
+}
+
+static int relay_pin_level(int pin)
+{
+  return ((uint32_t)relay_port.read() >> pin) & 1;
+}
+
+// Lowest fault first, see led.h
+static uint8_t led_fault_code(const bmu_context_t *ctx)
+{
+  for (int i = 0; i < 5; i++)
+  {
+    if ((ctx->BMU_status_array[0] >> i) & 1)
+      return LED_CODE_OVER_CURRENT + i;
+  }
+  if (ctx->driver_controls_lost)
+    return LED_CODE_CONTROLS_LOST;
+  if (ctx->ivt_lost)
+    return LED_CODE_IVT_LOST;
+  return LED_CODE_NONE;
+}
+
+/*****************************************************************************************************\
+ Work out the LEDs from the BMU state and write them, all four in one go, if they've changed.
+\*****************************************************************************************************/
+static void led_update(bmu_context_t *ctx, uint32_t now_ms)
+{
+  uint8_t lit = 0;
+  if (ctx->BMU.safe_to_drive)
+    lit |= LED_BIT(LED_SAFE);
+  if (ctx->BMU.contactor_state)
+    lit |= LED_BIT(LED_CONTACTOR);
+  if (relay_closed(&ctx->relays, RELAY_SOLAR))
+    lit |= LED_BIT(LED_SOLAR);
+  if (ctx->BMU.charging_state)
+    lit |= LED_BIT(LED_CHARGING);
+
+  uint32_t value = led_render(lit, led_fault_code(ctx), now_ms);
+  if (value != ctx->led_value)
+  {
+    ctx->led_value = value;
+    led_port = value;
+  }
+}
+
+static uint32_t uptime_ms(void)
+{
+  return duration_cast<milliseconds>(uptime.elapsed_time()).count();
+}
+
+static int ivt_max_current(const bmu_context_t *ctx)
+{
+  return ctx->ivt_front.current > ctx->ivt_rear.current ? ctx->ivt_front.current : ctx->ivt_rear.current;
+}
+
+static int ivt_min_current(const bmu_context_t *ctx)
+{
+  return ctx->ivt_front.current < ctx->ivt_rear.current ? ctx->ivt_front.current : ctx->ivt_rear.current;
+}
+
+static int ivt_max_voltage1(const bmu_context_t *ctx)
+{
+  return ctx->ivt_front.voltage1 > ctx->ivt_rear.voltage1 ? ctx->ivt_front.voltage1 : ctx->ivt_rear.voltage1;
+}
+
+static int ivt_min_voltage1(const bmu_context_t *ctx)
+{
+  return ctx->ivt_front.voltage1 < ctx->ivt_rear.voltage1 ? ctx->ivt_front.voltage1 : ctx->ivt_rear.voltage1;
+}
 
-static int ivt_max_current(void)
+static int ivt_max_temperature(const bmu_context_t *ctx)
 {
-  return ivt_front.current > ivt_rear.current ? ivt_front.current : ivt_rear.current;
+  return ctx->ivt_front.temperature > ctx->ivt_rear.temperature ? ctx->ivt_front.temperature : ctx->ivt_rear.temperature;
 }
 
-static int ivt_min_current(void)
+static int ivt_min_temperature(const bmu_context_t *ctx)
 {
-  return ivt_front.current > ivt_rear.current ? ivt_front.current : ivt_rear.current;
+  return ctx->ivt_front.temperature < ctx->ivt_rear.temperature ? ctx->ivt_front.temperature : ctx->ivt_rear.temperature;
 }
 
-static int ivt_max_voltage1(void)
+// Highest IVT current in 0.1A as the checks saw it, the value carried by fault events
+static int16_t stream_current(const bmu_context_t *ctx)
 {
-  return ivt_front.voltage1 > ivt_rear.voltage1 ? ivt_front.voltage1 : ivt_rear.voltage1;
+  int current = ctx->ivt_combined.max_current_ma / 100;
+  return current > INT16_MAX ? INT16_MAX : (current < INT16_MIN ? INT16_MIN : current);
 }
 
-static int ivt_min_voltage1(void)
+// Highest cell voltage in 100uV. Cells that haven't reported are skipped; if none have, estimate it from
+// the highest IVT pack voltage, in 64 bits as the IVT can report anything in 32.
+static int max_cell_voltage(const bmu_context_t *ctx)
 {
-  return ivt_front.voltage1 < ivt_rear.voltage1 ? ivt_front.voltage1 : ivt_rear.voltage1;
+  int max = 0;
+  for (int i = 0; i < 32; i++)
+  {
+    if (ctx->cell_voltages[i] > max)
+      max = ctx->cell_voltages[i];
+  }
+  if (max == 0)
+    max = (int)((int64_t)ivt_max_voltage1(ctx) * 10 / CELLS_PER_PACK);
+  return max;
 }
 
+#ifndef BMU_HOST
 int main(void) {
-    //Initialise the BMU with all the error flags set for safety, and the safe to drive flag cleared
-    BMU.over_voltage = 0;
-    BMU.under_voltage = 0;
-    BMU.over_current = 0;
-    //BMU.under_temperature = 0;
-    //BMU.over_temperature = 1;
-    BMU.safe_to_drive = 0;
+    bmu_context_t *ctx = &bmu;
 
-    //Attach the ticker to set_heartbeat_flag() at a rate of 1Hz.
-    heartbeat.attach(&set_heartbeat_flag, 1000ms);
+    bmu_context_init(ctx, &bmu_profiles[BMU_DEFAULT_PROFILE]);
+    relay_write(ctx);
+    soh_init_from_flash(ctx);
+    checkpoint_init(&checkpoints);
 
-    //Setup the CAN and attach it to the receive routine.
+    if (BMU_DEBUG)
+    {
+        can_schedule_print();
+    }
+
+    //Setup the CAN. The receive routine is attached last, once we know this isn't a bench build.
     can.frequency(500000);
-    can.attach(&CANRecieveRoutine, CAN::RxIrq);
     can.attach(&CANDataSentCallback, CAN::TxIrq);
+    // Bus errors aren't attached, they can fire on every retransmit when the bus is broken. The error
+    // counters are sampled in beat() instead.
+    can.attach(&CANArbitrationLostCallback, CAN::AlIrq);
+    can.attach(&CANErrorWarningCallback, CAN::EwIrq);
+    can.attach(&CANErrorPassiveCallback, CAN::EpIrq);
 
-    IVT_timer.start();
+    uptime.start();
+
+    //Bench build: nothing from the bus or the tickers gets in, the scenarios supply every input
+    if (BMU_SCENARIO)
+    {
+        scenario_run_bench(ctx);
+        while(1);
+    }
+
+    can.attach(&CANRecieveRoutine, CAN::RxIrq);
+    //Attach the ticker to set_heartbeat_flag() at a rate of 1Hz.
+    heartbeat.attach(&set_heartbeat_flag, milliseconds(HEARTBEAT_PERIOD_MS));
+    charger_ticker.attach(&set_charger_flag, milliseconds(CHARGER_FRAME_PERIOD_MS));
+    shell_init(&shell);
+    pc.sigio(&set_shell_flag);
+    if (BMU_SHADOW)
+        shadow_start(ctx);
 
     while(1) {
-        //Check the cell voltages, temperatures, and current and update the BMU status array to be sent over CAN
-        check_cells();
-        update_BMU_status_array();
+        uint32_t now_ms = uptime_ms();
+        bmu_loop(ctx, now_ms);
+        if(shadow_enabled)
+            shadow_step(ctx, now_ms);
+        //Lowest priority of all, after everything the loop had to do
+        if(shell_flag)
+            shell_poll(ctx);
+    }
+}
+#endif
 
-        //We want to send the BMU status every second when there are no errors
-        //When there is a new error, immediately send the BMU status, then keep sending it every second
-        if(heartbeat_flag) {
-            heartbeat_flag = false;
-            beat();
+/*****************************************************************************************************\
+ One pass of the main loop. The flags set by the tickers and the receive routine are acted on here, so
+ everything that sends CAN or drives the relays runs outside interrupt context.
+\*****************************************************************************************************/
+void bmu_loop(bmu_context_t *ctx, uint32_t now_ms) {
+    //Carry on with any relay or IVT config sequence that's waiting, before the checks act on their flags
+    sequences_step(ctx, now_ms);
+    bmu_profile_step(ctx, now_ms);
+    //Pair up the IVT readings the checks take the current and voltage from
+    ivt_combine(ctx);
+    //Check the cell voltages, temperatures, and current and update the BMU status array to be sent over CAN
+    bmu_fault_step(ctx, now_ms);
+    if(ctx->BMU_status_array[0] != ctx->previous_status)
+    {
+        uint8_t changed = ctx->BMU_status_array[0] ^ ctx->previous_status;
+        //Faults are bits 0-4, bit 5 is safe to drive and just follows them
+        for (int i = 0; i < 5; i++)
+        {
+            if ((changed >> i) & 1)
+                event_stream_emit(&ctx->stream, now_ms, ((ctx->BMU_status_array[0] >> i) & 1) ? STREAM_FAULT_SET : STREAM_FAULT_CLEAR,
+                                  i, stream_current(ctx));
         }
-        if(error_flag) {
-            if(previous_status != BMU_status_array[0])
-                beat();
+    }
+
+    //We want to send the BMU status every second when there are no errors
+    //When there is a new error, immediately send the BMU status, then keep sending it every second
+    if(heartbeat_flag) {
+        heartbeat_flag = false;
+        beat(ctx, now_ms);
+        soh_tick(ctx);
+        checkpoint_tick(&checkpoints, ctx, now_ms);
+    }
+    if(ctx->error_flag) {
+        if(ctx->previous_status != ctx->BMU_status_array[0])
+        {
+            beat(ctx, now_ms);
+            //Keep the state at the fault alongside the snapshots leading up to it. Until both IVTs have
+            //reported, their readings are 0 and trip faults that say nothing (under-temperature latches at
+            //power up), so only a fault set after that freezes the ring.
+            uint8_t raised = ctx->BMU_status_array[0] & ~ctx->previous_status & 0x1F;
+            bool ivts_reported = ctx->ivt_front_live.frames > 0 && ctx->ivt_rear_live.frames > 0;
+            if(!checkpoints.frozen && raised && ivts_reported)
+            {
+                checkpoint_take(&checkpoints, ctx, now_ms);
+                checkpoints.frozen = true;
+                if (BMU_DEBUG)
+                    printf("Checkpoints frozen at %lu ms, dump them with checkpoint <0-%d> \n", (unsigned long)now_ms,
+                           checkpoints.count - 1);
+            }
         }
-        
-        //Store the previous BMU status to prevent the same error rapidly triggering CAN messages to be sent
-        previous_status = BMU_status_array[0]; 
     }
+    if(charger_flag) {
+        charger_flag = false;
+        charger_frame(ctx, now_ms);
+    }
+    if(now_ms - ctx->time_sync_last_ms >= TIME_SYNC_PERIOD_MS) {
+        ctx->time_sync_last_ms = now_ms;
+        time_sync_send(ctx);
+    }
+    if(now_ms - ctx->led_last_ms >= LED_RENDER_MS) {
+        ctx->led_last_ms = now_ms;
+        led_update(ctx, now_ms);
+    }
+    if(now_ms - ctx->telemetry_last_ms >= TELEMETRY_PERIOD_MS) {
+        ctx->telemetry_last_ms = now_ms;
+        telemetry_send(ctx);
+    }
+    char event_array[8];
+    stream_event_t event;
+    if(now_ms - ctx->stream_sent_ms >= BMU_STREAM_MIN_INTERVAL_MS && event_stream_read(&ctx->stream, &ctx->stream_can, &event)) {
+        ctx->stream_sent_ms = now_ms;
+        event_stream_encode(&event, event_array);
+        CANMessage stream_msg(BMU_STREAM_CAN_ID, event_array, 8);
+        can_send(ctx, stream_msg);
+    }
+    if(bmu_log_level >= 2) {
+        while(event_stream_read(&ctx->stream, &ctx->stream_console, &event))
+            printf("event %lu: %lu ms, %s %u %d \n", (unsigned long)(event.sequence - 1), (unsigned long)event.time_ms,
+                   event_stream_name(event.type), event.arg, event.value);
+    }
+    //Requested by the receive routine, which can't send CAN itself
+    if(ctx->ivt_config_pending) {
+        ctx->ivt_config_pending = false;
+        config_IVT(ctx, now_ms);
+    }
+    
+    //Store the previous BMU status to prevent the same error rapidly triggering CAN messages to be sent
+    ctx->previous_status = ctx->BMU_status_array[0]; 
+
+    if (BMU_CHECK_INVARIANTS)
+    {
+        int broken = bmu_check_invariants(ctx);
+        if (broken)
+            printf("BMU invariants broken: 0x%02X \n", broken);
+    }
+}
+
+/*****************************************************************************************************\
+ Put a BMU instance into its power up state: all flags clear, not safe to drive until the first pass
+ of update_BMU_status_array() says otherwise. State of health starts from the nameplate capacity, and
+ the saved record is restored over it separately.
+\*****************************************************************************************************/
+void bmu_context_init(bmu_context_t *ctx, const bmu_config_t *config) {
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->config = config;
+    ctx->profile_request = BMU_PROFILES;
+    //Initialise the BMU with all the error flags set for safety, and the safe to drive flag cleared
+    ctx->BMU.over_voltage = 0;
+    ctx->BMU.under_voltage = 0;
+    ctx->BMU.over_current = 0;
+    //BMU.under_temperature = 0;
+    //BMU.over_temperature = 1;
+    ctx->BMU.safe_to_drive = 0;
+    relay_init(&ctx->relays);
+    charger_init(&ctx->charger);
+    soh_init(&ctx->soh_front, NULL);
+    soh_init(&ctx->soh_rear, NULL);
+    can_stats_init(&ctx->can_stats);
+    event_stream_init(&ctx->stream);
+    for (int i = 0; i < TELEMETRY_SIGNALS; i++)
+        downsample_reset(&ctx->telemetry[i]);
+    ivt_align_init(&ctx->current_align, config->ivt_current_cycle_ms);
+    ivt_align_init(&ctx->voltage_align, config->ivt_cycle_ms);
+}
+
+/*****************************************************************************************************\
+ Bytes bmu_receive() reads from each ID, 0 for IDs it ignores.
+\*****************************************************************************************************/
+static int bmu_frame_length(uint32_t id) {
+    switch(id) {
+        case CELL_VOLTAGES_BASE_ID ... CELL_VOLTAGES_BASE_ID + 0x7:
+        case CELL_TEMPERATURES_FRONT_ID:
+        case CELL_TEMPERATURES_REAR_ID:
+            return 8;
+        case DRIVER_CONTROLS_ID:
+        case BMU_PROFILE_ID:
+            return 1;
+        //IVT results are in bytes 2-5
+        case IVT_FRONT_BASE_ID ... IVT_FRONT_BASE_ID + 0x7:
+        case IVT_REAR_BASE_ID ... IVT_REAR_BASE_ID + 0x7:
+            return 6;
+        case CHARGER_STATUS_ID:
+            return 5;
+        default:
+            return 0;
+    }
+}
+
+static bool bmu_frame_valid(const CANMessage &msg) {
+    if(msg.type != CANData || msg.len > 8)
+        return false;
+    //The charger is the only node on extended IDs, so the same number as a standard ID means nothing to us
+    if((msg.format == CANExtended) != (msg.id == CHARGER_STATUS_ID))
+        return false;
+    return bmu_frame_length(msg.id) > 0 && msg.len >= bmu_frame_length(msg.id);
 }
 
 /*****************************************************************************************************\
- The most important function: the CAN message received interrupt callback.
- Tells the BMU what to do with each different message ID in a big switch statement 
+ The CAN message received interrupt callback. Reads the frame and hands it to bmu_receive().
 \*****************************************************************************************************/
 void CANRecieveRoutine (void) {
+    uint32_t now_ms = uptime_ms();
     can.read(received_msg);
+    bmu_receive(&bmu, received_msg, now_ms);
+    if(shadow_enabled)
+        bmu_receive(&shadow, received_msg, now_ms);
+}
+
+/*****************************************************************************************************\
+ The most important function: tells the BMU what to do with each different message ID in a big switch
+ statement. now_ms is the time the frame arrived.
+\*****************************************************************************************************/
+void bmu_receive(bmu_context_t *ctx, const CANMessage &received_msg, uint32_t now_ms) {
+    ctx->can_stats.rx_frames++;
+    //Anything we can't decode safely is dropped here, so the cases below can trust the length
+    if(!bmu_frame_valid(received_msg)) {
+        if(bmu_frame_length(received_msg.id) > 0)
+            ctx->can_stats.rx_dropped++;
+        return;
+    }
     switch(received_msg.id) {
         //cases 0x360 - 0x367 are cell voltage readings from the PCU.
         case CELL_VOLTAGES_BASE_ID ... CELL_VOLTAGES_BASE_ID + 0x7:
@@ -325,119 +713,130 @@ void CANRecieveRoutine (void) {
             for (int i = 0; i < 4; i++)
             {
                 int index = (received_msg.id - CELL_VOLTAGES_BASE_ID)*4 + i;
-                cell_voltages[index]
+                ctx->cell_voltages[index]
                 = ((uint8_t*)received_msg.data)[i*2] | (((uint8_t*)received_msg.data)[i*2 + 1] << 8);
             }
+            //The PCU sends all 8 back to back, so the last one completes a set
+            if (received_msg.id == CELL_VOLTAGES_BASE_ID + 0x7)
+                telemetry_sample_cells(ctx);
             break;
         }
 
         //Ignition message received by the Driver Controls board 
         case DRIVER_CONTROLS_ID:
         {
+            liveness_feed(&ctx->driver_controls_live, now_ms);
             bool ig = (received_msg.data[0] & 0x01);
-            if (ignition_demand != ig)
+            if (ctx->ignition_demand != ig)
             {
-                previous_ignition_demand = ignition_demand;
-                ignition_demand = ig;
+                ctx->previous_ignition_demand = ctx->ignition_demand;
+                ctx->ignition_demand = ig;
+                event_stream_emit(&ctx->stream, now_ms, STREAM_IGNITION, ig, 0);
             }
-            solar_demand = (bool)(received_msg.data[0] & 0x08);
+            ctx->solar_demand = (bool)(received_msg.data[0] & 0x08);
+            break;
+        }
+
+        //Applied by the main loop between passes, see bmu_profile_step()
+        case BMU_PROFILE_ID:
+        {
+            if (received_msg.data[0] < BMU_PROFILES)
+                ctx->profile_request = received_msg.data[0];
             break;
         }
 
         //Messages 0x520 - 0x527 are front IVT messages.
         case 0x520:
         {
-            ivt_front.current = (received_msg.data[5]) | (received_msg.data[4] << 8) | (received_msg.data[3] << 16) | (received_msg.data[2] << 24);
-            // For IVT_timeout
-            IVT_timer.stop();
-            IVT_time = duration_cast<milliseconds>(IVT_timer.elapsed_time()).count();
-            IVT_timer.reset();
-            IVT_timer.start();
+            ctx->ivt_front.current = (received_msg.data[5]) | (received_msg.data[4] << 8) | (received_msg.data[3] << 16) | (received_msg.data[2] << 24);
+            downsample_add(&ctx->telemetry[TELEMETRY_FRONT_CURRENT], ctx->ivt_front.current / 100);
+            ivt_align_add(&ctx->current_align.front, now_ms, ctx->ivt_front.current);
+            liveness_feed(&ctx->ivt_front_live, now_ms);
             break;
         }
 
         case 0x521:
         {
-            ivt_front.voltage1 = (received_msg.data[5]) | (received_msg.data[4] << 8) | (received_msg.data[3] << 16) | (received_msg.data[2] << 24);
+            ctx->ivt_front.voltage1 = (received_msg.data[5]) | (received_msg.data[4] << 8) | (received_msg.data[3] << 16) | (received_msg.data[2] << 24);
+            ivt_align_add(&ctx->voltage_align.front, now_ms, ctx->ivt_front.voltage1);
             break;
         }
         
         //We don't want U2 and U3 voltage readings. If the IVT is sending these (it always will when restarted) we need to configure it
         case 0x522 ... 0x523:
         {
-            config_IVT();
+            ctx->ivt_config_pending = true;
             break;
         }
         
         case 0x524:
         {
-            ivt_front.temperature = (received_msg.data[5]) | (received_msg.data[4] << 8) | (received_msg.data[3] << 16) | (received_msg.data[2] << 24);
+            ctx->ivt_front.temperature = (received_msg.data[5]) | (received_msg.data[4] << 8) | (received_msg.data[3] << 16) | (received_msg.data[2] << 24);
             break;
         }
         case 0x525:
         {
-            ivt_front.power = (received_msg.data[5]) | (received_msg.data[4] << 8) | (received_msg.data[3] << 16) | (received_msg.data[2] << 24);
+            ctx->ivt_front.power = (received_msg.data[5]) | (received_msg.data[4] << 8) | (received_msg.data[3] << 16) | (received_msg.data[2] << 24);
             break;
         }
 
         case 0x526:
         {   
-            ivt_front.charge = (received_msg.data[5]) | (received_msg.data[4] << 8) | (received_msg.data[3] << 16) | (received_msg.data[2] << 24);
+            ctx->ivt_front.charge = (received_msg.data[5]) | (received_msg.data[4] << 8) | (received_msg.data[3] << 16) | (received_msg.data[2] << 24);
             break;
         }
 
         case 0x527:
         {
-            ivt_front.energy = (received_msg.data[5]) | (received_msg.data[4] << 8) | (received_msg.data[3] << 16) | (received_msg.data[2] << 24);
+            ctx->ivt_front.energy = (received_msg.data[5]) | (received_msg.data[4] << 8) | (received_msg.data[3] << 16) | (received_msg.data[2] << 24);
             break;  
         } 
         
         //Messages 0x530 - 0x537 are rear IVT messages.
         case 0x530:
         {
-            ivt_rear.current = (received_msg.data[5]) | (received_msg.data[4] << 8) | (received_msg.data[3] << 16) | (received_msg.data[2] << 24);
-            // For IVT_timeout
-            IVT_timer.stop();
-            IVT_time = duration_cast<milliseconds>(IVT_timer.elapsed_time()).count();
-            IVT_timer.reset();
-            IVT_timer.start();
+            ctx->ivt_rear.current = (received_msg.data[5]) | (received_msg.data[4] << 8) | (received_msg.data[3] << 16) | (received_msg.data[2] << 24);
+            downsample_add(&ctx->telemetry[TELEMETRY_REAR_CURRENT], ctx->ivt_rear.current / 100);
+            ivt_align_add(&ctx->current_align.rear, now_ms, ctx->ivt_rear.current);
+            liveness_feed(&ctx->ivt_rear_live, now_ms);
             break;
         }
         
         case 0x531:
         {
-            ivt_rear.voltage1 = (received_msg.data[5]) | (received_msg.data[4] << 8) | (received_msg.data[3] << 16) | (received_msg.data[2] << 24);
+            ctx->ivt_rear.voltage1 = (received_msg.data[5]) | (received_msg.data[4] << 8) | (received_msg.data[3] << 16) | (received_msg.data[2] << 24);
+            ivt_align_add(&ctx->voltage_align.rear, now_ms, ctx->ivt_rear.voltage1);
             break;
         }
         
         //We don't want U2 and U3 voltage readings. If the IVT is sending these (it always will when restarted) we need to configure it
         case 0x532 ... 0x533:
         {
-            config_IVT();
+            ctx->ivt_config_pending = true;
             break;
         }
         
         case 0x534:
         {
-            ivt_rear.temperature = (received_msg.data[5]) | (received_msg.data[4] << 8) | (received_msg.data[3] << 16) | (received_msg.data[2] << 24);
+            ctx->ivt_rear.temperature = (received_msg.data[5]) | (received_msg.data[4] << 8) | (received_msg.data[3] << 16) | (received_msg.data[2] << 24);
             break;
         }
         
         case 0x535:
         {
-            ivt_rear.power = (received_msg.data[5]) | (received_msg.data[4] << 8) | (received_msg.data[3] << 16) | (received_msg.data[2] << 24);
+            ctx->ivt_rear.power = (received_msg.data[5]) | (received_msg.data[4] << 8) | (received_msg.data[3] << 16) | (received_msg.data[2] << 24);
             break;
         }
         
         case 0x536:
         {
-            ivt_rear.charge = (received_msg.data[5]) | (received_msg.data[4] << 8) | (received_msg.data[3] << 16) | (received_msg.data[2] << 24);
+            ctx->ivt_rear.charge = (received_msg.data[5]) | (received_msg.data[4] << 8) | (received_msg.data[3] << 16) | (received_msg.data[2] << 24);
             break;
         }
         
         case 0x537:
         {
-            ivt_rear.energy = (received_msg.data[5]) | (received_msg.data[4] << 8) | (received_msg.data[3] << 16) | (received_msg.data[2] << 24);
+            ctx->ivt_rear.energy = (received_msg.data[5]) | (received_msg.data[4] << 8) | (received_msg.data[3] << 16) | (received_msg.data[2] << 24);
             break;
         }
         
@@ -447,7 +846,7 @@ void CANRecieveRoutine (void) {
         {
             for (int i = 0; i < 8; i++)
             {
-                cell_temperatures[0][i] = received_msg.data[i];
+                ctx->cell_temperatures[0][i] = received_msg.data[i];
             }
             break;
         }
@@ -455,56 +854,104 @@ void CANRecieveRoutine (void) {
         case 0x562:
         {
             for (int i = 0; i < 8; i++) {
-                cell_temperatures[1][i] = received_msg.data[i];
+                ctx->cell_temperatures[1][i] = received_msg.data[i];
             }
             break;
         }
 
+        case CHARGER_STATUS_ID:
+        {
+            charger_decode_status(&ctx->charger, received_msg.data);
+            ctx->charger.present = true;
+            ctx->charger_last_ms = now_ms;
+            break;
+        }
+
         default:
             break;
     }
 }
 
-bool can_send(CANMessage msg){
+bool can_send(bmu_context_t *ctx, CANMessage msg){
     Timer t;
     CAN_data_sent = false;
     t.start();
     can.write(msg);
-    // Check whether elapsed time has exceeded CAN_TIMEOUT_MS. If it has, return false
-    while (!CAN_data_sent && (duration_cast<milliseconds>(t.elapsed_time()).count()) <  milliseconds(CAN_TIMEOUT_MS).count());
-    return duration_cast<milliseconds>(t.elapsed_time()).count() <= milliseconds(CAN_TIMEOUT_MS).count();
+    if(scenario_ivts)
+    {
+        for (int i = 0; i < 2; i++)
+            ivt_sim_receive(&scenario_ivts[i], msg.id, msg.data, msg.len);
+    }
+    // Check whether elapsed time has exceeded the CAN timeout. If it has, return false
+    while (!CAN_data_sent && (duration_cast<milliseconds>(t.elapsed_time()).count()) < ctx->config->can_timeout_ms);
+    // Time from write to transmit complete, i.e. queueing behind other traffic plus time on the wire
+    can_stats_record_tx(&ctx->can_stats, msg.id, msg.len, msg.format == CANExtended,
+                        duration_cast<microseconds>(t.elapsed_time()).count(), CAN_data_sent);
+    return duration_cast<milliseconds>(t.elapsed_time()).count() <= ctx->config->can_timeout_ms;
 }
 
 void CANDataSentCallback(void){
+    CAN_data_sent_us = duration_cast<microseconds>(uptime.elapsed_time()).count();
     CAN_data_sent = true;
 }
 
+void CANArbitrationLostCallback(void){
+    bmu.can_stats.arbitration_lost++;
+}
+
+void CANErrorWarningCallback(void){
+    bmu.can_stats.error_warning++;
+}
+
+void CANErrorPassiveCallback(void){
+    bmu.can_stats.error_passive++;
+}
+
 /*****************************************************************************************************\
- A function to configure the IVT. We put it in stop mode, write the set commands, and put it back
- into start mode.
+ Configure the IVTs. We put them in stop mode, write the set commands, and put them back into start
+ mode. By sending a CAN msg with ID 0x411, both the front and rear IVT will be configured; the CAN ID
+ of the front and rear IVT is not changed.
 \*****************************************************************************************************/
-void config_IVT(void) {
-    can_send(stop_msg);
-    // Wait 50 microseconds
-    wait_us(50);
-    can_send(current_setup_msg);
-    wait_us(50);
-    can_send(voltage1_setup_msg);
-    wait_us(50);
-    can_send(voltage2_setup_msg);
-    wait_us(50);
-    can_send(voltage3_setup_msg);
-    wait_us(50);
-    can_send(temperature_setup_msg);
-    wait_us(50);
-    can_send(charge_setup_msg);
-    wait_us(50);
-    can_send(power_setup_msg);
-    wait_us(50);
-    can_send(energy_setup_msg);
-    wait_us(50);
-    can_send(start_msg);
-    wait_us(50);
+#define IVT_CONFIG_COMMANDS 10
+
+// Mode for each result channel 0x20 - 0x27: 0x02 cyclic, 0x00 off
+static const char IVT_channel_modes[8] = {0x02, 0x02, 0x00, 0x00, 0x02, 0x02, 0x02, 0x02};
+
+// Command 0 is stop, 1 - 8 set up a channel each, 9 is start
+static CANMessage IVT_config_command(const bmu_config_t *config, int command)
+{
+    if (command == 0)
+        return CANMessage(IVT_CONFIG_ID, stop_mode, 5);
+    if (command == IVT_CONFIG_COMMANDS - 1)
+        return CANMessage(IVT_CONFIG_ID, start_mode, 5);
+
+    // Channel, mode, cycle time in ms big endian. Only the current runs fast.
+    int channel = command - 1;
+    int cycle_ms = channel == 0 ? config->ivt_current_cycle_ms : config->ivt_cycle_ms;
+    char setup[4] = {(char)(0x20 + channel), IVT_channel_modes[channel], (char)((cycle_ms >> 8) & 0xFF), (char)(cycle_ms & 0xFF)};
+    return CANMessage(IVT_CONFIG_ID, setup, 4);
+}
+
+// Starts the config sequence over from the stop command, even if one is already part way through
+void config_IVT(bmu_context_t *ctx, uint32_t now_ms) {
+    PT_INIT(&ctx->ivt_config_pt);
+    ctx->ivt_configuring = true;
+    event_stream_emit(&ctx->stream, now_ms, STREAM_IVT_CONFIG, 0, 0);
+    config_IVT_step(ctx, now_ms);
+}
+
+char config_IVT_step(bmu_context_t *ctx, uint32_t now_ms) {
+    pt_t *pt = &ctx->ivt_config_pt;
+
+    PT_BEGIN(pt);
+    for (pt->i = 0; pt->i < IVT_CONFIG_COMMANDS; pt->i++)
+    {
+        can_send(ctx, IVT_config_command(ctx->config, pt->i));
+        PT_SLEEP_MS(pt, now_ms, IVT_CONFIG_GAP_MS);
+    }
+    ctx->ivt_configuring = false;
+    event_stream_emit(&ctx->stream, now_ms, STREAM_IVT_CONFIG, 1, 0);
+    PT_END(pt);
 }
 
 /*****************************************************************************************************\
@@ -519,93 +966,242 @@ void set_heartbeat_flag(void) {
  The actual function we want to call whenever the ticker is triggered. This sends a BMU status message
  as well as updates contactor states.
 \*****************************************************************************************************/
-void beat(void) {
+void beat(bmu_context_t *ctx, uint32_t now_ms) {
     // If debug mode is on, print BMU status over serial
-    if (BMU_DEBUG)
+    if (bmu_log_level >= 2)
     {
-        print_bmu_status();
+        print_bmu_status(ctx);
     }
+    can_stats_record_error_counts(&ctx->can_stats, can.tderror(), can.rderror());
     //BMU will send a CAN message containing status messages
-    CANMessage BMU_status_msg(BMU_CAN_ID, BMU_status_array, 6);
-    can_send(BMU_status_msg);
+    CANMessage BMU_status_msg(BMU_CAN_ID, ctx->BMU_status_array, 6);
+    can_send(ctx, BMU_status_msg);
 
     /* Disable solar for now
-    if (solar_enable)
+    if (relay_closed(&ctx->relays, RELAY_SOLAR))
     {
         for (int i = 0; i < 3; i++)
         {
             CANMessage mppt(0x650 + (0x10 * i) + 8, "\x64", 1);
-            can_send(mppt);
+            can_send(ctx, mppt);
         }
     }
     */
 
-    update_relays();
+    update_relays(ctx, now_ms);
+}
+
+/*****************************************************************************************************\
+ Attached to the serial port, same reasoning as set_heartbeat_flag(). sigio fires when the transmit
+ buffer drains as well, and printf() drains it all the time, so only input raises the flag. readable()
+ only looks at the receive buffer, without taking a lock, so it is safe in the interrupt.
+\*****************************************************************************************************/
+void set_shell_flag(void) {
+    if (pc.readable())
+        shell_flag = true;
+}
+
+/*****************************************************************************************************\
+ Attached to the charger ticker, same reasoning as set_heartbeat_flag().
+\*****************************************************************************************************/
+void set_charger_flag(void) {
+    charger_flag = true;
+}
+
+/*****************************************************************************************************\
+ Recalculate the CC/CV current limit and send it to the charger. Nothing is sent unless a charger has
+ been heard from recently or we see charge current, so this stays off the bus while driving.
+\*****************************************************************************************************/
+void charger_frame(bmu_context_t *ctx, uint32_t now_ms) {
+    char charger_array[8];
+
+    if (ctx->charger.present && now_ms - ctx->charger_last_ms > CHARGER_TIMEOUT_MS)
+    {
+        if (BMU_DEBUG)
+        {
+            printf("Charger timeout.\n");
+        }
+        ctx->charger.present = false;
+    }
+    if (!ctx->charger.present && !ctx->BMU.charging_state)
+        return;
+
+    //Only real faults stop a charge. The driver controls are normally off on the charger, so losing them
+    //doesn't count, even though it clears safe to drive.
+    bool fault = (ctx->BMU_status_array[0] & 0x1F) != 0 || ctx->ivt_lost;
+    charger_update(&ctx->charger, max_cell_voltage(ctx), ivt_max_temperature(ctx), fault);
+    if (BMU_DEBUG)
+    {
+        printf("Charger request: %d mV, %d mA, cv_phase: %d, complete: %d \n", ctx->charger.voltage_request_mv,
+               ctx->charger.current_request_ma, ctx->charger.cv_phase, ctx->charger.charge_complete);
+    }
+    charger_encode_control(&ctx->charger, charger_array);
+    CANMessage charger_msg(CHARGER_CONTROL_ID, charger_array, 8, CANData, CANExtended);
+    can_send(ctx, charger_msg);
+}
+
+/*****************************************************************************************************\
+ Restore the capacity and cycle count of both packs from flash, falling back to nameplate values.
+\*****************************************************************************************************/
+void soh_init_from_flash(bmu_context_t *ctx) {
+    soh_record_t record;
+    if (nv_store_load(&record, sizeof(record)))
+    {
+        soh_init(&ctx->soh_front, &record.front);
+        soh_init(&ctx->soh_rear, &record.rear);
+    }
+    else
+    {
+        soh_init(&ctx->soh_front, NULL);
+        soh_init(&ctx->soh_rear, NULL);
+    }
+    ctx->soh_saved_throughput_as = ctx->soh_front.persist.discharge_throughput_as + ctx->soh_rear.persist.discharge_throughput_as;
+}
+
+/*****************************************************************************************************\
+ Called once a second. Feeds the latest IVT readings into the SoH estimators, sends the result over CAN
+ and writes it to flash when it has changed enough. Flash writes stall the CPU so they wait until the
+ ignition is off.
+\*****************************************************************************************************/
+void soh_tick(bmu_context_t *ctx) {
+    char soh_array[8];
+
+    //A pack's readings only mean something once its IVT has sent a current, the voltage is checked in soh_update()
+    if (ctx->ivt_front_live.frames > 0)
+        soh_update(&ctx->soh_front, ctx->ivt_front.charge, ctx->ivt_front.current, ctx->ivt_front.voltage1, ctx->ivt_front.temperature, 1000);
+    if (ctx->ivt_rear_live.frames > 0)
+        soh_update(&ctx->soh_rear, ctx->ivt_rear.charge, ctx->ivt_rear.current, ctx->ivt_rear.voltage1, ctx->ivt_rear.temperature, 1000);
+
+    int front_cycles = soh_equivalent_cycles_x10(&ctx->soh_front) / 10;
+    int rear_cycles = soh_equivalent_cycles_x10(&ctx->soh_rear) / 10;
+    int usable_energy = soh_usable_energy_wh(&ctx->soh_front, CELLS_PER_PACK) + soh_usable_energy_wh(&ctx->soh_rear, CELLS_PER_PACK);
+    //Big endian, like the other BMU frames
+    soh_array[0] = soh_health(&ctx->soh_front) >> 8;
+    soh_array[1] = soh_health(&ctx->soh_front) & 0xFF;
+    soh_array[2] = soh_health(&ctx->soh_rear) >> 8;
+    soh_array[3] = soh_health(&ctx->soh_rear) & 0xFF;
+    soh_array[4] = usable_energy >> 8;
+    soh_array[5] = usable_energy & 0xFF;
+    soh_array[6] = front_cycles > 0xFF ? 0xFF : front_cycles;
+    soh_array[7] = rear_cycles > 0xFF ? 0xFF : rear_cycles;
+    CANMessage soh_msg(BMU_SOH_CAN_ID, soh_array, 8);
+    can_send(ctx, soh_msg);
+
+    uint32_t throughput = ctx->soh_front.persist.discharge_throughput_as + ctx->soh_rear.persist.discharge_throughput_as;
+    if (!ctx->ignition_demand && (ctx->soh_front.dirty || ctx->soh_rear.dirty || throughput - ctx->soh_saved_throughput_as > SOH_SAVE_THROUGHPUT_AS))
+    {
+        soh_record_t record = {ctx->soh_front.persist, ctx->soh_rear.persist};
+        if (nv_store_save(&record, sizeof(record)))
+        {
+            ctx->soh_front.dirty = false;
+            ctx->soh_rear.dirty = false;
+            ctx->soh_saved_throughput_as = throughput;
+        }
+        else if (BMU_DEBUG)
+        {
+            printf("Failed to save state of health.\n");
+        }
+    }
 }
 
 /*****************************************************************************************************\
  Precharge routine whenever the car is turned on: connect the motor controller across the precharge
  resistor, and once up to voltage close the main contactor and disconnect the precharge resistor.
  This requires the PCU contactor to be on. 
+
+ precharge() starts the sequence and precharge_step() carries it on from the main loop, so the waits
+ don't hold up fault monitoring. A fault part way through starts a discharge, which cancels it.
 \*****************************************************************************************************/
-void precharge(void) {
-    //If we're precharging, then we're no longer discharged.
-    BMU.discharge_state = false;
+void precharge(bmu_context_t *ctx, uint32_t now_ms) {
+    //Takes over from a discharge that hasn't finished yet
+    ctx->currently_discharging = false;
     //A flag to say we're currently precharging
-    currently_precharging = true;
-    //The discharge relay should already be open, but just to make sure we open it again
-    dischg_disable = 1;
-    //close precharge relay
-    prechg_enable = 1;
+    ctx->currently_precharging = true;
+    event_stream_emit(&ctx->stream, now_ms, STREAM_PRECHARGE, 0, 0);
+    PT_INIT(&ctx->precharge_pt);
+    precharge_step(ctx, now_ms);
+}
+
+char precharge_step(bmu_context_t *ctx, uint32_t now_ms) {
+    pt_t *pt = &ctx->precharge_pt;
+
+    PT_BEGIN(pt);
+    //If we're precharging, then we're no longer discharged.
+    ctx->BMU.discharge_state = false;
+    //The discharge relay should already be open, but just to make sure we open it again, in the same
+    //write as closing the precharge relay. Waits out the dwell if the precharge relay only just opened.
+    PT_WAIT_UNTIL(pt, relay_switch(ctx, RELAY_BIT(RELAY_DISCHARGE), RELAY_BIT(RELAY_PRECHARGE), now_ms));
     if (BMU_DEBUG)
     {
         printf("Precharge relay closed.");
     }
     //Small 0.5s for safety, then wait until there's no more current flowing through the precharge resistor
-    // However, in general it is not a good practice to wait for that long in ISR
-    wait_us(500000);
-    //This is a place where it's possible for the BMU to freeze up
-    while(!prechg_detect);
+    PT_SLEEP_MS(pt, now_ms, PRECHARGE_SETTLE_MS);
+    //This can wait forever, but only this sequence waits; a fault still gets the relays opened
+    PT_WAIT_UNTIL(pt, precharge_detected());
     //close the HV box contactor and open the precharge relay
-    hvdc_enable = 1;
+    PT_WAIT_UNTIL(pt, relay_switch(ctx, 0, RELAY_BIT(RELAY_HVDC), now_ms));
     if (BMU_DEBUG)
     {
         printf("HVDC relay closed.");
     }
-    // Wait for 0.1 seconds
-    wait_us(100000);
-    prechg_enable = 0;
+    PT_SLEEP_MS(pt, now_ms, CONTACTOR_OVERLAP_MS);
+    relay_switch(ctx, RELAY_BIT(RELAY_PRECHARGE), 0, now_ms);
     if (BMU_DEBUG)
     {
         printf("Precharge relay opened.");
     }
     //We are now no longer precharging
-    currently_precharging = false;
+    ctx->currently_precharging = false;
     //a flag to make sure we don't precharge again if already precharged
     //this flag will only be cleared upon discharging
-    BMU.precharge_state = true;
+    ctx->BMU.precharge_state = true;
+    event_stream_emit(&ctx->stream, now_ms, STREAM_PRECHARGE, 1, 0);
+    PT_END(pt);
 }
 
 /*****************************************************************************************************\
  Discharge routine whenever the car is turned off (either manually or due to an error):
- Open the HV box contactor and close the discharge relay
+ Open the HV box contactor and close the discharge relay. The contactor opens straight away, in the
+ same pass of the main loop as the request.
 \*****************************************************************************************************/
-void discharge(void) {
-    //If we're discharging we're no longer precharged
-    BMU.precharge_state = false;
+void discharge(bmu_context_t *ctx, uint32_t now_ms) {
+    //Abandon a precharge in progress, the relays are put right below
+    ctx->currently_precharging = false;
     //A flag to say we're currently discharging
-    currently_discharging = true;
-    //The precharge relay should already be open, but just to make sure we open it again
-    prechg_enable = 0;
-    //Open the HV box contactor and close the discharge relay
-    hvdc_enable = 0;
-    // Wait for 0.1s, not a good practice to wait for that long in ISR
-    wait_us(100000);
-    dischg_disable = 0;
+    ctx->currently_discharging = true;
+    event_stream_emit(&ctx->stream, now_ms, STREAM_DISCHARGE, 0, 0);
+    PT_INIT(&ctx->discharge_pt);
+    discharge_step(ctx, now_ms);
+}
+
+char discharge_step(bmu_context_t *ctx, uint32_t now_ms) {
+    pt_t *pt = &ctx->discharge_pt;
+
+    PT_BEGIN(pt);
+    //If we're discharging we're no longer precharged
+    ctx->BMU.precharge_state = false;
+    //The precharge relay should already be open, but just to make sure we open it along with the HV box contactor
+    relay_switch(ctx, RELAY_BIT(RELAY_PRECHARGE) | RELAY_BIT(RELAY_HVDC), 0, now_ms);
+    //Then close the discharge relay
+    PT_SLEEP_MS(pt, now_ms, CONTACTOR_OVERLAP_MS);
+    PT_WAIT_UNTIL(pt, relay_switch(ctx, 0, RELAY_BIT(RELAY_DISCHARGE), now_ms));
     //Might want to add a delay here as we don't have a discharge detect; can measure the time it takes to discharge the HV caps and use that value
     //Without that delay it will look like the discharge process is instantaneous
-    currently_discharging = false;
-    BMU.discharge_state = true;
+    ctx->currently_discharging = false;
+    ctx->BMU.discharge_state = true;
+    event_stream_emit(&ctx->stream, now_ms, STREAM_DISCHARGE, 1, 0);
+    PT_END(pt);
+}
+
+// Step whichever sequences are in progress. Each clears its own flag when it finishes.
+void sequences_step(bmu_context_t *ctx, uint32_t now_ms) {
+    if (ctx->currently_precharging)
+        precharge_step(ctx, now_ms);
+    if (ctx->currently_discharging)
+        discharge_step(ctx, now_ms);
+    if (ctx->ivt_configuring)
+        config_IVT_step(ctx, now_ms);
 }
 
 /*****************************************************************************************************\
@@ -613,24 +1209,26 @@ void discharge(void) {
  This is only called in the beat() function but I've kept it separate so we can call it on its own
  if desired.
 \*****************************************************************************************************/
-void update_relays(void) {
+void update_relays(bmu_context_t *ctx, uint32_t now_ms) {
+    char contactor_array[1];
+
     //Self explanatory, if the car is on and it's safe then turn on contactors & precharge if needed
-    if(ignition_demand && !previous_ignition_demand && BMU.safe_to_drive) {
+    if(ctx->ignition_demand && !ctx->previous_ignition_demand && ctx->BMU.safe_to_drive) {
         if (BMU_DEBUG)
         {
             printf("Contactors are engaged. \n");
         }
         contactor_array[0] = 0x01;
-        contactor_indic = 1;
-        CANMessage contactor_msg(0x34F, contactor_array, 1);
-        can_send(contactor_msg);
-        if(!BMU.precharge_state)
+        ctx->BMU.contactor_state = true;
+        CANMessage contactor_msg(CONTACTOR_ID, contactor_array, 1);
+        can_send(ctx, contactor_msg);
+        if(!ctx->BMU.precharge_state && !ctx->currently_precharging)
         {
             if (BMU_DEBUG)
             {
                 printf("Start precharge sequence. \n");
             }
-            precharge();
+            precharge(ctx, now_ms);
         }
     }
 
@@ -641,235 +1239,209 @@ void update_relays(void) {
             printf("Contactors are disengaged. \n");
         }
         contactor_array[0] = 0x00;
-        CANMessage contactor_msg(0x34F, contactor_array, 1);
-        can_send(contactor_msg);
-        if(!BMU.discharge_state)
+        ctx->BMU.contactor_state = false;
+        CANMessage contactor_msg(CONTACTOR_ID, contactor_array, 1);
+        can_send(ctx, contactor_msg);
+        if(!ctx->BMU.discharge_state && !ctx->currently_discharging)
         {
             if (BMU_DEBUG)
             {
                 printf("Start discharge. \n");
             }
-            discharge();
+            discharge(ctx, now_ms);
         }
 
-        solar_enable = (solar_demand && BMU.safe_to_drive);
-        solar_indic = solar_enable;
+        bool solar = ctx->solar_demand && ctx->BMU.safe_to_drive;
+        relay_switch(ctx, solar ? 0 : RELAY_BIT(RELAY_SOLAR), solar ? RELAY_BIT(RELAY_SOLAR) : 0, now_ms);
     }
 }
 
+/*****************************************************************************************************\
+ Downsampled telemetry. Samples are added from the receive routine as frames are decoded; every
+ TELEMETRY_PERIOD_MS each signal's min/max/mean/last goes out on its own ID, so spikes between frames
+ are never lost.
+\*****************************************************************************************************/
+void telemetry_sample_cells(bmu_context_t *ctx) {
+    int min = 0;
+    int max = 0;
+
+    //Cells reading 0 haven't reported
+    for (int i = 0; i < 32; i++)
+    {
+        if (ctx->cell_voltages[i] == 0)
+            continue;
+        if (min == 0 || ctx->cell_voltages[i] < min)
+            min = ctx->cell_voltages[i];
+        if (ctx->cell_voltages[i] > max)
+            max = ctx->cell_voltages[i];
+    }
+    if (max == 0)
+        return;
+    //Cell voltages are in 100uV
+    downsample_add(&ctx->telemetry[TELEMETRY_MIN_CELL_VOLTAGE], min / 10);
+    downsample_add(&ctx->telemetry[TELEMETRY_MAX_CELL_VOLTAGE], max / 10);
+}
+
+void telemetry_send(bmu_context_t *ctx) {
+    char telemetry_array[8];
+    downsample_result_t result;
+
+    for (int i = 0; i < TELEMETRY_SIGNALS; i++)
+    {
+        //The receive routine adds to these
+        core_util_critical_section_enter();
+        bool have = downsample_take(&ctx->telemetry[i], &result);
+        core_util_critical_section_exit();
+        if (!have)
+            continue;
+        downsample_encode(&result, telemetry_array);
+        CANMessage telemetry_msg(BMU_TELEMETRY_BASE_ID + i, telemetry_array, 8);
+        can_send(ctx, telemetry_msg);
+    }
+}
+
+/*****************************************************************************************************\
+ Combine the front and rear IVTs on aligned pairs (see ivt_align.h), once per new current pair. The
+ voltage pair only comes once a second, so the latest one is used with each current pair. Sums and
+ differences are taken in 64 bits and saturated, a bad reading can be anything an int32 can hold.
+
+ Also picks the worst of front and rear for the current and voltage checks, from the aligned pair.
+ Without one, at start up or with one IVT gone quiet, they get the latest readings as they are, so a
+ quiet IVT never hides what the other one sees; the IVT timeout deals with the quiet one. Runs every
+ pass, before the checks.
+\*****************************************************************************************************/
+static int ivt_saturate(int64_t value) {
+    return value > INT32_MAX ? INT32_MAX : (value < INT32_MIN ? INT32_MIN : (int)value);
+}
+
+void ivt_combine(bmu_context_t *ctx) {
+    ivt_pair_t current;
+    ivt_pair_t voltage;
+
+    //The receive routine adds samples
+    core_util_critical_section_enter();
+    bool have_current = ivt_align_pair(&ctx->current_align, &current);
+    bool have_voltage = ivt_align_pair(&ctx->voltage_align, &voltage);
+    core_util_critical_section_exit();
+
+    ctx->ivt_combined.current_aligned = have_current;
+    ctx->ivt_combined.max_current_ma = have_current ? (current.front > current.rear ? current.front : current.rear) : ivt_max_current(ctx);
+    ctx->ivt_combined.min_current_ma = have_current ? (current.front < current.rear ? current.front : current.rear) : ivt_min_current(ctx);
+    ctx->ivt_combined.voltage_aligned = have_voltage;
+    ctx->ivt_combined.max_voltage_mv = have_voltage ? (voltage.front > voltage.rear ? voltage.front : voltage.rear) : ivt_max_voltage1(ctx);
+    ctx->ivt_combined.min_voltage_mv = have_voltage ? (voltage.front < voltage.rear ? voltage.front : voltage.rear) : ivt_min_voltage1(ctx);
+
+    if(!have_current || current.time_ms == ctx->ivt_combined.time_ms)
+        return;
+    int64_t mismatch = (int64_t)current.front - current.rear;
+    ctx->ivt_combined.time_ms = current.time_ms;
+    ctx->ivt_combined.current_ma = (int)(((int64_t)current.front + current.rear) / 2);
+    ctx->ivt_combined.current_mismatch_ma = ivt_saturate(mismatch);
+    if(mismatch > IVT_MISMATCH_MA || -mismatch > IVT_MISMATCH_MA)
+        ctx->ivt_mismatch_count++;
+    if(have_voltage)
+        ctx->ivt_combined.voltage_mv = ivt_saturate((int64_t)voltage.front + voltage.rear);
+    ctx->ivt_combined.power_w = ivt_saturate((int64_t)ctx->ivt_combined.voltage_mv * ctx->ivt_combined.current_ma / 1000000);
+}
+
+/*****************************************************************************************************\
+ Vehicle time sync, see time_sync.h. The follow up carries the time the SYNC actually finished on the
+ bus, taken in the transmit interrupt, so queueing and arbitration delays don't count. If the SYNC
+ didn't go out there's no follow up and the other nodes wait for the next one.
+\*****************************************************************************************************/
+void time_sync_send(bmu_context_t *ctx) {
+    char sync_array[1];
+    char follow_up_array[8];
+
+    ctx->time_sync_sequence++;
+    time_sync_encode_sync(ctx->time_sync_sequence, sync_array);
+    CANMessage sync_msg(TIME_SYNC_ID, sync_array, 1);
+    if(!can_send(ctx, sync_msg) || !CAN_data_sent)
+        return;
+    time_sync_encode_follow_up(ctx->time_sync_sequence, CAN_data_sent_us, follow_up_array);
+    CANMessage follow_up_msg(TIME_FOLLOW_UP_ID, follow_up_array, 8);
+    can_send(ctx, follow_up_msg);
+}
+
 /*****************************************************************************************************\
  A function that checks cell voltages, temperatures, and IVT current to make sure they are within the
  operating limits. This updates the BMU struct but NOT the BMU status array to be sent over CAN.
+ Current and voltage are the worst of the front and rear IVT taken at the same moment, from
+ ivt_combine(), so a fault is never set or cleared by comparing readings up to a cycle apart.
 \*****************************************************************************************************/
-void check_cells(void) {
+void check_cells(bmu_context_t *ctx) {
+    const ivt_combined_t *ivt = &ctx->ivt_combined;
+
     //Check whether we are charging
-    if(ivt_max_current() < 0)
+    if(ivt->max_current_ma < 0)
     {
         if (BMU_DEBUG)
         {
             printf("BMU detected charging through IVT.\n");
-            printf("front_IVT_current: %d mA, rear_IVT_current: %d mA \n", ivt_front.current, ivt_rear.current);
+            printf("front_IVT_current: %d mA, rear_IVT_current: %d mA \n", ctx->ivt_front.current, ctx->ivt_rear.current);
         }
-        BMU.charging_state = true;
-        charge_indic = 1;
+        ctx->BMU.charging_state = true;
     }
     else
     {
-        BMU.charging_state = false;
-        charge_indic = 0;
+        ctx->BMU.charging_state = false;
     }
-    //Check the max current isn't exceeded in both charging and discharging directions for both IVTs
-    if(ivt_max_current() >= max_current || ivt_min_current() < max_charging_current) {
-        if (BMU_DEBUG)
-        {
-            printf("BMU detected over current through IVT.\n");
-            printf("front_IVT_current: %d mA, rear_IVT_current: %d mA \n", ivt_front.current, ivt_rear.current);
-        }
-        BMU.over_current = true;
-        // current_led = 1;
-    }
-    else {
-        BMU.over_current = false;
-        // current_led = 0;
-    }
-    //This bit is for the subsequent iterations of the code, to add some hysteresis into the under/over-voltage triggers
-    if(over_voltage_flag)
-        temp_max_battery_pack_voltage_mv = max_battery_pack_voltage_mv + battery_pack_hysteresis;
-    else
-        temp_max_battery_pack_voltage_mv = max_battery_pack_voltage_mv;
-
-    if(under_voltage_flag)
-        temp_min_battery_pack_voltage_mv = min_battery_pack_voltage_mv - battery_pack_hysteresis;
-    else
-        temp_min_battery_pack_voltage_mv = min_battery_pack_voltage_mv;
-    //Clear these flags before checking the cells, set them if we detect an over/under-voltage cell
-    over_voltage_flag = false;
-    under_voltage_flag = false;
-    
-    /*
-    // Cell monitoring is only working for cells in one of the battery pack, disabled for now
-    // Check individual cell voltages
-    for(int i = 0; i < 32; i++) 
+    //Check the max current isn't exceeded in both charging and discharging directions for both IVTs. Reaching
+    //the discharge limit already trips, hence the - 1.
+    bool over_current = over_limit::step(ctx->BMU.over_current, ivt->max_current_ma, ctx->config->max_discharge_current_ma - 1, 0)
+                        || under_limit::step(ctx->BMU.over_current, ivt->min_current_ma, ctx->config->max_charge_current_ma, 0);
+    if (BMU_DEBUG && over_current && !ctx->BMU.over_current)
     {
-        // Final 16 cell voltages are reporting all zero so not checking
-        if (i >= 16)
-        {
-            // XXX bodge:
-            continue;
-        }
-        
-        
-        if (cell_voltages[i] < tmp_min_cell_voltage) {
-            BMU.under_voltage = true;
-            under_voltage_flag = true;
-        }
-        if (cell_voltages[i] > tmp_max_cell_voltage) {
-            BMU.over_voltage = true;
-            over_voltage_flag = true;
-        }
+        printf("BMU detected over current through IVT.\n");
+        printf("front_IVT_current: %d mA, rear_IVT_current: %d mA \n", ctx->ivt_front.current, ctx->ivt_rear.current);
     }
-    */
+    ctx->BMU.over_current = over_current;
 
-    // Check over/under voltage through IVT voltage
+    // Check over/under voltage through IVT voltage, the worst of the two packs
     // Each battery pack is 16S48P, so max_voltage  = 4.19*16 = 67.04V = 67040mV
     // under_voltage = 3.00*16 = 48V = 48000mV
-    // Check front IVT first
-    if (ivt_front.voltage1 > temp_max_battery_pack_voltage_mv)
-    {
-        if (BMU_DEBUG)
-        {
-            printf("BMU detected over voltage in front IVT.\n");
-            printf("front_IVT_voltage: %d mV \n", ivt_front.voltage1);
-        }
-        over_voltage_flag = true;
-        BMU.over_voltage = true;
-    }
-    if (ivt_front.voltage1 < temp_min_battery_pack_voltage_mv) {
-        if (BMU_DEBUG)
-            {
-                printf("BMU detected under voltage in front IVT.\n");
-                printf("front_IVT_voltage: %d mV \n", ivt_front.voltage1);
-            }
-        under_voltage_flag = true;
-        BMU.under_voltage = true;
-    }
-    // Check rear IVT
-    if (ivt_rear.voltage1 > temp_max_battery_pack_voltage_mv)
+    bool over_voltage = over_limit::step(ctx->BMU.over_voltage, ivt->max_voltage_mv, ctx->config->max_pack_voltage_mv,
+                                         ctx->config->pack_voltage_hysteresis_mv);
+    bool under_voltage = under_limit::step(ctx->BMU.under_voltage, ivt->min_voltage_mv, ctx->config->min_pack_voltage_mv,
+                                           ctx->config->pack_voltage_hysteresis_mv);
+    if (BMU_DEBUG && ((over_voltage && !ctx->BMU.over_voltage) || (under_voltage && !ctx->BMU.under_voltage)))
     {
-        if (BMU_DEBUG)
-        {
-            printf("BMU detected over voltage in rear IVT.\n");
-            printf("rear_IVT_voltage: %d mV \n", ivt_rear.voltage1);
-        }
-        over_voltage_flag = true;
-        BMU.over_voltage = true;
-    }
-    if (ivt_rear.voltage1 < temp_min_battery_pack_voltage_mv) {
-        if (BMU_DEBUG)
-            {
-                printf("BMU detected under voltage in rear IVT.\n");
-                printf("rear_IVT_voltage: %d mV \n", ivt_rear.voltage1);
-            }
-        under_voltage_flag = true;
-        BMU.under_voltage = true;
-    }
-
-    if(over_voltage_flag == false && under_voltage_flag == false) {
-        BMU.under_voltage = false;
-        BMU.over_voltage = false;
+        printf("BMU detected %s voltage through IVT.\n", over_voltage ? "over" : "under");
+        printf("front_IVT_voltage: %d mV, rear_IVT_voltage: %d mV \n", ctx->ivt_front.voltage1, ctx->ivt_rear.voltage1);
     }
+    ctx->BMU.over_voltage = over_voltage;
+    ctx->BMU.under_voltage = under_voltage;
 
-    // Disabled because we are not directly monitoring cell voltages
     /*
-    //If none of the cells are over/under-voltage, clear the BMU struct under/over-voltage flags
-    if(over_voltage_flag == false && under_voltage_flag == false) {
-        BMU.under_voltage = false;
-        BMU.over_voltage = false;
-    }
+    // Cell monitoring is only working for cells in one of the battery pack, disabled for now. The final
+    // 16 cell voltages are reporting all zero, so only the first 16 would be checked. Cell voltages are in
+    // 100uV and need a min_cell_voltage() to go with max_cell_voltage().
+    ctx->BMU.over_voltage |= over_limit::step(ctx->BMU.over_voltage, max_cell_voltage(ctx), MAX_CELL_VOLTAGE, VOLTAGE_HYSTERESIS);
+    ctx->BMU.under_voltage |= under_limit::step(ctx->BMU.under_voltage, min_cell_voltage(ctx), MIN_CELL_VOLTAGE, VOLTAGE_HYSTERESIS);
     */
 
-    // Monitoring temperature of front IVT, convert to degree celsius first 
-    if ((ivt_front.temperature*0.1) > MAX_IVT_TEMPERATURE)
+    // Monitoring temperature of both IVTs, all in 0.1 degC. Temperature faults latch until power off, so
+    // there is no hysteresis to clear them by.
+    bool over_temperature = over_limit_latched::step(ctx->BMU.over_temperature, ivt_max_temperature(ctx),
+                                                     ctx->config->max_ivt_temperature, 0);
+    bool under_temperature = under_limit_latched::step(ctx->BMU.under_temperature, ivt_min_temperature(ctx),
+                                                       ctx->config->min_ivt_temperature, 0);
+    if (BMU_DEBUG && ((over_temperature && !ctx->BMU.over_temperature) || (under_temperature && !ctx->BMU.under_temperature)))
     {
-        if(BMU_DEBUG)
-        {
-            printf("BMU detected over temperature in front IVT. \n");
-            printf("front_IVT_temperature: %.2f C \n", (ivt_front.temperature*0.1));
-        }
-        over_temperature_flag = true;
-        BMU.over_temperature = true;
-    }
-    if ((ivt_front.temperature*0.1) < MIN_IVT_TEMPERATURE) 
-    {
-        if(BMU_DEBUG)
-        {
-            printf("BMU detected under temperature in front IVT. \n");
-            printf("front_IVT_temperature: %.2f C \n", (ivt_front.temperature*0.1));
-        }
-        under_voltage_flag = true;
-        BMU.under_temperature = true;
+        printf("BMU detected %s temperature in IVT. \n", over_temperature ? "over" : "under");
+        printf("front_IVT_temperature: %.2f C, rear_IVT_temperature: %.2f C \n", (ctx->ivt_front.temperature*0.1),
+               (ctx->ivt_rear.temperature*0.1));
     }
-
-    // Monitoring temperature of rear IVT, convert to degree celsius first 
-    if ((ivt_rear.temperature*0.1) > MAX_IVT_TEMPERATURE)
-    {
-        if(BMU_DEBUG)
-        {
-            printf("BMU detected over temperature in rear IVT. \n");
-            printf("rear_IVT_temperature: %.2f C \n", (ivt_rear.temperature*0.1));
-        }
-        over_temperature_flag = true;
-        BMU.over_temperature = true;
-    }
-    if ((ivt_rear.temperature*0.1) < MIN_IVT_TEMPERATURE) 
-    {
-        if(BMU_DEBUG)
-        {
-            printf("BMU detected under temperature in rear IVT. \n");
-            printf("front_IVT_temperature: %.2f C \n", (ivt_rear.temperature*0.1));
-        }
-        under_temperature_flag = true;
-        BMU.under_temperature = true;
-    }
-
-    if(over_temperature_flag == false && under_temperature_flag == false) {
-        BMU.under_temperature = false;
-        BMU.over_temperature = false;
-    }
-
+    ctx->BMU.over_temperature = over_temperature;
+    ctx->BMU.under_temperature = under_temperature;
 
     /*
-    //Same thing as the voltage, except now for temperature.
-    if(over_temperature_flag)
-        temp_max_cell_temperature = max_cell_temperature - temperature_hysteresis;
-    else
-        temp_max_cell_temperature = max_cell_temperature;
-
-    if(under_temperature_flag)
-        temp_min_cell_temperature = min_cell_temperature + temperature_hysteresis;
-    else
-        temp_min_cell_temperature = min_cell_temperature;
-
-    over_temperature_flag = false;
-    under_temperature_flag = false;
-
-    for(int i = 0; i < 1; i++) { //i should go up to 34 in the final, just checking the first one for the test rig 
-        for(int j = 0; j < 1; j++) { //j should go up to 6 in the final, just checking the first one for the test rig
-            if(cell_temperatures[i][j] < temp_min_cell_temperature) {
-                BMU.under_temperature = true;
-                under_temperature_flag = true;
-            }
-            if(cell_temperatures[i][j] > temp_max_cell_temperature) {
-                BMU.over_temperature = true;
-                over_temperature_flag = true;
-            }
-        }
-    }
-
-    if(over_temperature_flag == false && under_temperature_flag == false) {
-        BMU.under_temperature = false;
-        BMU.over_temperature = false;
-    }
+    //Same thing as the voltage, except now for cell temperature. i should go up to 34 and j to 6 in the final,
+    //just checking the first one for the test rig
+    ctx->BMU.over_temperature |= over_limit_latched::step(ctx->BMU.over_temperature, ctx->cell_temperatures[0][0],
+                                                          MAX_CELL_TEMPERATURE, TEMPERATURE_HYSTERESIS);
+    ctx->BMU.under_temperature |= under_limit_latched::step(ctx->BMU.under_temperature, ctx->cell_temperatures[0][0],
+                                                            MIN_CELL_TEMPERATURE, TEMPERATURE_HYSTERESIS);
     */
 }
 
@@ -877,107 +1449,677 @@ void check_cells(void) {
  This function checks the BMU struct for various flags and updates the BMU status array (the bytes
  sent over CAN) accordingly.
 \*****************************************************************************************************/
-void update_BMU_status_array(void) {
+void update_BMU_status_array(bmu_context_t *ctx, uint32_t now_ms) {
     //This flag is there to trigger beat() outside the ticker as soon as an error is detected
-    error_flag = false;
-    if(IVT_time > milliseconds(IVT_TIMEOUT_MS).count())
+    ctx->error_flag = false;
+    //Either IVT going quiet means we can't see the current in that pack any more
+    bool ivt_lost = liveness_expired(&ctx->ivt_front_live, now_ms, ctx->config->ivt_timeout_ms)
+                    || liveness_expired(&ctx->ivt_rear_live, now_ms, ctx->config->ivt_timeout_ms);
+    if(ivt_lost)
     {
-        if (BMU_DEBUG)
+        if (BMU_DEBUG && !ctx->ivt_lost)
         {
             printf("IVT timeout.");
         }
-        error_flag = true;
+        ctx->error_flag = true;
     }
+    if(ivt_lost != ctx->ivt_lost)
+        event_stream_emit(&ctx->stream, now_ms, STREAM_TIMEOUT, STREAM_SOURCE_IVT, ivt_lost);
+    ctx->ivt_lost = ivt_lost;
+    //Without the driver controls we don't know the ignition any more, so treat it like a fault: the
+    //ignition is dropped below and the next beat() discharges. Cleared by the next frame from them.
+    bool driver_controls_lost = liveness_expired(&ctx->driver_controls_live, now_ms, ctx->config->driver_controls_timeout_ms);
+    if(driver_controls_lost)
+    {
+        if (BMU_DEBUG && !ctx->driver_controls_lost)
+        {
+            printf("Driver controls timeout.");
+        }
+        ctx->error_flag = true;
+        ctx->BMU_status_array[1] |= 1<<3;
+    }
+    else
+        ctx->BMU_status_array[1] &= ~(1<<3);
+    if(driver_controls_lost != ctx->driver_controls_lost)
+        event_stream_emit(&ctx->stream, now_ms, STREAM_TIMEOUT, STREAM_SOURCE_DRIVER_CONTROLS, driver_controls_lost);
+    ctx->driver_controls_lost = driver_controls_lost;
     //Check current
-    if(BMU.over_current) {
-        BMU_status_array[0] |= 1<<0;
-        error_flag = true;
+    if(ctx->BMU.over_current) {
+        ctx->BMU_status_array[0] |= 1<<0;
+        ctx->error_flag = true;
     }
     else
-        BMU_status_array[0] &= ~(1<<0);
+        ctx->BMU_status_array[0] &= ~(1<<0);
     //Check under-voltage
-    if(BMU.under_voltage) {
-        BMU_status_array[0] |= 1<<1;
-        error_flag = true;
+    if(ctx->BMU.under_voltage) {
+        ctx->BMU_status_array[0] |= 1<<1;
+        ctx->error_flag = true;
     }
     else
-        BMU_status_array[0] &= ~(1<<1);
+        ctx->BMU_status_array[0] &= ~(1<<1);
     //Check over-voltage
-    if(BMU.over_voltage) {
-        BMU_status_array[0] |= 1<<2;
-        error_flag = true;        
+    if(ctx->BMU.over_voltage) {
+        ctx->BMU_status_array[0] |= 1<<2;
+        ctx->error_flag = true;        
     }
     else
-        BMU_status_array[0] &= ~(1<<2);
+        ctx->BMU_status_array[0] &= ~(1<<2);
     //Check under-temperature
-    if(BMU.under_temperature) {
-        BMU_status_array[0] |= 1<<3;
-        error_flag = true;
+    if(ctx->BMU.under_temperature) {
+        ctx->BMU_status_array[0] |= 1<<3;
+        ctx->error_flag = true;
     }
     else
-        BMU_status_array[0] &= ~(1<<3);
+        ctx->BMU_status_array[0] &= ~(1<<3);
     //Check over-temperature
-    if(BMU.over_temperature) {
-        BMU_status_array[0] |= 1<<4;
-        error_flag = true;
+    if(ctx->BMU.over_temperature) {
+        ctx->BMU_status_array[0] |= 1<<4;
+        ctx->error_flag = true;
     }
     else
-        BMU_status_array[0] &= ~(1<<4);
+        ctx->BMU_status_array[0] &= ~(1<<4);
     //If there was an error, turn off the ignition and clear the safe to drive flag
-    if(error_flag) {
-        BMU.safe_to_drive = false;
-        BMU_status_array[0] &= ~(1<<5);
-        safe_indic = 0;
-        if (ignition_demand)
+    if(ctx->error_flag) {
+        ctx->BMU.safe_to_drive = false;
+        ctx->BMU_status_array[0] &= ~(1<<5);
+        if (ctx->ignition_demand)
         {                
-            ignition_demand = false;
-            previous_ignition_demand = true;
+            ctx->ignition_demand = false;
+            ctx->previous_ignition_demand = true;
+            event_stream_emit(&ctx->stream, now_ms, STREAM_IGNITION, 0, 1);
         }
     }
     //If no errors, tell us it's safe to drive
     else {
-        BMU.safe_to_drive = true;
-        BMU_status_array[0] |= 1<<5;
-        safe_indic = 1;
+        ctx->BMU.safe_to_drive = true;
+        ctx->BMU_status_array[0] |= 1<<5;
     }
     //Charging flag
-    if(BMU.charging_state)
-        BMU_status_array[1] |= 1<<0;
+    if(ctx->BMU.charging_state)
+        ctx->BMU_status_array[1] |= 1<<0;
     else
-        BMU_status_array[1] &= ~(1<<0);
+        ctx->BMU_status_array[1] &= ~(1<<0);
     //Precharge and Discharge flags
-    if(BMU.precharge_state)
-        BMU_status_array[1] |= 1<<1;
+    if(ctx->BMU.precharge_state)
+        ctx->BMU_status_array[1] |= 1<<1;
     else
-        BMU_status_array[1] &= ~(1<<1);
-    if(BMU.discharge_state)
-        BMU_status_array[1] |= 1<<2;
+        ctx->BMU_status_array[1] &= ~(1<<1);
+    if(ctx->BMU.discharge_state)
+        ctx->BMU_status_array[1] |= 1<<2;
     else
-        BMU_status_array[1] &= ~(1<<2);
+        ctx->BMU_status_array[1] &= ~(1<<2);
 
     //Placeholder for fan states, code setting BMU.fanx_state needs to be updated
-    BMU_status_array[2] = BMU.fan1_state;
-    BMU_status_array[3] = BMU.fan2_state;
-    BMU_status_array[4] = BMU.fan3_state;
-    BMU_status_array[5] = BMU.fan4_state;
+    ctx->BMU_status_array[2] = ctx->BMU.fan1_state;
+    ctx->BMU_status_array[3] = ctx->BMU.fan2_state;
+    ctx->BMU_status_array[4] = ctx->BMU.fan3_state;
+    ctx->BMU_status_array[5] = ctx->BMU.fan4_state;
+}
+
+// The fault engine the car runs on, with the same signature as fault_engine_step()
+void bmu_fault_step(bmu_context_t *ctx, uint32_t now_ms) {
+    check_cells(ctx);
+    update_BMU_status_array(ctx, now_ms);
+}
+
+/*****************************************************************************************************\
+ Switch to the profile asked for since the last pass. The checks only read limits through ctx->config,
+ so moving that one pointer here, before any of them run, changes every limit at once. Faults already
+ set stay set until the new limits clear them.
+
+ Only a parked car switches: with the ignition on or the HVDC contactor closed the request is refused,
+ as charge would lift the driver controls timeout and swap the current limits under a live pack. It is
+ not kept for later, so the car can't change limits by itself when it is next switched off.
+\*****************************************************************************************************/
+void bmu_profile_step(bmu_context_t *ctx, uint32_t now_ms) {
+    //The receive routine writes the request
+    core_util_critical_section_enter();
+    uint8_t profile = ctx->profile_request;
+    ctx->profile_request = BMU_PROFILES;
+    core_util_critical_section_exit();
+
+    if(profile >= BMU_PROFILES || ctx->config == &bmu_profiles[profile])
+        return;
+    if(ctx->ignition_demand || relay_closed(&ctx->relays, RELAY_HVDC)) {
+        event_stream_emit(&ctx->stream, now_ms, STREAM_PROFILE, profile, 1);
+        if (BMU_DEBUG)
+            printf("Not switching to the %s profile with HV live \n", bmu_profile_names[profile]);
+        return;
+    }
+    ctx->config = &bmu_profiles[profile];
+    event_stream_emit(&ctx->stream, now_ms, STREAM_PROFILE, profile, 0);
+    if (BMU_DEBUG)
+        printf("Limits switched to the %s profile \n", bmu_profile_names[profile]);
+}
+
+/*****************************************************************************************************\
+ Start the shadow BMU from a copy of ctx, so it begins in step, and clear the lockstep log. Restarting
+ it re-syncs a shadow that has drifted.
+\*****************************************************************************************************/
+void shadow_start(const bmu_context_t *ctx) {
+    //The receive routine writes both
+    core_util_critical_section_enter();
+    memcpy(&shadow, ctx, sizeof(shadow));
+    lockstep_init(&lockstep, LOCKSTEP_CONFIRM_PASSES);
+    shadow_enabled = true;
+    core_util_critical_section_exit();
+}
+
+// One pass of the candidate fault engine on the shadow, straight after the same pass on ctx
+void shadow_step(const bmu_context_t *ctx, uint32_t now_ms) {
+    //Same limits as the pass it is compared with, even if the profile changed in between
+    shadow.config = ctx->config;
+    ivt_combine(&shadow);
+    fault_engine_step(&shadow, now_ms);
+    if(lockstep_compare(&lockstep, now_ms, ctx->BMU_status_array, shadow.BMU_status_array) && BMU_DEBUG)
+    {
+        const lockstep_divergence_t *d = &lockstep.log[(lockstep.count - 1) & (LOCKSTEP_LOG_SIZE - 1)];
+        printf("Fault engines diverge from %lu ms: %02X %02X vs %02X %02X \n", (unsigned long)d->time_ms,
+               d->primary[0], d->primary[1], d->shadow[0], d->shadow[1]);
+    }
+}
+
+/*****************************************************************************************************\
+ Things that must hold after every pass of the fault logic, whatever arrived on the bus. Returns 0 if
+ they all do, otherwise a bit per broken rule.
+\*****************************************************************************************************/
+int bmu_check_invariants(const bmu_context_t *ctx)
+{
+    int broken = 0;
+    bool fault = ctx->BMU.over_current || ctx->BMU.under_voltage || ctx->BMU.over_voltage
+                 || ctx->BMU.under_temperature || ctx->BMU.over_temperature;
+
+    //Never safe to drive with a fault
+    if(ctx->BMU.safe_to_drive && fault)
+        broken |= 1<<0;
+    //The status frame says what the flags say
+    if(((ctx->BMU_status_array[0] >> 5) & 1) != ctx->BMU.safe_to_drive)
+        broken |= 1<<1;
+    if(((ctx->BMU_status_array[0] & 0x1F) != 0) != fault)
+        broken |= 1<<2;
+    //Can't be precharged and discharged at once
+    if(ctx->BMU.precharge_state && ctx->BMU.discharge_state)
+        broken |= 1<<3;
+    //The discharge relay must never be closed along with the HV box contactor or the precharge relay
+    if(relay_closed(&ctx->relays, RELAY_DISCHARGE) && (relay_closed(&ctx->relays, RELAY_HVDC) || relay_closed(&ctx->relays, RELAY_PRECHARGE)))
+        broken |= 1<<4;
+    return broken;
+}
+
+extern "C" int bmu_batch_context_size(void)
+{
+    return sizeof(bmu_context_t);
+}
+
+extern "C" void bmu_batch_init(bmu_context_t *ctx, const bmu_config_t *config)
+{
+    bmu_context_init(ctx, config);
+}
+
+extern "C" const bmu_config_t *bmu_batch_profile(int profile)
+{
+    return profile >= 0 && profile < BMU_PROFILES ? &bmu_profiles[profile] : NULL;
+}
+
+extern "C" bool bmu_batch_config_ok(const bmu_config_t *config)
+{
+    return can_schedule_ivt_rates_ok(config->ivt_current_cycle_ms, config->ivt_cycle_ms);
+}
+
+/*****************************************************************************************************\
+ Batch entry point, see bmu_batch.h. One CANMessage is reused for every frame and only the fault logic
+ runs per frame, so the cost per frame is the decode, the IVT pairing and the checks and nothing else.
+\*****************************************************************************************************/
+extern "C" int bmu_process_batch(bmu_context_t *ctx, const uint32_t *timestamps_ms, const uint32_t *ids,
+                                 const uint8_t *lengths, const uint8_t *payloads, int count, uint8_t *status)
+{
+    CANMessage msg;
+
+    for (int i = 0; i < count; i++)
+    {
+        msg.id = ids[i] & ~BMU_BATCH_EXTENDED;
+        msg.format = (ids[i] & BMU_BATCH_EXTENDED) ? CANExtended : CANStandard;
+        msg.type = CANData;
+        msg.len = lengths[i];
+        memcpy(msg.data, &payloads[i * 8], 8);
+
+        bmu_receive(ctx, msg, timestamps_ms[i]);
+        bmu_profile_step(ctx, timestamps_ms[i]);
+        ivt_combine(ctx);
+        bmu_fault_step(ctx, timestamps_ms[i]);
+        memcpy(&status[i * 6], ctx->BMU_status_array, 6);
+    }
+    return count;
+}
+
+extern "C" int bmu_batch_checkpoint_size(void)
+{
+    return CHECKPOINT_BYTES;
+}
+
+extern "C" void bmu_batch_save(const bmu_context_t *ctx, uint32_t now_ms, uint8_t *data)
+{
+    checkpoint_save(ctx, now_ms, data);
+}
+
+extern "C" bool bmu_batch_restore(bmu_context_t *ctx, const uint8_t *data, int size, const bmu_config_t *custom, uint32_t *uptime_ms)
+{
+    return checkpoint_check(data, size, uptime_ms) && checkpoint_restore(ctx, data, size, custom, *uptime_ms);
+}
+
+extern "C" int bmu_batch_lockstep_size(void)
+{
+    return sizeof(lockstep_t);
+}
+
+extern "C" int bmu_lockstep_batch(bmu_context_t *primary, bmu_context_t *shadow, lockstep_t *lockstep, const uint32_t *timestamps_ms,
+                                  const uint32_t *ids, const uint8_t *lengths, const uint8_t *payloads, int count)
+{
+    CANMessage msg;
+    uint32_t before = lockstep->count;
+
+    for (int i = 0; i < count; i++)
+    {
+        msg.id = ids[i] & ~BMU_BATCH_EXTENDED;
+        msg.format = (ids[i] & BMU_BATCH_EXTENDED) ? CANExtended : CANStandard;
+        msg.type = CANData;
+        msg.len = lengths[i];
+        memcpy(msg.data, &payloads[i * 8], 8);
+
+        bmu_receive(primary, msg, timestamps_ms[i]);
+        bmu_receive(shadow, msg, timestamps_ms[i]);
+        bmu_profile_step(primary, timestamps_ms[i]);
+        shadow->config = primary->config;
+        ivt_combine(primary);
+        ivt_combine(shadow);
+        bmu_fault_step(primary, timestamps_ms[i]);
+        fault_engine_step(shadow, timestamps_ms[i]);
+        lockstep_compare(lockstep, timestamps_ms[i], primary->BMU_status_array, shadow->BMU_status_array);
+    }
+    return (int)(lockstep->count - before);
 }
 
 /*****************************************************************************************************\
  This function prints the content of BMU struct over serial to show the status of the BMU. It is only
  used for debugging purposes.
 \*****************************************************************************************************/
-void print_bmu_status(void)
+void print_bmu_status(bmu_context_t *ctx)
 {
     printf("BMU status \n");
     printf("==================================== \n");
-    printf("over_current: %d \n", BMU.over_current);
-    printf("under_voltage: %d \n", BMU.under_voltage);
-    printf("under_temperature: %d \n", BMU.under_temperature);
-    printf("over_temperature: %d \n", BMU.over_temperature);
-    printf("safe_to_drive: %d \n", BMU.safe_to_drive);
-    printf("charging_state: %d \n", BMU.charging_state);
-    printf("precharge_state: %d \n", BMU.precharge_state);
-    printf("discharge_state: %d \n", BMU.discharge_state);
-    printf("contactor_state: %d \n", BMU.contactor_state);
+    printf("over_current: %d \n", ctx->BMU.over_current);
+    printf("under_voltage: %d \n", ctx->BMU.under_voltage);
+    printf("under_temperature: %d \n", ctx->BMU.under_temperature);
+    printf("over_temperature: %d \n", ctx->BMU.over_temperature);
+    printf("safe_to_drive: %d \n", ctx->BMU.safe_to_drive);
+    printf("charging_state: %d \n", ctx->BMU.charging_state);
+    printf("precharge_state: %d \n", ctx->BMU.precharge_state);
+    printf("discharge_state: %d \n", ctx->BMU.discharge_state);
+    printf("contactor_state: %d \n", ctx->BMU.contactor_state);
+    printf("relays closed: 0x%02X, refused: %lu, readback errors: %lu \n", ctx->relays.closed,
+           (unsigned long)ctx->relays.refusals, (unsigned long)ctx->relays.readback_errors);
+    printf("event stream: %lu events, lost by CAN: %lu, lost by console: %lu \n", (unsigned long)ctx->stream.head,
+           (unsigned long)ctx->stream_can.lost, (unsigned long)ctx->stream_console.lost);
+    const char *limits = "custom";
+    for (int i = 0; i < BMU_PROFILES; i++)
+        if (ctx->config == &bmu_profiles[i])
+            limits = bmu_profile_names[i];
+    printf("limits: %s \n", limits);
+    printf("driver controls: %lu ms since last frame \n", (unsigned long)liveness_age_ms(&ctx->driver_controls_live, uptime_ms()));
+    printf("pack: %d mV, %d mA, %d W, front - rear: %d mA, mismatches: %lu \n", ctx->ivt_combined.voltage_mv,
+           ctx->ivt_combined.current_ma, ctx->ivt_combined.power_w, ctx->ivt_combined.current_mismatch_ma,
+           (unsigned long)ctx->ivt_mismatch_count);
     printf("\n");
-}
\ No newline at end of file
+    can_stats_print(&ctx->can_stats);
+}
+
+static void print_ivt(const char *name, const ivt_state_t *ivt)
+{
+    printf("%s IVT: %d mA, %d / %d / %d mV, %d (0.1 degC), %d W, %d As, %d Wh \n", name, ivt->current,
+           ivt->voltage1, ivt->voltage2, ivt->voltage3, ivt->temperature, ivt->power, ivt->charge, ivt->energy);
+}
+
+static void print_cells(const bmu_context_t *ctx)
+{
+    printf("cell voltages (100uV): \n");
+    for (int i = 0; i < 32; i++)
+        printf("%u%s", ctx->cell_voltages[i], i % 8 == 7 ? " \n" : " ");
+    printf("cell temperatures (degC): \n");
+    for (int pack = 0; pack < 2; pack++)
+    {
+        for (int i = 0; i < 8; i++)
+            printf("%u ", ctx->cell_temperatures[pack][i]);
+        printf("\n");
+    }
+}
+
+// What the event stream still holds, read with a cursor of its own so the other consumers don't move
+static void print_events(const event_stream_t *stream)
+{
+    uint32_t head = stream->head;
+    stream_cursor_t cursor = {head > EVENT_STREAM_SIZE ? head - EVENT_STREAM_SIZE : 0, 0};
+    stream_event_t event;
+
+    printf("%lu events \n", (unsigned long)head);
+    while (event_stream_read(stream, &cursor, &event))
+        printf("event %lu: %lu ms, %s %u %d \n", (unsigned long)(event.sequence - 1), (unsigned long)event.time_ms,
+               event_stream_name(event.type), event.arg, event.value);
+}
+
+static void shell_run(bmu_context_t *ctx, const char *line)
+{
+    int32_t argument = 0;
+
+    switch (shell_parse(line, &argument))
+    {
+        case SHELL_NONE: break;
+        case SHELL_HELP: printf("%s", shell_help); break;
+        case SHELL_STATUS: print_bmu_status(ctx); break;
+        case SHELL_IVT:
+            print_ivt("front", &ctx->ivt_front);
+            print_ivt("rear", &ctx->ivt_rear);
+            break;
+        case SHELL_CELLS: print_cells(ctx); break;
+        case SHELL_CAN: can_stats_print(&ctx->can_stats); break;
+        case SHELL_EVENTS: print_events(&ctx->stream); break;
+        case SHELL_LOG:
+            bmu_log_level = argument < 0 ? 0 : (argument > 2 ? 2 : argument);
+            printf("log level %d \n", bmu_log_level);
+            break;
+        case SHELL_PROFILE:
+            if (argument < 0 || argument >= BMU_PROFILES)
+            {
+                printf("no profile %ld \n", (long)argument);
+                break;
+            }
+            //Taken up by the next pass of the main loop, same as a BMU_PROFILE_ID frame
+            ctx->profile_request = argument;
+            break;
+        case SHELL_SHADOW:
+            if (argument)
+                shadow_start(ctx);
+            else
+                shadow_enabled = false;
+            printf("shadow %s \n", shadow_enabled ? "on" : "off");
+            break;
+        case SHELL_LOCKSTEP: lockstep_print(&lockstep); break;
+        case SHELL_CHECKPOINT:
+        {
+            const bmu_checkpoint_t *checkpoint = checkpoint_get(&checkpoints, argument);
+            if (checkpoint == NULL)
+            {
+                printf("%d checkpoints%s \n", checkpoints.count, checkpoints.frozen ? ", frozen" : "");
+                break;
+            }
+            checkpoint_dump(checkpoint);
+            break;
+        }
+        default: printf("unknown command, try help \n"); break;
+    }
+}
+
+/*****************************************************************************************************\
+ Debug shell, see shell.h. Only called once the serial interrupt has raised shell_flag, so while nobody
+ is typing it costs the main loop one flag test. Reads whatever is waiting and carries out any complete
+ lines; printf() goes to the same port, so the replies come back to whoever typed.
+\*****************************************************************************************************/
+void shell_poll(bmu_context_t *ctx)
+{
+    char c;
+
+    shell_flag = false;
+    while (pc.readable() && pc.read(&c, 1) == 1)
+    {
+        if (shell_feed(&shell, c))
+            shell_run(ctx, shell.line);
+    }
+}
+/*****************************************************************************************************\
+ Bench scenario runner. Each scenario starts from a fresh BMU and runs in virtual time, a millisecond
+ per step: the scenario sets the load on two emulated IVTs (ivt_sim.h) whose frames are fed straight
+ into bmu_receive(), the heartbeat and charger flags are raised on schedule, and bmu_loop() runs after
+ each step. Expects are checked after the loop pass at their time. The relay and IVT config sequences
+ run in the same virtual time, and precharge waits on "detect" exactly as it would on prechg_detect.
+
+ Both IVTs start out as config_IVT() leaves them. After a restart the time until the BMU has them
+ configured again is printed.
+\*****************************************************************************************************/
+#define SCENARIO_STEP_MS 1
+
+typedef struct scenario_signal {
+    int32_t from;
+    int32_t to;
+    uint32_t start_ms;
+    uint32_t duration_ms;
+} scenario_signal_t;
+
+typedef struct scenario_ivt {
+    scenario_signal_t current;
+    scenario_signal_t voltage;
+    scenario_signal_t temperature;
+} scenario_ivt_t;
+
+static int32_t scenario_signal_value(const scenario_signal_t *signal, uint32_t now_ms)
+{
+    if (now_ms >= signal->start_ms + signal->duration_ms)
+        return signal->to;
+    return signal->from + (int32_t)((int64_t)(signal->to - signal->from) * (int32_t)(now_ms - signal->start_ms) / (int32_t)signal->duration_ms);
+}
+
+static void scenario_signal_set(scenario_signal_t *signal, const scenario_event_t *event)
+{
+    signal->from = scenario_signal_value(signal, event->time_ms);
+    signal->to = event->value;
+    signal->start_ms = event->time_ms;
+    signal->duration_ms = event->duration_ms;
+}
+
+static int scenario_read_check(const bmu_context_t *ctx, int check)
+{
+    switch (check)
+    {
+        case SCENARIO_CHECK_PRECHARGE_RELAY: return relay_pin_level(RELAY_PRECHARGE_PIN);
+        case SCENARIO_CHECK_DISCHARGE_DISABLE: return relay_pin_level(RELAY_DISCHARGE_PIN);
+        case SCENARIO_CHECK_HVDC_RELAY: return relay_pin_level(RELAY_HVDC_PIN);
+        case SCENARIO_CHECK_CHARGING: return (ctx->BMU_status_array[1] >> 0) & 1;
+        case SCENARIO_CHECK_PRECHARGED: return (ctx->BMU_status_array[1] >> 1) & 1;
+        case SCENARIO_CHECK_DISCHARGED: return (ctx->BMU_status_array[1] >> 2) & 1;
+        case SCENARIO_CHECK_CONTROLS_LOST: return (ctx->BMU_status_array[1] >> 3) & 1;
+        // The rest are BMU_status_array[0] bits 0-5 in the same order as scenario_check_t
+        default: return (ctx->BMU_status_array[0] >> check) & 1;
+    }
+}
+
+// Returns the number of failed expects
+static int scenario_run(bmu_context_t *ctx, const scenario_t *scenario, int number)
+{
+    static const char *const ivt_names[2] = {"front", "rear"};
+    const int ivt_base[2] = {IVT_FRONT_BASE_ID, IVT_REAR_BASE_ID};
+    static ivt_sim_t sims[2];
+    scenario_ivt_t ivt[2];
+    uint32_t configs[2];
+    bool restarted[2] = {false, false};
+    ivt_sim_frame_t frames[IVT_SIM_MAX_FRAMES];
+    uint32_t controls_quiet_until_ms = 0;
+    bool ignition = false;
+    int failures = 0;
+    int next = 0;
+
+    memset(ivt, 0, sizeof(ivt));
+    bmu_context_init(ctx, &bmu_profiles[BMU_DEFAULT_PROFILE]);
+    relay_write(ctx);
+    scenario_detect = false;
+    heartbeat_flag = false;
+    charger_flag = false;
+    for (int i = 0; i < 2; i++)
+    {
+        ivt_sim_init(&sims[i], ivt_base[i], number * 2 + i + 1);
+        for (int command = 0; command < IVT_CONFIG_COMMANDS; command++)
+        {
+            CANMessage msg = IVT_config_command(ctx->config, command);
+            ivt_sim_receive(&sims[i], msg.id, msg.data, msg.len);
+        }
+        configs[i] = 1;
+    }
+    scenario_ivts = sims;
+
+    for (uint32_t now = 0; now <= scenario->end_ms; now += SCENARIO_STEP_MS)
+    {
+        int first = next;
+
+        // Events due by now change the inputs before this step's frames go out
+        for (; next < scenario->count && scenario->events[next].time_ms <= now; next++)
+        {
+            const scenario_event_t *event = &scenario->events[next];
+            switch (event->type)
+            {
+                case SCENARIO_IGNITION: ignition = event->value; break;
+                case SCENARIO_CURRENT: scenario_signal_set(&ivt[event->target].current, event); break;
+                case SCENARIO_VOLTAGE: scenario_signal_set(&ivt[event->target].voltage, event); break;
+                case SCENARIO_TEMPERATURE: scenario_signal_set(&ivt[event->target].temperature, event); break;
+                case SCENARIO_DROPOUT:
+                    if (event->target == SCENARIO_CONTROLS)
+                        controls_quiet_until_ms = event->time_ms + event->duration_ms;
+                    else
+                        sims[event->target].quiet_until_ms = event->time_ms + event->duration_ms;
+                    break;
+                case SCENARIO_DETECT: scenario_detect = event->value; break;
+                case SCENARIO_RESTART:
+                    ivt_sim_restart(&sims[event->target], now);
+                    restarted[event->target] = true;
+                    break;
+                case SCENARIO_NOISE: sims[event->target].noise_ma = event->value; break;
+                case SCENARIO_RESISTANCE: sims[event->target].resistance_mohm = event->value; break;
+                default: break;
+            }
+        }
+
+        if (now % DRIVER_CONTROLS_PERIOD_MS == 0 && now >= controls_quiet_until_ms)
+        {
+            char data[1] = {(char)(ignition ? 0x01 : 0x00)};
+            bmu_receive(ctx, CANMessage(DRIVER_CONTROLS_ID, data, 1), now);
+        }
+        for (int i = 0; i < 2; i++)
+        {
+            ivt_sim_set_load(&sims[i], scenario_signal_value(&ivt[i].current, now), scenario_signal_value(&ivt[i].voltage, now),
+                             scenario_signal_value(&ivt[i].temperature, now));
+            int count = ivt_sim_step(&sims[i], now, frames);
+            for (int j = 0; j < count; j++)
+                bmu_receive(ctx, CANMessage(frames[j].id, (const char *)frames[j].data, 6), now);
+            //Config goes to both IVTs, only time it for one that was restarted
+            if (sims[i].configs != configs[i] && restarted[i])
+            {
+                restarted[i] = false;
+                printf("scenario %d: %s IVT configured %lu ms after its restart \n", number, ivt_names[i],
+                       (unsigned long)(sims[i].configured_ms - sims[i].restart_ms));
+            }
+            configs[i] = sims[i].configs;
+        }
+        if (now % HEARTBEAT_PERIOD_MS == 0)
+            heartbeat_flag = true;
+        if (now % CHARGER_FRAME_PERIOD_MS == 0)
+            charger_flag = true;
+
+        bmu_loop(ctx, now);
+
+        int broken = bmu_check_invariants(ctx);
+        if (broken)
+        {
+            printf("scenario %d: invariants broken at %lu ms: 0x%02X \n", number, (unsigned long)now, broken);
+            failures++;
+        }
+
+        for (int i = first; i < next; i++)
+        {
+            const scenario_event_t *event = &scenario->events[i];
+            if (event->type != SCENARIO_EXPECT)
+                continue;
+            int got = scenario_read_check(ctx, event->target);
+            if (got != event->value)
+            {
+                printf("scenario %d line %d: expected %s %d at %lu ms, got %d \n", number, event->line,
+                       scenario_check_name(event->target), (int)event->value, (unsigned long)now, got);
+                failures++;
+            }
+        }
+    }
+    scenario_ivts = NULL;
+    return failures;
+}
+
+/*****************************************************************************************************\
+ Throw random frames at bmu_receive() and the fault logic and check the invariants after each one. The
+ IDs are mostly ones the BMU listens to, with random lengths, formats and payloads, so the decoding and
+ the length checks get hit rather than the default case. Each frame goes through the same profile and
+ fault steps as a pass of bmu_loop(), but relays aren't driven, so this runs flat out. host/fuzz_bmu
+ does the coverage guided version through bmu_loop() itself.
+\*****************************************************************************************************/
+#define SCENARIO_FUZZ_FRAMES 100000
+
+static uint32_t scenario_random(uint32_t *state)
+{
+    //xorshift32
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+static int scenario_fuzz(bmu_context_t *ctx, uint32_t seed, int frames)
+{
+    static const uint32_t ids[] = {DRIVER_CONTROLS_ID, BMU_PROFILE_ID, CELL_VOLTAGES_BASE_ID, IVT_FRONT_BASE_ID,
+                                   IVT_REAR_BASE_ID, CELL_TEMPERATURES_FRONT_ID, CELL_TEMPERATURES_REAR_ID,
+                                   CHARGER_STATUS_ID};
+    uint32_t state = seed;
+    int failures = 0;
+
+    bmu_context_init(ctx, &bmu_profiles[BMU_DEFAULT_PROFILE]);
+    for (int i = 0; i < frames; i++)
+    {
+        uint32_t r = scenario_random(&state);
+        uint32_t id = ids[r % (sizeof(ids) / sizeof(ids[0]))] + ((r >> 8) & 0x7);
+        char data[8];
+        for (int j = 0; j < 8; j++)
+            data[j] = (char)(scenario_random(&state) >> 24);
+        //Now and then a completely random ID, or the wrong format for the ID
+        if (((r >> 12) & 0x1F) == 0)
+            id = r >> 16;
+        bool extended = id == CHARGER_STATUS_ID;
+        if (((r >> 27) & 0x7) == 0)
+            extended = !extended;
+        CANMessage msg(id, data, (r >> 20) % 9, ((r >> 24) & 0x7) ? CANData : CANRemote, extended ? CANExtended : CANStandard);
+
+        bmu_receive(ctx, msg, i);
+        bmu_profile_step(ctx, i);
+        ivt_combine(ctx);
+        bmu_fault_step(ctx, i);
+        int broken = bmu_check_invariants(ctx);
+        if (broken)
+        {
+            printf("fuzz seed %lu frame %d id 0x%lX: invariants broken: 0x%02X \n", (unsigned long)seed, i,
+                   (unsigned long)id, broken);
+            failures++;
+            bmu_context_init(ctx, &bmu_profiles[BMU_DEFAULT_PROFILE]);
+        }
+    }
+    return failures;
+}
+
+// Returns the number of scenarios that failed plus the number of fuzz failures
+int scenario_run_bench(bmu_context_t *ctx) {
+    static scenario_t scenario;
+    int passed = 0;
+
+    for (int i = 0; i < scenario_bench_count; i++)
+    {
+        int line = scenario_compile(scenario_bench[i], &scenario);
+        if (line != 0)
+            printf("scenario %d: syntax error on line %d \n", i, line);
+        else if (scenario_run(ctx, &scenario, i) == 0)
+            passed++;
+    }
+    int fuzz_failures = scenario_fuzz(ctx, 0x2545F491, SCENARIO_FUZZ_FRAMES);
+    printf("scenarios: %d of %d passed \n", passed, scenario_bench_count);
+    printf("fuzz: %d failures in %d frames \n", fuzz_failures, SCENARIO_FUZZ_FRAMES);
+    return scenario_bench_count - passed + fuzz_failures;
+}
@@ -0,0 +1,114 @@
+/*****************************************************************************************************\
+ Tiny persistent record store in the last sector of internal flash, for data that has to survive a
+ power cycle (e.g. pack state of health).
+
+ Every save programs one NV_STORE_SLOT_SIZE slot after the last used one, so the sector is only erased
+ once every (sector size / slot size) saves. Erasing and programming stall the CPU, so only save when
+ the car isn't driving.
+\*****************************************************************************************************/
+
+#include <cstring>
+#include <mbed.h>
+
+#include "crc32.h"
+#include "nv_store.h"
+
+typedef struct nv_record_header {
+    uint32_t magic;
+    uint32_t sequence;
+    uint32_t size;
+    uint32_t crc;
+} nv_record_header_t;
+
+static uint8_t slot_buffer[NV_STORE_SLOT_SIZE];
+
+/*****************************************************************************************************\
+ Scan the sector for the newest record. Returns the slot index of the newest valid record (or -1) and
+ the index of the first erased slot (or the slot count if the sector is full).
+\*****************************************************************************************************/
+static int nv_store_scan(FlashIAP &flash, uint32_t sector, uint32_t slots, uint32_t size, int *free_slot)
+{
+    nv_record_header_t header;
+    uint32_t newest_sequence = 0;
+    int newest = -1;
+
+    *free_slot = slots;
+    for (uint32_t i = 0; i < slots; i++)
+    {
+        flash.read(&header, sector + i * NV_STORE_SLOT_SIZE, sizeof(header));
+        if (header.magic == 0xFFFFFFFF)
+        {
+            *free_slot = i;
+            break;
+        }
+        if (header.magic != NV_STORE_MAGIC || header.size != size)
+            continue;
+        flash.read(slot_buffer, sector + i * NV_STORE_SLOT_SIZE + sizeof(header), size);
+        if (crc32(slot_buffer, size) != header.crc)
+            continue;
+        if (newest < 0 || header.sequence > newest_sequence)
+        {
+            newest = i;
+            newest_sequence = header.sequence;
+        }
+    }
+    return newest;
+}
+
+bool nv_store_load(void *data, uint32_t size)
+{
+    FlashIAP flash;
+    int free_slot;
+
+    if (size > NV_STORE_SLOT_SIZE - sizeof(nv_record_header_t) || flash.init() != 0)
+        return false;
+
+    uint32_t sector_size = flash.get_sector_size(flash.get_flash_start() + flash.get_flash_size() - 1);
+    uint32_t sector = flash.get_flash_start() + flash.get_flash_size() - sector_size;
+    int newest = nv_store_scan(flash, sector, sector_size / NV_STORE_SLOT_SIZE, size, &free_slot);
+    if (newest >= 0)
+        flash.read(data, sector + newest * NV_STORE_SLOT_SIZE + sizeof(nv_record_header_t), size);
+
+    flash.deinit();
+    return newest >= 0;
+}
+
+bool nv_store_save(const void *data, uint32_t size)
+{
+    FlashIAP flash;
+    nv_record_header_t header;
+    int free_slot;
+    bool ok = true;
+
+    if (size > NV_STORE_SLOT_SIZE - sizeof(nv_record_header_t) || flash.init() != 0)
+        return false;
+
+    uint32_t sector_size = flash.get_sector_size(flash.get_flash_start() + flash.get_flash_size() - 1);
+    uint32_t sector = flash.get_flash_start() + flash.get_flash_size() - sector_size;
+    uint32_t slots = sector_size / NV_STORE_SLOT_SIZE;
+    int newest = nv_store_scan(flash, sector, slots, size, &free_slot);
+
+    header.sequence = 0;
+    if (newest >= 0)
+    {
+        flash.read(&header, sector + newest * NV_STORE_SLOT_SIZE, sizeof(header));
+        header.sequence++;
+    }
+    if ((uint32_t)free_slot == slots)
+    {
+        ok = flash.erase(sector, sector_size) == 0;
+        free_slot = 0;
+    }
+
+    header.magic = NV_STORE_MAGIC;
+    header.size = size;
+    header.crc = crc32(data, size);
+    memset(slot_buffer, flash.get_erase_value(), sizeof(slot_buffer));
+    memcpy(slot_buffer, &header, sizeof(header));
+    memcpy(slot_buffer + sizeof(header), data, size);
+    if (ok)
+        ok = flash.program(slot_buffer, sector + free_slot * NV_STORE_SLOT_SIZE, NV_STORE_SLOT_SIZE) == 0;
+
+    flash.deinit();
+    return ok;
+}
@@ -0,0 +1,86 @@
+/*****************************************************************************************************\
+ OCV/SoC curves for the pack cells and the lookup tables generated from them at compile time.
+
+ The curves are the datasheet OCV at 0, 20 and 40 degC. The static_asserts below check the generated
+ tables against the curves, so a bad edit to a curve or to the grid fails the build rather than
+ silently skewing every SoC reading.
+\*****************************************************************************************************/
+
+#include "ocv_table.h"
+
+// Worst case lookup error against the source curve, in 0.1% SoC and mV
+#define OCV_TABLE_SOC_TOLERANCE 5
+#define OCV_TABLE_MV_TOLERANCE 8
+
+static constexpr ocv_point_t curve_0c[] = {
+    {3000, 0}, {3420, 100}, {3520, 200}, {3585, 300}, {3640, 400}, {3700, 500},
+    {3785, 600}, {3875, 700}, {3965, 800}, {4065, 900}, {4190, 1000}};
+static constexpr ocv_point_t curve_20c[] = {
+    {3000, 0}, {3450, 100}, {3540, 200}, {3600, 300}, {3650, 400}, {3710, 500},
+    {3790, 600}, {3880, 700}, {3970, 800}, {4070, 900}, {4190, 1000}};
+static constexpr ocv_point_t curve_40c[] = {
+    {3000, 0}, {3470, 100}, {3555, 200}, {3610, 300}, {3658, 400}, {3716, 500},
+    {3794, 600}, {3884, 700}, {3974, 800}, {4074, 900}, {4190, 1000}};
+
+static constexpr ocv_table table_0c(curve_0c);
+static constexpr ocv_table table_20c(curve_20c);
+static constexpr ocv_table table_40c(curve_40c);
+
+const ocv_table ocv_tables[OCV_TEMPERATURES] = {table_0c, table_20c, table_40c};
+
+/*****************************************************************************************************\
+ Compile time accuracy checks: every curve point must come back out of both tables within tolerance,
+ both tables must be monotonic, and the whole grid must survive a round trip.
+\*****************************************************************************************************/
+constexpr int absolute(int x)
+{
+    return x < 0 ? -x : x;
+}
+
+template <size_t N>
+constexpr bool ocv_table_matches_curve(const ocv_table &table, const ocv_point_t (&curve)[N])
+{
+    for (size_t i = 0; i < N; i++)
+    {
+        if (absolute(ocv_table_soc(table, curve[i].mv) - curve[i].soc) > OCV_TABLE_SOC_TOLERANCE)
+            return false;
+        if (absolute(ocv_table_mv(table, curve[i].soc) - curve[i].mv) > OCV_TABLE_MV_TOLERANCE)
+            return false;
+    }
+    return true;
+}
+
+constexpr bool ocv_table_monotonic(const ocv_table &table)
+{
+    for (int i = 1; i < OCV_GRID_POINTS; i++)
+    {
+        if (table.soc[i] < table.soc[i - 1])
+            return false;
+    }
+    for (int i = 1; i < SOC_GRID_POINTS; i++)
+    {
+        if (table.mv[i] < table.mv[i - 1])
+            return false;
+    }
+    return true;
+}
+
+constexpr bool ocv_table_round_trip(const ocv_table &table)
+{
+    for (int soc = 0; soc <= 1000; soc++)
+    {
+        if (absolute(ocv_table_soc(table, ocv_table_mv(table, soc)) - soc) > OCV_TABLE_SOC_TOLERANCE)
+            return false;
+    }
+    return true;
+}
+
+static_assert(ocv_table_matches_curve(table_0c, curve_0c), "0 degC OCV table too far from its curve");
+static_assert(ocv_table_matches_curve(table_20c, curve_20c), "20 degC OCV table too far from its curve");
+static_assert(ocv_table_matches_curve(table_40c, curve_40c), "40 degC OCV table too far from its curve");
+static_assert(ocv_table_monotonic(table_0c) && ocv_table_monotonic(table_20c) && ocv_table_monotonic(table_40c),
+              "OCV tables must be monotonic");
+static_assert(ocv_table_round_trip(table_0c) && ocv_table_round_trip(table_20c) && ocv_table_round_trip(table_40c),
+              "OCV tables don't round trip");
+static_assert(OCV_GRID_MIN_MV + ((OCV_GRID_POINTS - 1) << OCV_GRID_SHIFT) >= 4190, "OCV grid doesn't reach a full cell");
+static_assert(((SOC_GRID_POINTS - 1) << SOC_GRID_SHIFT) >= 1000, "SoC grid doesn't reach 100%");
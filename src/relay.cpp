@@ -0,0 +1,89 @@
+/*****************************************************************************************************\
+ Relay bank, see relay.h. Every check is a mask test against fixed tables, so a command costs the same
+ however many relays it touches.
+\*****************************************************************************************************/
+
+#include "relay.h"
+
+// Relays that must be open for each relay to close. The discharge relay would short the DC bus through
+// its resistor while the HV box contactor or the precharge relay is feeding it.
+static const uint8_t relay_interlock[RELAYS] = {
+    RELAY_BIT(RELAY_DISCHARGE),                             // precharge
+    RELAY_BIT(RELAY_PRECHARGE) | RELAY_BIT(RELAY_HVDC),     // discharge
+    RELAY_BIT(RELAY_DISCHARGE),                             // HV box contactor
+    0,                                                      // solar
+};
+
+static const uint8_t relay_pin[RELAYS] = {RELAY_PRECHARGE_PIN, RELAY_DISCHARGE_PIN, RELAY_HVDC_PIN, RELAY_SOLAR_PIN};
+
+// Pins that are low when the contacts are closed
+static const uint8_t relay_active_low = RELAY_BIT(RELAY_DISCHARGE);
+
+// Power up state: the discharge relay closed (its pin is low out of reset), everything else open and
+// free to close straight away
+void relay_init(relay_bank_t *bank)
+{
+    for (int i = 0; i < RELAYS; i++)
+        bank->changed_ms[i] = 0u - RELAY_MIN_OPEN_MS;
+    bank->refusals = 0;
+    bank->readback_errors = 0;
+    bank->closed = RELAY_BIT(RELAY_DISCHARGE);
+    bank->waiting = 0;
+}
+
+/*****************************************************************************************************\
+ Open the relays in open, then close the ones in close, as one change. The opens always happen; the
+ closes only happen if every one of them is allowed against the state after the opens, otherwise none
+ of them do and this returns false so the caller can try again later. Sequences retry on every pass
+ of the main loop until the close goes through, so only the first refusal of a request is counted.
+\*****************************************************************************************************/
+bool relay_apply(relay_bank_t *bank, uint8_t open, uint8_t close, uint32_t now_ms)
+{
+    uint8_t opening = open & bank->closed;
+    uint8_t closed = bank->closed & ~open;
+    uint8_t closing = close & ~closed;
+    bool allowed = true;
+
+    for (int i = 0; i < RELAYS; i++)
+    {
+        if (opening & RELAY_BIT(i))
+            bank->changed_ms[i] = now_ms;
+        if (!(closing & RELAY_BIT(i)))
+            continue;
+        // Checked against the state with all the closes applied, so two relays that exclude each other
+        // can't be closed in the same command either
+        if (((closed | closing) & relay_interlock[i]) || now_ms - bank->changed_ms[i] < RELAY_MIN_OPEN_MS)
+            allowed = false;
+    }
+
+    if (allowed)
+    {
+        for (int i = 0; i < RELAYS; i++)
+        {
+            if (closing & RELAY_BIT(i))
+                bank->changed_ms[i] = now_ms;
+        }
+        closed |= closing;
+        bank->waiting = 0;
+    }
+    else if (close != bank->waiting)
+    {
+        bank->refusals++;
+        bank->waiting = close;
+    }
+    bank->closed = closed;
+    return allowed;
+}
+
+// Port 0 value for the commanded state, to be written through RELAY_PORT_MASK
+uint32_t relay_port_value(const relay_bank_t *bank)
+{
+    uint32_t value = 0;
+    for (int i = 0; i < RELAYS; i++)
+    {
+        bool high = ((bank->closed ^ relay_active_low) >> i) & 1;
+        if (high)
+            value |= 1u << relay_pin[i];
+    }
+    return value;
+}
@@ -0,0 +1,215 @@
+/*****************************************************************************************************\
+ Compiler for the bench scenario text, see scenario.h for the format. Only used in BMU_SCENARIO builds
+ but has no hardware dependencies, so it is always compiled.
+\*****************************************************************************************************/
+
+#include <cstdlib>
+#include <cstring>
+
+#include "scenario.h"
+
+#define SCENARIO_MAX_TOKENS 8
+#define SCENARIO_MAX_TOKEN 16
+
+static const char *const check_names[SCENARIO_CHECKS] = {
+    "over_current",
+    "under_voltage",
+    "over_voltage",
+    "under_temperature",
+    "over_temperature",
+    "safe",
+    "charging",
+    "precharged",
+    "discharged",
+    "controls_lost",
+    "prechg_enable",
+    "dischg_disable",
+    "hvdc_enable",
+};
+
+const char *scenario_check_name(int check)
+{
+    return check >= 0 && check < SCENARIO_CHECKS ? check_names[check] : "?";
+}
+
+// Index of word in names, or -1
+static int lookup(const char *word, const char *const *names, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (strcmp(word, names[i]) == 0)
+            return i;
+    }
+    return -1;
+}
+
+static bool parse_int(const char *word, int32_t *value)
+{
+    char *end;
+    long v = strtol(word, &end, 0);
+    if (end == word || *end != '\0')
+        return false;
+    *value = (int32_t)v;
+    return true;
+}
+
+// on/off or 1/0
+static bool parse_bool(const char *word, int32_t *value)
+{
+    if (strcmp(word, "on") == 0 || strcmp(word, "1") == 0)
+        *value = 1;
+    else if (strcmp(word, "off") == 0 || strcmp(word, "0") == 0)
+        *value = 0;
+    else
+        return false;
+    return true;
+}
+
+/*****************************************************************************************************\
+ Parse the words after "at <ms>" into one event. Returns false if the statement doesn't make sense.
+\*****************************************************************************************************/
+static bool parse_statement(char words[][SCENARIO_MAX_TOKEN], int count, scenario_event_t *event)
+{
+    static const char *const types[] = {"ignition", "current", "voltage", "temperature", "dropout", "detect", "expect",
+                                          "restart", "noise", "resistance"};
+    static const char *const targets[] = {"front", "rear", "controls"};
+    int type = lookup(words[0], types, sizeof(types) / sizeof(types[0]));
+
+    event->type = type;
+    event->target = 0;
+    event->duration_ms = 0;
+    switch (type)
+    {
+        case SCENARIO_IGNITION:
+        case SCENARIO_DETECT:
+            return count == 2 && parse_bool(words[1], &event->value);
+
+        case SCENARIO_CURRENT:
+        case SCENARIO_VOLTAGE:
+        case SCENARIO_TEMPERATURE:
+        {
+            int32_t duration = 0;
+            int target = lookup(words[1], targets, 2);
+            if (target < 0 || !(count == 3 || (count == 5 && strcmp(words[3], "over") == 0 && parse_int(words[4], &duration) && duration >= 0)))
+                return false;
+            event->target = target;
+            event->duration_ms = duration;
+            return parse_int(words[2], &event->value);
+        }
+
+        case SCENARIO_DROPOUT:
+        {
+            int32_t duration;
+            int target = lookup(words[1], targets, 3);
+            if (count != 3 || target < 0 || !parse_int(words[2], &duration) || duration < 0)
+                return false;
+            event->target = target;
+            event->duration_ms = duration;
+            return true;
+        }
+
+        case SCENARIO_RESTART:
+        {
+            int target = lookup(words[1], targets, 2);
+            if (count != 2 || target < 0)
+                return false;
+            event->target = target;
+            return true;
+        }
+
+        case SCENARIO_NOISE:
+        case SCENARIO_RESISTANCE:
+        {
+            int target = lookup(words[1], targets, 2);
+            if (count != 3 || target < 0)
+                return false;
+            event->target = target;
+            return parse_int(words[2], &event->value) && event->value >= 0;
+        }
+
+        case SCENARIO_EXPECT:
+        {
+            int check = lookup(words[1], check_names, SCENARIO_CHECKS);
+            if (count != 3 || check < 0)
+                return false;
+            event->target = check;
+            return parse_bool(words[2], &event->value);
+        }
+
+        default:
+            return false;
+    }
+}
+
+int scenario_compile(const char *text, scenario_t *scenario)
+{
+    char words[SCENARIO_MAX_TOKENS][SCENARIO_MAX_TOKEN];
+    uint32_t last_ms = 0;
+    int line = 0;
+
+    scenario->count = 0;
+    scenario->end_ms = 0;
+    while (*text != '\0')
+    {
+        int count = 0;
+        int length = 0;
+
+        // Split the line into words, dropping comments
+        line++;
+        for (bool comment = false; *text != '\0' && *text != '\n'; text++)
+        {
+            if (*text == '#')
+                comment = true;
+            if (comment || *text == ' ' || *text == '\t' || *text == '\r')
+            {
+                if (length > 0)
+                {
+                    words[count++][length] = '\0';
+                    length = 0;
+                }
+                continue;
+            }
+            if (count == SCENARIO_MAX_TOKENS || length == SCENARIO_MAX_TOKEN - 1)
+                return line;
+            words[count][length++] = *text;
+        }
+        if (length > 0)
+            words[count++][length] = '\0';
+        if (*text == '\n')
+            text++;
+        if (count == 0)
+            continue;
+
+        int32_t time_ms;
+        if (count < 2 || !parse_int(words[1], &time_ms) || time_ms < (int32_t)last_ms)
+            return line;
+        last_ms = time_ms;
+
+        if (strcmp(words[0], "end") == 0 && count == 2)
+        {
+            scenario->end_ms = time_ms;
+            break;
+        }
+        if (strcmp(words[0], "at") != 0 || count < 3 || scenario->count == SCENARIO_MAX_EVENTS)
+            return line;
+
+        scenario_event_t *event = &scenario->events[scenario->count];
+        if (!parse_statement(&words[2], count - 2, event))
+            return line;
+        event->time_ms = time_ms;
+        event->line = line;
+        scenario->count++;
+    }
+
+    // Without an end, run until the last event has finished
+    if (scenario->end_ms == 0)
+    {
+        for (int i = 0; i < scenario->count; i++)
+        {
+            uint32_t done = scenario->events[i].time_ms + scenario->events[i].duration_ms;
+            if (done > scenario->end_ms)
+                scenario->end_ms = done;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,97 @@
+/*****************************************************************************************************\
+ Scenarios run by BMU_SCENARIO builds. Both IVTs start healthy in each one: 60V, 25 degC, no current.
+\*****************************************************************************************************/
+
+#include "scenario.h"
+
+#define SCENARIO_HEALTHY_PACKS \
+    "at 0 voltage front 60000\n" \
+    "at 0 voltage rear 60000\n" \
+    "at 0 temperature front 250\n" \
+    "at 0 temperature rear 250\n" \
+    "at 0 detect on\n"
+
+const char *const scenario_bench[] = {
+    // Normal power up and power down
+    SCENARIO_HEALTHY_PACKS
+    "at 0    ignition on\n"
+    "at 300  expect prechg_enable 1\n"
+    "at 300  expect hvdc_enable 0\n"
+    "at 700  expect precharged 1\n"
+    "at 700  expect hvdc_enable 1\n"
+    "at 700  expect prechg_enable 0\n"
+    "at 700  expect safe 1\n"
+    "at 2000 ignition off\n"
+    "at 2100 expect discharged 1\n"
+    "at 2100 expect hvdc_enable 0\n"
+    "at 2100 expect dischg_disable 0\n"
+    "end 3000\n",
+
+    // Discharge current ramps past the limit while driving
+    SCENARIO_HEALTHY_PACKS
+    "at 0    ignition on\n"
+    "at 1000 current front 120000 over 2000\n"
+    "at 2000 expect over_current 0\n"
+    "at 2900 expect over_current 1\n"
+    "at 2900 expect safe 0\n"
+    "at 2900 expect hvdc_enable 0\n"
+    "end 4000\n",
+
+    // Rear pack sags below its minimum voltage, then recovers
+    SCENARIO_HEALTHY_PACKS
+    "at 0    ignition on\n"
+    "at 1500 voltage rear 45000\n"
+    "at 2100 expect under_voltage 1\n"
+    "at 2100 expect safe 0\n"
+    "at 2100 expect hvdc_enable 0\n"
+    "at 3500 voltage rear 52000\n"
+    "at 4100 expect under_voltage 0\n"
+    "at 4100 expect safe 1\n"
+    "end 5000\n",
+
+    // Driver controls die while driving: HV comes down and stays down until they're back
+    SCENARIO_HEALTHY_PACKS
+    "at 0    ignition on\n"
+    "at 1500 dropout controls 1500\n"
+    "at 1900 expect controls_lost 0\n"
+    "at 1900 expect hvdc_enable 1\n"
+    "at 2100 expect controls_lost 1\n"
+    "at 2100 expect safe 0\n"
+    "at 2100 expect hvdc_enable 0\n"
+    "at 2100 expect discharged 1\n"
+    "at 3100 expect controls_lost 0\n"
+    "end 3500\n",
+
+    // Front IVT goes quiet while driving
+    SCENARIO_HEALTHY_PACKS
+    "at 0    ignition on\n"
+    "at 1500 dropout front 2000\n"
+    "at 2400 expect safe 1\n"
+    "at 2600 expect safe 0\n"
+    "at 2600 expect hvdc_enable 0\n"
+    "end 3000\n",
+
+    // Front IVT power cycles while driving and comes back unconfigured: the BMU reprograms it without
+    // dropping HV
+    SCENARIO_HEALTHY_PACKS
+    "at 0    ignition on\n"
+    "at 1500 restart front\n"
+    "at 2500 expect safe 1\n"
+    "at 2500 expect hvdc_enable 1\n"
+    "end 3000\n",
+
+    // Front pack sags under load past its minimum voltage, with a noisy rear current sensor alongside
+    SCENARIO_HEALTHY_PACKS
+    "at 0    resistance front 200\n"
+    "at 0    noise rear 5000\n"
+    "at 0    ignition on\n"
+    "at 1000 current front 80000\n"
+    "at 1100 expect under_voltage 1\n"
+    "at 1100 expect over_current 0\n"
+    "at 1100 expect safe 0\n"
+    "at 2500 current front 0\n"
+    "at 3100 expect under_voltage 0\n"
+    "end 3500\n",
+};
+
+const int scenario_bench_count = sizeof(scenario_bench) / sizeof(scenario_bench[0]);
@@ -0,0 +1,73 @@
+/*****************************************************************************************************\
+ Line handling and parsing for the debug shell, see shell.h. No hardware dependencies.
+\*****************************************************************************************************/
+
+#include <cstdlib>
+#include <cstring>
+
+#include "shell.h"
+
+const char shell_help[] =
+    "help, status, ivt, cells, can, events, log <0-2>, profile <0-2>, shadow <0|1>, lockstep, checkpoint <n> \n";
+
+static const char *const shell_commands[] = {"help", "status", "ivt", "cells", "can", "events", "log", "profile", "shadow", "lockstep", "checkpoint"};
+
+void shell_init(shell_t *shell)
+{
+    shell->length = 0;
+    shell->overflow = false;
+}
+
+/*****************************************************************************************************\
+ Add one received character. Returns true when it ends a line, which is then in shell->line until the
+ next call. Backspace works; a line that overflowed comes back empty rather than cut short.
+\*****************************************************************************************************/
+bool shell_feed(shell_t *shell, char c)
+{
+    if (c == '\r' || c == '\n')
+    {
+        if (shell->overflow)
+            shell->length = 0;
+        shell->line[shell->length] = '\0';
+        shell->length = 0;
+        shell->overflow = false;
+        return true;
+    }
+    if (c == '\b' || c == 0x7F)
+    {
+        if (shell->length > 0)
+            shell->length--;
+        return false;
+    }
+    if (shell->length < SHELL_LINE - 1)
+        shell->line[shell->length++] = c;
+    else
+        shell->overflow = true;
+    return false;
+}
+
+shell_command_t shell_parse(const char *line, int32_t *argument)
+{
+    while (*line == ' ')
+        line++;
+    if (*line == '\0')
+        return SHELL_NONE;
+
+    size_t word = strcspn(line, " ");
+    for (unsigned i = 0; i < sizeof(shell_commands) / sizeof(shell_commands[0]); i++)
+    {
+        if (strlen(shell_commands[i]) != word || strncmp(line, shell_commands[i], word) != 0)
+            continue;
+        shell_command_t command = (shell_command_t)(SHELL_HELP + i);
+        if (command == SHELL_LOG || command == SHELL_PROFILE || command == SHELL_SHADOW || command == SHELL_CHECKPOINT)
+        {
+            char *end;
+            long value = strtol(line + word, &end, 0);
+            if (end == line + word)
+                return SHELL_UNKNOWN;
+            *argument = (int32_t)value;
+        }
+        return command;
+    }
+    return SHELL_UNKNOWN;
+}
@@ -0,0 +1,127 @@
+/*****************************************************************************************************\
+ State of health tracking for one battery pack.
+
+ The IVT charge counter gives Ah throughput. Whenever the pack has rested long enough for its terminal
+ voltage to settle, the OCV gives an absolute SoC. Two such rest points with a big enough SoC swing
+ between them give a capacity measurement: charge moved / SoC moved. Everything runs incrementally
+ off the latest readings, no sample history is kept.
+\*****************************************************************************************************/
+
+#include <stddef.h>
+
+#include "ocv_table.h"
+#include "soh.h"
+
+void soh_init(soh_state_t *soh, const soh_persist_t *persist)
+{
+    if (persist != NULL && persist->capacity_as > 0)
+        soh->persist = *persist;
+    else
+    {
+        soh->persist.capacity_as = SOH_NOMINAL_CAPACITY_AS;
+        soh->persist.discharge_throughput_as = 0;
+    }
+    soh->net_charge_as = 0;
+    soh->last_charge_as = 0;
+    soh->anchor_charge_as = 0;
+    soh->rest_ms = 0;
+    soh->anchor_soc = 0;
+    soh->soc = 0;
+    soh->have_charge = false;
+    soh->have_anchor = false;
+    soh->dirty = false;
+}
+
+/*****************************************************************************************************\
+ A rest point has just been reached. Use it as a new SoC anchor, and if the previous anchor is far
+ enough away, fold the implied capacity into the estimate.
+\*****************************************************************************************************/
+static void soh_rest_point(soh_state_t *soh, int soc)
+{
+    if (soh->have_anchor)
+    {
+        int delta_soc = soh->anchor_soc - soc;
+        int32_t delta_charge = soh->net_charge_as - soh->anchor_charge_as;
+        // Charge and SoC must have moved the same way, otherwise one of the readings is off
+        if ((delta_soc >= SOH_MIN_DELTA_SOC && delta_charge > 0) || (delta_soc <= -SOH_MIN_DELTA_SOC && delta_charge < 0))
+        {
+            int32_t capacity = (int32_t)((int64_t)delta_charge * 1000 / delta_soc);
+            // Ignore anything wildly outside what the pack could be
+            if (capacity > SOH_NOMINAL_CAPACITY_AS / 2 && capacity < SOH_NOMINAL_CAPACITY_AS * 6 / 5)
+            {
+                soh->persist.capacity_as += (capacity - soh->persist.capacity_as) / SOH_FILTER;
+                soh->dirty = true;
+            }
+        }
+    }
+    soh->anchor_soc = soc;
+    soh->anchor_charge_as = soh->net_charge_as;
+    soh->have_anchor = true;
+}
+
+/*****************************************************************************************************\
+ Called periodically with the latest IVT readings for this pack. temperature is in 0.1 degC, dt_ms is the
+ time since the last call. Calls before the first voltage reading are ignored.
+\*****************************************************************************************************/
+void soh_update(soh_state_t *soh, int charge_as, int current_ma, int pack_voltage_mv, int temperature, uint32_t dt_ms)
+{
+    // Until the IVT has sent its voltage there's nothing to go on; an OCV of 0 would anchor SoC at empty
+    if (pack_voltage_mv <= 0)
+        return;
+
+    bool first_update = !soh->have_charge;
+
+    if (!first_update)
+    {
+        int32_t step = charge_as - soh->last_charge_as;
+        if (step > -SOH_MAX_CHARGE_STEP_AS && step < SOH_MAX_CHARGE_STEP_AS)
+        {
+            soh->net_charge_as += step;
+            if (step > 0)
+                soh->persist.discharge_throughput_as += step;
+        }
+    }
+    soh->last_charge_as = charge_as;
+    soh->have_charge = true;
+
+    if (current_ma < SOH_REST_CURRENT_MA && current_ma > -SOH_REST_CURRENT_MA)
+    {
+        // The pack has been sitting while we were powered off, so the first reading is already a rest point
+        if (first_update)
+            soh->rest_ms = SOH_REST_TIME_MS - dt_ms;
+        // Only take one reading per rest period, when the rest time is first reached
+        if (soh->rest_ms < SOH_REST_TIME_MS && soh->rest_ms + dt_ms >= SOH_REST_TIME_MS)
+            soh_rest_point(soh, ocv_to_soc(pack_voltage_mv / SOH_SERIES_CELLS, temperature));
+        if (soh->rest_ms < SOH_REST_TIME_MS)
+            soh->rest_ms += dt_ms;
+    }
+    else
+        soh->rest_ms = 0;
+
+    // Between rest points, SoC is coulomb counted from the last anchor. A zero capacity means soh_init()
+    // was never called, so fall back to the OCV rather than divide by it
+    if (soh->have_anchor && soh->persist.capacity_as > 0)
+    {
+        int32_t soc = soh->anchor_soc - (int32_t)((int64_t)(soh->net_charge_as - soh->anchor_charge_as) * 1000 / soh->persist.capacity_as);
+        soh->soc = soc < 0 ? 0 : (soc > 1000 ? 1000 : soc);
+    }
+    else
+        soh->soc = ocv_to_soc(pack_voltage_mv / SOH_SERIES_CELLS, temperature);
+}
+
+// SoH in 0.1% of nominal capacity
+int soh_health(const soh_state_t *soh)
+{
+    return (int)((int64_t)soh->persist.capacity_as * 1000 / SOH_NOMINAL_CAPACITY_AS);
+}
+
+int soh_equivalent_cycles_x10(const soh_state_t *soh)
+{
+    return (int)((uint64_t)soh->persist.discharge_throughput_as * 10 / SOH_NOMINAL_CAPACITY_AS);
+}
+
+// Energy left in the pack at nominal voltage, using the measured rather than nameplate capacity
+int soh_usable_energy_wh(const soh_state_t *soh, int cells)
+{
+    return (int)((int64_t)soh->persist.capacity_as * soh->soc / 1000 * SOH_NOMINAL_CELL_VOLTAGE_MV * cells / 1000 / 3600);
+}
@@ -0,0 +1,23 @@
+#include "time_sync.h"
+
+void time_sync_encode_sync(uint8_t sequence, char data[1])
+{
+    data[0] = sequence;
+}
+
+void time_sync_encode_follow_up(uint8_t sequence, uint64_t sync_tx_us, char data[8])
+{
+    data[0] = sequence;
+    data[1] = 0x00;
+    for (int i = 0; i < 6; i++)
+        data[2 + i] = (sync_tx_us >> (40 - i * 8)) & 0xFF;
+}
+
+int64_t time_sync_offset_us(uint64_t sync_rx_local_us, const unsigned char follow_up[8])
+{
+    uint64_t sync_tx_us = 0;
+
+    for (int i = 0; i < 6; i++)
+        sync_tx_us = (sync_tx_us << 8) | follow_up[2 + i];
+    return (int64_t)(sync_tx_us - sync_rx_local_us);
+}